@@ -9,7 +9,9 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/select.h>
-#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/sysinfo.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -36,6 +38,15 @@
 #define CORE_STATISTICS
 #endif
 
+/*
+	Disable interrupts with a thread-local flag, instead of blocking SIGUSR1 
+	(see below). This is only implemented on x86-64, where %fs addresses the
+	thread-local storage. Other targets block SIGUSR1 with pthread_sigmask.
+ */
+#if defined(__x86_64__)
+#define VIRTUAL_INTERRUPT_MASKING
+#endif
+
 
 /*
 	Per-core data.
@@ -46,12 +57,17 @@ typedef struct core
 	interrupt_handler* bootfunc;
 	pthread_t thread;
 
-	struct sigevent timer_sigevent;
-	timer_t timer_id;
+	int timer_fd;                       /* timerfd of the core timer */
+	volatile TimerDuration alarm_deadline;  /* monotonic time the timer expires, or 0 */
+	unsigned long alarm_latency[ALARM_LATENCY_BUCKETS];  /* histogram of ALARM latency */
 
 	volatile uint32_t intr_pending;
 	interrupt_handler* intvec[maximum_interrupt_no];
 
+	/* Bit vectors of the serial ports with a pending SERIAL_RX_READY 
+	   and SERIAL_TX_READY interrupt, indexed by io_direction */
+	volatile uint32_t serial_pending[2];
+
 
 #if defined(CORE_STATISTICS)
 	/* Statistics */
@@ -73,12 +89,6 @@ static sigset_t core_signal_set;
 /* Uset to store the singleton set containing SIGUSR1 */
 static sigset_t sigusr1_set;
 
-/* Uset to store the singleton set containing SIGALRM */
-static sigset_t sigalrm_set;
-
-/* Used to create the signalfd */
-static sigset_t signalfd_set;
-
 /* Array of Core objects, one per core */
 static Core CORE[MAX_CORES];
 
@@ -94,8 +104,14 @@ static volatile sig_atomic_t PIC_active;
 /* Bit vector denoting halted cores */
 static _Atomic uint32_t halt_vector;
 
-/* PIC thread id */
-static pthread_t PIC_thread;
+/* The number of cores of the last VM run */
+static uint last_ncores;
+
+/* The epoll instance of the PIC daemon */
+static int PIC_epoll_fd;
+
+/* An eventfd, written to wake up the PIC daemon */
+static int PIC_kick_fd;
 
 /* Save the sigaction for SIGUSR1 */
 static struct sigaction USR1_saved_sigaction;
@@ -124,6 +140,14 @@ static void initialize()
 
 	USR1_sigaction.sa_sigaction = sigusr1_handler;
 	USR1_sigaction.sa_flags = SA_SIGINFO;
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+	/* 
+		Do not block SIGUSR1 in the handler. The handler may switch to a
+		different thread, which would then run with SIGUSR1 blocked, since 
+		the signal mask is only restored when the handler returns.
+	 */
+	USR1_sigaction.sa_flags |= SA_NODEFER;
+#endif
 	sigemptyset(& USR1_sigaction.sa_mask);
 
 	/* Create the sigmask to block all signals, except USR1 */
@@ -134,15 +158,6 @@ static void initialize()
 	CHECK(sigemptyset(&sigusr1_set));
 	CHECK(sigaddset(&sigusr1_set, SIGUSR1));
 
-	/* Create the mask for  SIGALRM */
-	CHECK(sigemptyset(&sigalrm_set));
-	CHECK(sigaddset(&sigalrm_set, SIGALRM));
-
-
-	/* Create signaldf_set */
-	CHECK(sigemptyset(&signalfd_set));
-	CHECK(sigaddset(&signalfd_set, SIGUSR1));
-	CHECK(sigaddset(&signalfd_set, SIGALRM));
 }
 
 
@@ -158,15 +173,62 @@ static inline Core* curr_core() {
 
 
 /*
-	Cause PIC daemon to loop. This needs to happen when we wish 
-	the PIC daemon to refresh the list of fds it is polling.
+	Virtual interrupt masking.
+
+	Disabling interrupts by blocking SIGUSR1 costs a system call. Instead, 
+	each core thread keeps a thread-local flag, which is non-zero while 
+	interrupts are disabled. SIGUSR1 stays unblocked; when it arrives 
+	while the flag is set, the handler returns at once, leaving the 
+	interrupt pending in the core's intr_pending vector. The pending 
+	interrupts are dispatched when interrupts are re-enabled.
+
+	A thread may be switched to a different core whenever interrupts are
+	enabled. Therefore, the flag must be read or written with a single
+	instruction that addresses the thread-local storage of the current core,
+	and never through a pointer computed earlier. A thread that is switched
+	away with interrupts enabled always resumes with interrupts enabled, so
+	a read followed by a write (as in cpu_disable_interrupts) is safe.
+
+	See VIRTUAL_INTERRUPT_MASKING above.
+ */
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+
+static _Thread_local volatile int intr_disabled __attribute__((used));
+
+static inline int vintr_get()
+{
+	int v;
+	__asm__ volatile ("movl %%fs:intr_disabled@tpoff, %0" : "=r" (v) : : "memory");
+	return v;
+}
+
+static inline void vintr_set(int v)
+{
+	__asm__ volatile ("movl %0, %%fs:intr_disabled@tpoff" : : "r" (v) : "memory");
+}
+
+static inline void dispatch_interrupts(Core* core);
+
+/* Enable interrupts and dispatch the interrupts that were deferred */
+static inline void vintr_enable()
+{
+	vintr_set(0);
+	while(curr_core()->intr_pending) {
+		vintr_set(1);
+		dispatch_interrupts(curr_core());
+		vintr_set(0);
+	}
+}
+#endif
+
+
+/*
+	Cause PIC daemon to loop. 
  */
 static inline void interrupt_pic_thread()
 {
-	union sigval coreval;
-	coreval.sival_ptr = NULL; /* This is silly, but silences valgrind */
-	coreval.sival_int = -1;
-	CHECKRC(pthread_sigqueue(PIC_thread, SIGUSR1, coreval));
+	uint64_t one = 1;
+	CHECK(write(PIC_kick_fd, &one, sizeof(one)));
 }
 
 
@@ -178,8 +240,9 @@ static void* core_thread(void* _core)
 {
 	Core* core = (Core*)_core;
 
-	/* Clear pending bitvec */
+	/* Clear pending bitvecs */
 	core->intr_pending = 0;
+	core->serial_pending[0] = core->serial_pending[1] = 0;
 
 	/* Default interrupt handlers */
 	for(int i=0; i<maximum_interrupt_no; i++) 
@@ -190,13 +253,6 @@ static void* core_thread(void* _core)
 	/* Set core signal mask */
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &core_signal_set, NULL));
 
-	/* create a thread-specific timer */
-	core->timer_sigevent.sigev_notify = SIGEV_SIGNAL;
-	core->timer_sigevent.sigev_signo = SIGALRM;
-	core->timer_sigevent.sigev_value.sival_int = core->id;
-	// Could also be CLOCK_REALTIME
-	CHECK(timer_create(CLOCK_MONOTONIC, & core->timer_sigevent, & core->timer_id));
-
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
@@ -208,8 +264,8 @@ static void* core_thread(void* _core)
 		core->intvec[i] = NULL;
 	}		
 
-	/* Delete the core timer */
-	CHECK(timer_delete(core->timer_id));
+	/* Stop the core timer */
+	bios_cancel_timer();
 
 	pthread_barrier_wait(& core_barrier);
 
@@ -309,6 +365,31 @@ static inline void raise_interrupt(Core* core, Interrupt intno)
 
 
 
+/* Monotonic clock, in usec */
+static inline TimerDuration get_monotonic_time()
+{
+	struct timespec curtime;
+	CHECK(clock_gettime(CLOCK_MONOTONIC, &curtime));
+	return curtime.tv_nsec / 1000ul + curtime.tv_sec*1000000ull;
+}
+
+/* 
+	Add the delay from the expiration of the core timer to the dispatch 
+	of the ALARM interrupt to the core's latency histogram.
+ */
+static inline void alarm_latency_record(Core* core)
+{
+	TimerDuration deadline = core->alarm_deadline;
+	if(deadline == 0) return;  /* The timer was cancelled */
+
+	TimerDuration now = get_monotonic_time();
+	TimerDuration lat = (now > deadline) ? now - deadline : 0;
+	uint b = (lat == 0) ? 0 : 64 - __builtin_clzll(lat);
+	if(b >= ALARM_LATENCY_BUCKETS) b = ALARM_LATENCY_BUCKETS-1;
+	core->alarm_latency[b]++;
+}
+
+
 /*
 	Dispatch any pending interrupts, lowest first.
 	Cease if an interrupt causes core change.
@@ -326,6 +407,8 @@ static inline void dispatch_interrupts(Core* core)
 #if defined(CORE_STATISTICS)
 		core->irq_delivered[irq]++;
 #endif
+		if(irq == ALARM) alarm_latency_record(core);
+
 		interrupt_handler* handler =  core->intvec[irq];
 		if(handler != NULL) handler();
 	
@@ -353,7 +436,19 @@ static void sigusr1_handler(int signo, siginfo_t* si, void* ctx)
 	core->irq_count++;
 #endif
 
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+	/* Interrupts are disabled, leave them pending */
+	if(vintr_get()) return;
+
+	/* Interrupts are disabled while the handlers run, as if SIGUSR1 was blocked */
+	vintr_set(1);
+	dispatch_interrupts(core);
+
+	/* We may be on a different core now */
+	vintr_enable();
+#else
 	dispatch_interrupts(core);
+#endif
 }
 
 
@@ -386,9 +481,9 @@ static TimerDuration get_coarse_time()
 	by this program (bidirectional fds, such as sockets, can be handled by a pair of
 	io_device objects).  
 
-	An io_device is ready if I/O operations may succeed (as reported by select()).
+	An io_device is ready if I/O operations may succeed (as reported by epoll).
 
-	A not-ready device is made ready when select() returns it as such.
+	A not-ready device is made ready when epoll reports it as such.
 
 	A ready device is made not-ready on each failed attempt to do an I/O transfer.
 
@@ -475,42 +570,58 @@ static int io_device_destroy(io_device* this)
 }
 
 
-static int io_device_read(io_device* this, char* ptr)
+/*
+	Transfer up to 'size' bytes with a single host call, returning the
+	number transferred. The device is made not-ready when less than
+	'size' bytes can be transferred, since the next transfer would fail.
+ */
+static unsigned int io_device_read_block(io_device* this, char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_RX);
-	int rc;
-	while((rc=read(this->fd, ptr, 1))==-1 && errno == EINTR);
+	if(size==0) return 0;
 
-	int ok = rc==0 || rc==1 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
+	ssize_t rc;
+	while((rc=read(this->fd, buf, size))==-1 && errno == EINTR);
+
+	int ok = rc>=0 || (rc==-1 && (errno==EAGAIN || errno==EWOULDBLOCK));
 	if(!ok) perror("io_device_read:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
+	if(rc < (ssize_t)size && this->ready)
 		this->ready = 0;
-		interrupt_pic_thread();
-	}
-	return rc==1;
+	return (rc > 0) ? rc : 0;
 }
 
 
-static int io_device_write(io_device* this, char value)
+static unsigned int io_device_write_block(io_device* this, const char* buf, unsigned int size)
 {
 	assert(this->iodir == IODIR_TX);
+	if(size==0) return 0;
 
 	/* Try to write */
-	int rc;
-	while((rc = write(this->fd, &value, 1))==-1 && errno == EINTR);
+	ssize_t rc;
+	while((rc = write(this->fd, buf, size))==-1 && errno == EINTR);
 
-	int ok = rc==1 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
+	int ok = rc>=0 || (rc==-1 && (errno == EAGAIN || errno==EWOULDBLOCK || errno == EPIPE));
 	if(! ok) perror("io_device_write:");
 	assert(ok);
 
-	if(rc!=1 && this->ready) {
+	if(rc < (ssize_t)size && this->ready)
 		this->ready = 0;
-		interrupt_pic_thread();
-	} 
 
-	return rc==1;
+	return (rc > 0) ? rc : 0;
+}
+
+
+static int io_device_read(io_device* this, char* ptr)
+{
+	return io_device_read_block(this, ptr, 1);
+}
+
+
+static int io_device_write(io_device* this, char value)
+{
+	return io_device_write_block(this, &value, 1);
 }
 
 
@@ -563,157 +674,68 @@ static int terminal_destroy(terminal* this)
 		io_device becomes ready.
 
 	Implementation:
-	- Use Linux signal file descriptors to receive signals. Currently,
-	  two signals are used:
-	  * SIGUSR1 is sent by io_device to signify that some io_device is NOT READY.
-	    Otherwise it is discarded. The signal simply wakes up the PIC_daemon thread.
-	    This however causes the PIC loop to include the devices to the ones monitored.
+	- All event sources are registered once, in an epoll instance:
+	  * the timerfd of each core, which becomes readable when the core 
+	    timer expires. This results in an ALARM interrupt on the core.
+	  * an eventfd, which is written to wake up the PIC daemon (used 
+	    to stop it).
+	  * the fds of the terminals, in edge-triggered mode. An io_device
+	    becomes not-ready when a transfer fails with EAGAIN, i.e., exactly
+	    when the next edge will be reported by epoll.
 
-	  * SIGALRM is sent to indicate that some core timer has expired. This
-	    results to an interrupt on the core.
-
-	- Monitor these fds together with the fds of the terminals.
-	
 	- At each loop dispatch interrupts as needed:
 	  * ALARM interrupts to those cores whose timer has expired
 	  * SERIAL_RX/TX_READY to those cores handling the interrupts of
-	    an io_device which is now READY.		
- */
-
-
-
-/******************************
-
-	Helpers for signal fds
-
- ******************************/
-
-
-static inline int read_signalfd(int sfd, struct signalfd_siginfo* sfdinfo)
-{
-	int rc = read(sfd, sfdinfo, sizeof(struct signalfd_siginfo));
-
-	assert( (rc==-1 || rc==sizeof(struct signalfd_siginfo))
-		&&  (rc!=-1 || errno==EAGAIN || errno==EWOULDBLOCK) );
-
-	return rc;
-}
-
-static inline void drain_signalfd(int sfd)
-{
-	struct signalfd_siginfo sfdinfo;
-	while(read_signalfd(sfd, &sfdinfo)!=-1);
-}
-
-
-static int open_signalfd(sigset_t* set)
-{
-	int fd = signalfd(-1, set, SFD_NONBLOCK);
-	CHECK(fd);
-	return fd;
-}
-
-static void close_signalfd(int sfd)
-{
-	drain_signalfd(sfd);
-	CHECK(close(sfd));
-}
-
-
-
-/********************************
-
-	PIC loop state and helpers
-
- ********************************/
-
-typedef struct pic_selector
-{
-	fd_set fds[2];
-	int maxfd;
-	TimerDuration system_clock;
-} pic_selector;
-
-
-static void pic_selector_reset(pic_selector* ps)
-{
-	FD_ZERO(& ps->fds[0]);
-	FD_ZERO(& ps->fds[1]);
-	ps->maxfd = 0;
-}
-
-
-static inline void pic_add_fd(pic_selector* ps, io_direction dir, int fd)
-{
-	FD_SET(fd, ps->fds + dir);
-	if(fd >= ps->maxfd) ps->maxfd = fd+1;
-}
-
-
+	    an io_device which is now READY. 
 
-static int pic_select(pic_selector* ps)
-{
-	/* select will sleep for about SLOW_HZ usec (half the system_clock res.) */
-	struct timeval sleeptime = { .tv_sec=0, .tv_usec = SERIAL_TIMEOUT };
-	int selcode = select(ps->maxfd, &ps->fds[IODIR_RX], &ps->fds[IODIR_TX], NULL, &sleeptime);
-
-	if(selcode == -1)  {
-		/* An error is likely EINTR */
-		if(errno != EINTR)  perror("PIC_loops: "); else perror("PIC_select:");
-	} else {
-		/* update system clock */
-		ps->system_clock = get_coarse_time();
-	}
-	return selcode;
-}
-
-
-static inline int pic_is_ready(pic_selector* ps, io_direction dir, int fd)
-{
-	return FD_ISSET(fd, & ps->fds[dir]);
-}
+	- As a safety net, a not-ready io_device raises an interrupt every 
+	  SERIAL_TIMEOUT usec.
+ */
 
+/* Kinds of epoll events, stored in the high word of epoll_event.data.u64 */
+enum { PIC_KICK, PIC_TIMER, PIC_DEVICE };
+#define PIC_EVENT(kind, index)  ( ((uint64_t)(kind) << 32) | (index) )
 
+/* The max. number of events returned by one epoll_wait() */
+#define PIC_MAX_EVENTS  (MAX_CORES + 2*MAX_TERMINALS + 1)
 
 
-static inline void pic_add_io_device(pic_selector* ps, io_device* dev)
+static void pic_register(int fd, uint32_t events, uint64_t data)
 {
-	if(! dev->ready) pic_add_fd(ps, dev->iodir, dev->fd);
+	struct epoll_event ev = { .events = events, .data.u64 = data };
+	CHECK(epoll_ctl(PIC_epoll_fd, EPOLL_CTL_ADD, fd, &ev));
 }
 
 
-static inline void pic_add_terminal(pic_selector* ps, terminal* term)
-{
-	/* First check that terminal is connected, without blocking.
-	   This is done by polling for errors on the kbd device. */
-	if(io_device_check(& term->kbd)) {
-		pic_add_io_device(ps, & term->kbd);
-		pic_add_io_device(ps, & term->con);
-	}
-}
-
+static inline io_device* pic_device(uint index);
 
-static void term_dev_raise_if_ready(io_device* dev, pic_selector* ps)
+static void pic_device_ready(uint index, TimerDuration system_clock)
 {
-	if(    pic_is_ready(ps, dev->iodir, dev->fd) 
-		|| (ps->system_clock - dev->last_int) > SERIAL_TIMEOUT 
-		)
-	{
-		dev->ready = 1;
-		dev->last_int = ps->system_clock;
-		Core* core = (Core*) dev->int_core;
-		switch(dev->iodir) {
-			case IODIR_RX:
-				raise_interrupt(core, SERIAL_RX_READY); break;
-			case IODIR_TX:
-				raise_interrupt(core, SERIAL_TX_READY); break;
-		}
+	io_device* dev = pic_device(index);
+
+	/* 
+	   Raise the interrupt even if the device is marked ready, since it may 
+	   have been marked not-ready after the edge was reported.
+	 */
+	dev->ready = 1;
+	dev->last_int = system_clock;
+	Core* core = (Core*) dev->int_core;
+
+	/* 
+	   Mark the serial port as pending before raising the interrupt. The 
+	   interrupt is cleared before its handler runs, so a port marked after 
+	   the handler has taken the pending ports raises the interrupt again.
+	 */
+	__atomic_fetch_or(& core->serial_pending[dev->iodir], 1u << (index/2), __ATOMIC_ACQ_REL);
+	switch(dev->iodir) {
+		case IODIR_RX:
+			raise_interrupt(core, SERIAL_RX_READY); break;
+		case IODIR_TX:
+			raise_interrupt(core, SERIAL_TX_READY); break;
 	}
 }
 
 
-
-
 static void PIC_daemon(void)
 {
 
@@ -722,13 +744,20 @@ static void PIC_daemon(void)
 	CHECKRC(pthread_getname_np(pthread_self(), oldname, 16));
 	CHECKRC(pthread_setname_np(pthread_self(), "tinyos_vm"));
 
-	/* Open signal queues */
-	int sigusr1fd = open_signalfd(&sigusr1_set);
-	int sigalrmfd = open_signalfd(&sigalrm_set);
+	/* Register the event sources */
+	pic_register(PIC_kick_fd, EPOLLIN, PIC_EVENT(PIC_KICK, 0));
+	for(uint c=0; c<ncores; c++)
+		pic_register(CORE[c].timer_fd, EPOLLIN, PIC_EVENT(PIC_TIMER, c));
+	for(uint i=0; i<nterm; i++) {
+		/* First check that terminal is connected, without blocking. */
+		if(io_device_check(& TERM[i].kbd)) {
+			pic_register(TERM[i].kbd.fd, EPOLLIN | EPOLLET, PIC_EVENT(PIC_DEVICE, 2*i));
+			pic_register(TERM[i].con.fd, EPOLLOUT | EPOLLET, PIC_EVENT(PIC_DEVICE, 2*i+1));
+		}
+	}
 
-	/* Set signal mask to block the signals monitored by signalfd */
-	sigset_t saved_mask;
-	CHECKRC(pthread_sigmask(SIG_BLOCK, &signalfd_set, &saved_mask));
+	/* Without terminals, there is no need for a timeout */
+	int timeout = (nterm > 0) ? SERIAL_TIMEOUT/1000 : -1;
 		
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
@@ -736,62 +765,60 @@ static void PIC_daemon(void)
 	/* The PIC multiplexing loop */
 	while(PIC_active) {
 
-		pic_selector ps;
-
-		pic_selector_reset(&ps);
-
-		for(uint i=0; i<nterm; i++)
-			pic_add_terminal(&ps, & TERM[i]);
-
-		pic_add_fd(&ps, IODIR_RX, sigalrmfd);
-		pic_add_fd(&ps, IODIR_RX, sigusr1fd);
-
-		if(pic_select(&ps) == -1)
+		struct epoll_event events[PIC_MAX_EVENTS];
+		int nevents = epoll_wait(PIC_epoll_fd, events, PIC_MAX_EVENTS, timeout);
+		if(nevents == -1) {
+			/* An error is likely EINTR */
+			if(errno != EINTR) perror("PIC_loops: ");
 			continue;
+		}
 
 		PIC_loops++ ;
-
-		if( pic_is_ready(&ps, IODIR_RX, sigalrmfd)!=-1 ) {
-			struct signalfd_siginfo sfdinfo;
-
-			while(read_signalfd(sigalrmfd, &sfdinfo) != -1) {
-				Core* core = & CORE[sfdinfo.ssi_int];
-				raise_interrupt(core, ALARM);
+		TimerDuration system_clock = get_coarse_time();
+
+		for(int e=0; e<nevents; e++) {
+			uint kind = events[e].data.u64 >> 32;
+			uint index = events[e].data.u64 & 0xffffffff;
+			uint64_t count;
+
+			switch(kind) {
+			case PIC_KICK:
+				while(read(PIC_kick_fd, &count, sizeof(count)) == -1 && errno == EINTR);
+				break;
+			case PIC_TIMER:
+				/* This fails with EAGAIN if the core has reset the timer meanwhile */
+				if(read(CORE[index].timer_fd, &count, sizeof(count)) == sizeof(count))
+					raise_interrupt(& CORE[index], ALARM);
+				break;
+			case PIC_DEVICE:
+				pic_device_ready(index, system_clock);
+				break;
 			}
 		}
 
-
-		if( pic_is_ready(&ps, IODIR_RX, sigusr1fd)!=-1 ) {
-			drain_signalfd(sigusr1fd);
+		/* The safety net for lost interrupts */
+		for(uint i=0; i<2*nterm; i++) {
+			io_device* dev = pic_device(i);
+			if(! dev->ready && (system_clock - dev->last_int) > SERIAL_TIMEOUT)
+				pic_device_ready(i, system_clock);
 		}
 
-
-		for(uint i=0; i<nterm; i++) {
-			terminal* term = & TERM[i];			
-
-			term_dev_raise_if_ready(& term->con, &ps);
-			term_dev_raise_if_ready(& term->kbd, &ps);
-		}
-
-
 	}
 
 
 	/* sync with all cores */
 	pthread_barrier_wait(& system_barrier);
 
-	/* Close signal fds */
-	close_signalfd(sigusr1fd);
-	close_signalfd(sigalrmfd);
-
-	/* Restore sigmask */
-	CHECKRC(pthread_sigmask(SIG_SETMASK, &saved_mask, NULL));
-
 	/* Reset name */
 	CHECKRC(pthread_setname_np(pthread_self(), oldname));
 }
 
 
+static inline io_device* pic_device(uint index)
+{
+	return (index & 1) ? & TERM[index/2].con : & TERM[index/2].kbd;
+}
+
 
 
 /*****************************************
@@ -884,9 +911,12 @@ void vm_run(vm_config* vmc)
 	CHECK(sigaction(SIGUSR1, &USR1_sigaction, &USR1_saved_sigaction));
 
 	/* Set pic_active to 1 */
-	PIC_thread = pthread_self();
 	PIC_active = 1;	
 
+	/* Create the PIC epoll instance and kick eventfd */
+	CHECK(PIC_epoll_fd = epoll_create1(EPOLL_CLOEXEC));
+	CHECK(PIC_kick_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC));
+
 	/* Initialize terminals */
 	nterm = vmc->serialno;
 	for(uint i=0; i<nterm; i++)
@@ -908,6 +938,11 @@ void vm_run(vm_config* vmc)
 		CORE[c].bootfunc = vmc->bootfunc;
 		CORE[c].id = c;
 
+		/* Create the core timer */
+		CHECK(CORE[c].timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+		CORE[c].alarm_deadline = 0;
+		for(uint b=0; b<ALARM_LATENCY_BUCKETS; b++)
+			CORE[c].alarm_latency[b] = 0;
 
 #if defined(CORE_STATISTICS)
 		/* Initialize Core statistics */
@@ -942,8 +977,16 @@ void vm_run(vm_config* vmc)
 #if defined(CORE_STATISTICS)
 		CORE[c].run_time = get_coarse_time() - CORE[c].run_time;
 #endif
+		CHECK(close(CORE[c].timer_fd));
 	}
 
+	/* Close the PIC fds */
+	CHECK(close(PIC_kick_fd));
+	CHECK(close(PIC_epoll_fd));
+
+	/* Remember the number of cores, for vm_alarm_latency() */
+	last_ncores = ncores;
+
 	/* Delete the Core table */
 	ncores = 0;
 
@@ -996,6 +1039,9 @@ uint cpu_cores()
 
 void cpu_core_halt()
 {
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+	vintr_set(1);
+#endif
 	CHECKRC(pthread_sigmask(SIG_BLOCK, &sigusr1_set, NULL));
 
 	Core* core = curr_core();
@@ -1014,10 +1060,18 @@ void cpu_core_halt()
 
 	siginfo_t info;
 
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+	/* 
+		Interrupts deferred while interrupts were disabled have no signal
+		pending, so do not wait for one.
+	 */
+	int rc = core->intr_pending ? SIGUSR1 : sigwaitinfo(&sigusr1_set, &info);
+#else
 	/* Sleep for 10 msec */
 	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
 	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
 	int rc = sigwaitinfo(&sigusr1_set, &info);
+#endif
 
 	if(rc>0) {
 		/* Got signal, dispatch */
@@ -1035,6 +1089,9 @@ void cpu_core_halt()
 	__atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
 
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+	vintr_enable();
+#endif
 }
 
 static int __core_restart(uint c)
@@ -1090,6 +1147,34 @@ void cpu_ici(uint core)
 	raise_interrupt(& CORE[core], ICI);
 }
 
+#if defined(VIRTUAL_INTERRUPT_MASKING)
+
+void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
+{
+	int enabled = cpu_disable_interrupts();
+	curr_core()->intvec[interrupt] = handler;
+	if(enabled) cpu_enable_interrupts();
+}
+
+int cpu_interrupts_enabled()
+{
+	return vintr_get()==0;
+}
+
+int cpu_disable_interrupts()
+{
+	int disabled = vintr_get();
+	vintr_set(1);
+	return disabled==0;
+}
+
+void cpu_enable_interrupts()
+{
+	vintr_enable();
+}
+
+#else
+
 void cpu_interrupt_handler(Interrupt interrupt, interrupt_handler handler)
 {
 	sigset_t curss;
@@ -1117,29 +1202,122 @@ void cpu_enable_interrupts()
 	CHECKRC(pthread_sigmask(SIG_UNBLOCK, &sigusr1_set, NULL));
 }
 
+#endif
+
+
+/*
+	Context switching.
+
+	glibc's swapcontext() saves and restores the signal mask, which costs a
+	rt_sigprocmask system call at every switch. Since the kernel switches 
+	contexts with interrupts disabled, the signal mask is the same before and 
+	after every switch, so we only save the registers that the ABI requires
+	a function call to preserve.
+ */
+#if defined(__x86_64__)
+
+/*
+	cpu_switch_stack(void** save_sp, void* load_sp)
+
+	Push the callee-saved registers, the SSE control/status register and the
+	x87 control word on the current stack, save the stack pointer in *save_sp, 
+	switch to load_sp and pop the same from there.
+ */
+void cpu_switch_stack(void** save_sp, void* load_sp);
+__asm__(
+	".text\n"
+	".p2align 4\n"
+	".type cpu_switch_stack, @function\n"
+	"cpu_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_switch_stack, .-cpu_switch_stack\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* 
+	  Build the frame that cpu_switch_stack pops, so that it 'returns' into
+	  ctx_func, as if ctx_func had been called with a null return address.
+	 */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* sp = (uint64_t*) top;
+
+	*--sp = 0;						/* return address of ctx_func */
+	*--sp = (uintptr_t) ctx_func;	/* popped by ret */
+	for(int i=0; i<6; i++) 
+		*--sp = 0;					/* rbp, rbx, r12-r15 */
+	--sp;
+	__asm__ volatile ("stmxcsr %0" : "=m" (*(uint32_t*)sp));
+	__asm__ volatile ("fnstcw %0" : "=m" (*((uint16_t*)sp + 2)));
+
+	ctx->sp = sp;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_switch_stack(&oldctx->sp, newctx->sp);
+}
+
+#else
 
+/*
+	The generic version uses _setjmp/_longjmp, which do not touch the signal
+	mask. A new context is entered once by setcontext(), to get on its stack.
+ */
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
-  getcontext(ctx);
-  ctx->uc_link = NULL;
+  getcontext(&ctx->uc);
+  ctx->uc.uc_link = NULL;
 
   /* initialize the context stack */
-  ctx->uc_stack.ss_sp = ss_sp;
-  ctx->uc_stack.ss_size = ss_size;
-  ctx->uc_stack.ss_flags = 0;
-
-  //CHECKRC(pthread_sigmask(0, NULL, & ctx->uc_sigmask));  /* We don't want any signals changed */
-  sigfillset( & ctx->uc_sigmask );
-  makecontext(ctx, (void*) ctx_func, 0);
+  ctx->uc.uc_stack.ss_sp = ss_sp;
+  ctx->uc.uc_stack.ss_size = ss_size;
+  ctx->uc.uc_stack.ss_flags = 0;
+
+  /* Start with all signals blocked; gain() will enable interrupts */
+  sigfillset( & ctx->uc.uc_sigmask );
+  makecontext(&ctx->uc, (void*) ctx_func, 0);
+  ctx->started = 0;
 }
 
 
 void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 {
-	swapcontext(oldctx, newctx);
+	oldctx->started = 1;
+	if(_setjmp(oldctx->jb) == 0) {
+		if(newctx->started)
+			_longjmp(newctx->jb, 1);
+		else {
+			newctx->started = 1;
+			setcontext(&newctx->uc);
+		}
+	}
 }
 
+#endif
+
 
 
 /*
@@ -1158,8 +1336,10 @@ TimerDuration bios_set_timer(TimerDuration usec)
 	};
 
 	struct itimerspec oldtime;
-	
-	timer_settime(curr_core()->timer_id, 0, &newtime, &oldtime);
+
+	Core* core = curr_core();
+	core->alarm_deadline = (usec==0) ? 0 : get_monotonic_time() + usec;
+	CHECK(timerfd_settime(core->timer_fd, 0, &newtime, &oldtime));
 
 	assert(oldtime.it_interval.tv_sec ==0 && oldtime.it_interval.tv_nsec==0);
 	return 1000000*oldtime.it_value.tv_sec + oldtime.it_value.tv_nsec/1000ull;
@@ -1171,6 +1351,16 @@ TimerDuration bios_cancel_timer()
 }
 
 
+void vm_alarm_latency(unsigned long hist[ALARM_LATENCY_BUCKETS])
+{
+	for(uint b=0; b<ALARM_LATENCY_BUCKETS; b++) {
+		hist[b] = 0;
+		for(uint c=0; c<last_ncores; c++)
+			hist[b] += CORE[c].alarm_latency[b];
+	}
+}
+
+
 TimerDuration bios_clock()
 {
 	return get_coarse_time();
@@ -1203,6 +1393,18 @@ void bios_serial_interrupt_core(uint serial, Interrupt intno, uint coreid)
 }
 
 
+/*
+	Return the serial ports with a pending interrupt 'intno' on the calling 
+	core, and clear them.
+ */
+uint bios_serial_pending(Interrupt intno)
+{
+	if(!(intno==SERIAL_RX_READY || intno==SERIAL_TX_READY)) return 0;
+	io_direction dir = (intno==SERIAL_RX_READY) ? IODIR_RX : IODIR_TX;
+	return __atomic_exchange_n(& curr_core()->serial_pending[dir], 0, __ATOMIC_ACQ_REL);
+}
+
+
 /*
 	Try to read a byte from serial port 'serial' and store it into the location
 	pointed by 'ptr'.  If the operation succeds, 1 is returned. If not, 0 is returned.
@@ -1223,3 +1425,23 @@ int bios_write_serial(uint serial, char value)
 }
 
 
+/*
+	Try to read up to 'size' bytes from serial port 'serial' into 'buf',
+	with a single host call. Return the number of bytes read.
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size)
+{
+	return io_device_read_block(& TERM[serial].kbd, buf, size);
+}
+
+
+/*
+	Try to write up to 'size' bytes from 'buf' to serial port 'serial',
+	with a single host call. Return the number of bytes written.
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size)
+{
+	return io_device_write_block(& TERM[serial].con, buf, size);
+}
+
+
@@ -2,6 +2,7 @@
 #define BIOS_H
 
 #include <stdint.h>
+#include <setjmp.h>
 #include <ucontext.h>
 
 /**
@@ -95,9 +96,17 @@
 	which is ready, the write will succeed. When a non-ready device becomes ready,
 	a @c SERIAL_TX_READY interrupt is raised.
 
+	Blocks of bytes can also be read and written, by 
+	@c bios_read_serial_block and @c bios_write_serial_block, with a single
+	transfer each. A block transfer may be partial; in this case the device 
+	has become not-ready.
+
 	Also, each interrupt is sent if the serial device timeouts (is inactive for
 	about 300 msec).
 
+	The interrupts of all serial ports share the same handler. The handler
+	can find the ports which raised its interrupt by @c bios_serial_pending.
+
  */
 
 
@@ -263,6 +272,24 @@ void vm_configure(vm_config* vmc, interrupt_handler bootfunc, uint cores, uint s
 void vm_run(vm_config* vmc);
 
 
+/** @brief The number of buckets of the ALARM latency histogram. */
+#define ALARM_LATENCY_BUCKETS 20
+
+/**
+	@brief Return the ALARM latency histogram of the last VM run.
+
+	For each ALARM interrupt delivered, the VM measures the delay from the 
+	expiration of the core timer to the call of the interrupt handler.
+	Bucket 0 counts delays under 1 usec; bucket @c b>0 counts delays in 
+	the range \f$ [2^{b-1}, 2^b) \f$ usec. The last bucket also counts all 
+	larger delays. The histogram is summed over all cores.
+
+	@param hist the array filled with the histogram
+	@see vm_run
+ */
+void vm_alarm_latency(unsigned long hist[ALARM_LATENCY_BUCKETS]);
+
+
 
 
 /**
@@ -407,8 +434,22 @@ void cpu_core_restart_all();
 
 /**
 	@brief A type for saving CPU context into.
+
+	A context holds only the registers that are preserved across a function
+	call. The signal mask (and therefore the interrupt state) is not part of 
+	the context: it is left unchanged by @c cpu_swap_context(). 
 */
-typedef ucontext_t cpu_context_t;
+#if defined(__x86_64__)
+typedef struct {
+	void* sp;		/**< @brief The saved stack pointer. The registers are saved on the stack */
+} cpu_context_t;
+#else
+typedef struct {
+	jmp_buf jb;		/**< @brief The saved registers */
+	ucontext_t uc;	/**< @brief Used to enter a new context for the first time */
+	int started;	/**< @brief Non-zero once @c jb holds a valid context */
+} cpu_context_t;
+#endif
 
 
 /**
@@ -430,6 +471,11 @@ void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, voi
 	Save the current context into @c oldctx and load the contents of @c newctx
 	into the CPU.
 
+	The signal mask is not saved or restored, so that no system call is needed.
+	Therefore, contexts should only be switched with interrupts disabled, so that
+	every context resumes with interrupts disabled. A new context starts 
+	with the signal mask of the core that first switches to it.
+
 	@param oldctx pointer to the storage for the old context
 	@param newctx pointer to the new context to be loaded
 */
@@ -512,6 +558,25 @@ uint bios_serial_ports();
 void bios_serial_interrupt_core(uint serial, Interrupt intno, uint core);
 
 
+/**
+	@brief Return the serial ports which raised an interrupt.
+
+	Return a bit mask of the serial ports which raised interrupt @c intno 
+	(one of @c SERIAL_RX_READY and @c SERIAL_TX_READY) to the calling core,
+	since the last call. Bit @c i is set for serial port @c i. The returned
+	ports are cleared.
+
+	This is meant to be called by the interrupt handler, so that it serves
+	only the ports which became ready. A port which becomes ready after the
+	call raises the interrupt again. The handler may find no ports, when
+	they were returned by an earlier call.
+
+	@param intno the interrupt (one of @c SERIAL_RX_READY and @c SERIAL_TX_READY)
+	@return the bit mask of the serial ports, or 0 if @c intno is illegal
+ */
+uint bios_serial_pending(Interrupt intno);
+
+
 /**
 	@brief Read a byte from a serial port.
 
@@ -546,4 +611,42 @@ int bios_read_serial(uint serial, char* ptr);
 int bios_write_serial(uint serial, char value);
 
 
+/**
+	@brief Read a block of bytes from a serial port.
+
+	Try to read up to @c size bytes from serial port @c serial into
+	@c buf, and return the number of bytes read. This is like calling 
+	@c bios_read_serial repeatedly until it fails (or @c size bytes are
+	read), but it costs a single transfer.
+
+	If this operation returns less than @c size, a @c SERIAL_RX_READY
+	interrupt will be raised when more data is ready to be received.
+
+	@param serial the serial device to read from
+	@param buf the location in which to store the bytes read
+	@param size the maximum number of bytes to read
+	@return the number of bytes read, which may be 0
+ */
+uint bios_read_serial_block(uint serial, char* buf, uint size);
+
+
+/**
+	@brief Write a block of bytes to a serial port.
+
+	Try to write up to @c size bytes from @c buf to serial port @c serial,
+	and return the number of bytes written. This is like calling
+	@c bios_write_serial repeatedly until it fails (or @c size bytes are
+	written), but it costs a single transfer.
+
+	If this operation returns less than @c size, a @c SERIAL_TX_READY
+	interrupt will be raised when the device is ready to accept more data.
+
+	@param serial the serial device to write to
+	@param buf the bytes to write
+	@param size the number of bytes to write
+	@return the number of bytes written, which may be 0
+ */
+uint bios_write_serial_block(uint serial, const char* buf, uint size);
+
+
 #endif
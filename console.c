@@ -1,5 +1,6 @@
 
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 #include "tinyoslib.h"
 
 /*
@@ -11,10 +12,19 @@
 
 extern FILE *saved_in, *saved_out;
 
+/* 
+	Read and Write are called without the kernel lock, so the unlocked
+	stdio calls are protected by these (with preemption off).
+ */
+static Mutex stdin_lock = MUTEX_INIT;
+static Mutex stdout_lock = MUTEX_INIT;
+
 static int stdio_read(void* __this, char *buf, unsigned int size)
 {
 	size_t ret;
 
+	int pre = preempt_off;
+	Mutex_Lock(&stdin_lock);
 	while(1) {
 		ret = fread_unlocked(buf, 1, size, saved_in);
 
@@ -29,13 +39,20 @@ static int stdio_read(void* __this, char *buf, unsigned int size)
 			break;
 		}
 	}
+	Mutex_Unlock(&stdin_lock);
+	if(pre) preempt_on;
 	return ret;
 }
 
 
 static int stdio_write(void* __this, const char* buf, unsigned int size)
 {
-	return fwrite_unlocked(buf, 1, size, saved_out);
+	int pre = preempt_off;
+	Mutex_Lock(&stdout_lock);
+	int ret = fwrite_unlocked(buf, 1, size, saved_out);
+	Mutex_Unlock(&stdout_lock);
+	if(pre) preempt_on;
+	return ret;
 }
 
 static int stdio_close(void* this) { return 0; }
@@ -186,6 +186,13 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 }
 
 
+int kernel_cv_wait(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
+
 void Cond_Signal(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
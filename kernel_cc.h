@@ -59,6 +59,18 @@ int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause,
 #define kernel_timedwait(cv, cause, timeout) \
 	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
 
+/**
+	@brief Wait on a condition variable using a kernel mutex.
+
+	This is like @c Cond_TimedWait, but the cause is passed to the scheduler
+	and the timeout is in usec (or @c NO_TIMEOUT). It is used by kernel
+	objects which are protected by their own mutex instead of the kernel lock.
+
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_cv_wait(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	TimerDuration timeout);
+
 /**
 	@brief Signal a kernel condition to one waiter.
 
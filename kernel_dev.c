@@ -15,6 +15,68 @@
 DCB DT[MAX_TERMINALS];
 
 
+/* ===================================
+
+  Poll wait queues
+
+  ====================================*/
+
+
+void poll_queue_init(poll_queue* pq)
+{
+  pq->lock = MUTEX_INIT;
+  rlnode_init(& pq->entries, NULL);
+}
+
+
+void poll_register(poll_queue* pq, poll_entry* pe)
+{
+  if(pe->queue == NULL) {
+    Mutex_Lock(& pq->lock);
+    rlist_push_back(& pq->entries, & pe->node);
+    pe->queue = pq;
+    Mutex_Unlock(& pq->lock);
+  }
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+
+void poll_unregister(poll_entry* pe)
+{
+  poll_queue* pq = pe->queue;
+  if(pq) {
+    Mutex_Lock(& pq->lock);
+    rlist_remove(& pe->node);
+    pe->queue = NULL;
+    Mutex_Unlock(& pq->lock);
+  }
+}
+
+
+void poll_notify(poll_queue* pq)
+{
+  /* Pairs with the barrier of poll_register */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(& pq->entries.next, __ATOMIC_RELAXED) == & pq->entries)
+    return;
+
+  Mutex_Lock(& pq->lock);
+  for(rlnode* n = pq->entries.next; n != & pq->entries; n = n->next) {
+    poll_entry* pe = n->obj;
+    if(pe->notify) {
+      pe->notify(pe);
+      continue;
+    }
+    poller* pl = pe->owner;
+    Mutex_Lock(& pl->lock);
+    pl->triggered = 1;
+    Cond_Signal(& pl->wakeup);
+    Mutex_Unlock(& pl->lock);
+  }
+  Mutex_Unlock(& pq->lock);
+}
+
+
 /* ===================================
 
   The null device driver
@@ -47,11 +109,17 @@ void* nulldev_open(uint minor)
   return NULL;
 }
 
+int nulldev_poll(void* dev, poll_entry* pe)
+{
+  return POLL_READ | POLL_WRITE;
+}
+
 static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
-  .Close = nulldev_close
+  .Close = nulldev_close,
+  .Poll = nulldev_poll
 };
 
 
@@ -66,10 +134,32 @@ static file_ops nulldev_fops = {
 void serial_rx_handler();
 void serial_tx_handler();
 
+/* The size of the receive ring of each terminal (a power of two) */
+#define SERIAL_RX_SIZE 4096
+
+/* The size of the transmit ring of each terminal (a power of two) */
+#define SERIAL_TX_SIZE 4096
+
 typedef struct serial_device_control_block {
   uint devno;
-  Mutex spinlock;
-  CondVar rx_ready;
+  Mutex spinlock;       /* Lock for the receive ring, with preemption off */
+  CondVar rx_ready;     /* Readers wait here for input */
+  terminal_mode mode;   /* The line discipline */
+  uint rx_core;         /* The core receiving SERIAL_RX_READY, under spinlock */
+  uint tx_core;         /* The core receiving SERIAL_TX_READY, under tx_spinlock */
+  size_t rx_head;       /* Total bytes read from the ring (free-running) */
+  size_t rx_tail;       /* Total bytes received into the ring (free-running) */
+  size_t rx_eol;        /* Position after the last end of line received */
+  char rx_buf[SERIAL_RX_SIZE];
+  poll_queue pollq;
+  Mutex tx_mutex;       /* Held by writers, to keep each write contiguous */
+  int tx_waiting;       /* Set by a non-blocking writer which found tx_mutex held */
+
+  Mutex tx_spinlock;    /* Lock for the transmit ring, with preemption off */
+  CondVar tx_ready;     /* Writers wait here for room in the transmit ring */
+  size_t tx_head;       /* Total bytes sent to the device (free-running) */
+  size_t tx_tail;       /* Total bytes queued (free-running) */
+  char tx_buf[SERIAL_TX_SIZE];
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -78,89 +168,301 @@ serial_dcb_t serial_dcb[MAX_TERMINALS];
 
 /*
   Interrupt-driven driver for serial-device reads.
+
+  The RX handler moves the input of the terminal from the device to the
+  receive ring, and wakes up the readers when it can be read. In raw mode,
+  any input can be read. In canonical mode, input can be read only up to
+  the end of a line (or when the ring is full), so that a reader gets a
+  complete line with a single wakeup.
+
+  When the ring is full, the device is not read, and it does not raise
+  SERIAL_RX_READY again. Therefore, readers refill the ring after taking
+  input from it.
+ */
+
+/*
+  Send an interrupt of the terminal to the current core. Readers and 
+  writers call this before they sleep for the interrupt: a woken thread
+  is queued at the core it last ran on, so the handler can then wake it
+  up without interrupting another core.
+  *** MUST BE CALLED WITH THE LOCK OF *core HELD ***
  */
+static void serial_irq_follow(serial_dcb_t* dcb, Interrupt intno, uint* core)
+{
+  if(*core != cpu_core_id) {
+    *core = cpu_core_id;
+    bios_serial_interrupt_core(dcb->devno, intno, cpu_core_id);
+  }
+}
+
+/* 
+  Move input from the device to the receive ring, until the ring is full
+  or the device has no more input. Return 1 if input was received.
+  *** MUST BE CALLED WITH spinlock HELD *** 
+ */
+static int serial_rx_fill(serial_dcb_t* dcb)
+{
+  size_t tail = dcb->rx_tail;
+  while(tail - dcb->rx_head < SERIAL_RX_SIZE) {
+    size_t offset = tail & (SERIAL_RX_SIZE-1);
+    size_t span = SERIAL_RX_SIZE - offset;
+    size_t space = SERIAL_RX_SIZE - (tail - dcb->rx_head);
+    if(span > space) span = space;
+
+    uint n = bios_read_serial_block(dcb->devno, dcb->rx_buf + offset, span);
+    char* eol = memrchr(dcb->rx_buf + offset, '\n', n);
+    if(eol) dcb->rx_eol = tail + (eol - (dcb->rx_buf + offset)) + 1;
+    tail += n;
+    if(n < span) break;
+  }
+
+  if(tail == dcb->rx_tail) return 0;
+  dcb->rx_tail = tail;
+  return 1;
+}
+
+/* 
+  Return 1 if the receive ring can be read, according to the mode.
+  *** MUST BE CALLED WITH spinlock HELD *** 
+ */
+static int serial_rx_readable(serial_dcb_t* dcb)
+{
+  size_t avail = dcb->rx_tail - dcb->rx_head;
+  if(dcb->mode == TERMINAL_RAW)
+    return avail > 0;
+  return dcb->rx_eol > dcb->rx_head || avail == SERIAL_RX_SIZE;
+}
+
+/* 
+  Take up to size bytes from the receive ring, stopping after an end of
+  line in canonical mode. Return the number of bytes taken.
+  *** MUST BE CALLED WITH spinlock HELD *** 
+ */
+static unsigned int serial_rx_take(serial_dcb_t* dcb, char* buf, unsigned int size)
+{
+  size_t avail = dcb->rx_tail - dcb->rx_head;
+  unsigned int count = 0;
+
+  while(count < size && avail > 0) {
+    size_t offset = dcb->rx_head & (SERIAL_RX_SIZE-1);
+    size_t span = SERIAL_RX_SIZE - offset;
+    if(span > avail) span = avail;
+    if(span > size - count) span = size - count;
+
+    /* In canonical mode, stop after the first end of line */
+    char* eol = NULL;
+    if(dcb->mode == TERMINAL_CANONICAL) {
+      eol = memchr(dcb->rx_buf + offset, '\n', span);
+      if(eol) span = eol - (dcb->rx_buf + offset) + 1;
+    }
+
+    memcpy(buf + count, dcb->rx_buf + offset, span);
+    dcb->rx_head += span;
+    avail -= span;
+    count += span;
+    if(eol) break;
+  }
+  return count;
+}
 
 void serial_rx_handler()
 {
   int pre = preempt_off;
 
-  /* 
-    We do not know which terminal is
-    ready, so we must signal them all !
-   */
-  for(int i=0;i<bios_serial_ports();i++) {
-    serial_dcb_t* dcb = &serial_dcb[i];
-    Cond_Broadcast(&dcb->rx_ready);
+  /* Serve only the terminals which are ready */
+  uint ready = bios_serial_pending(SERIAL_RX_READY);
+  while(ready) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctz(ready)];
+    ready &= ready-1;
+    Mutex_Lock(&dcb->spinlock);
+    int wake = serial_rx_fill(dcb) && serial_rx_readable(dcb);
+    if(wake)
+      Cond_Broadcast(&dcb->rx_ready);
+    Mutex_Unlock(&dcb->spinlock);
+    if(wake)
+      poll_notify(&dcb->pollq);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read from the device, sleeping if needed. If block is 0, return
+  STREAM_WOULD_BLOCK instead of sleeping.
  */
-int serial_read(void* dev, char *buf, unsigned int size)
+static int serial_receive(serial_dcb_t* dcb, char *buf, unsigned int size, int block)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
-
   preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->spinlock);
 
-  uint count =  0;
+  int count =  0;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
-    
-    if (valid) {
-      count++;
+  while(size > 0) {
+    if(dcb->mode == TERMINAL_RAW && dcb->rx_head == dcb->rx_tail) {
+      /* Nothing is buffered, read directly into buf */
+      count = bios_read_serial_block(dcb->devno, buf, size);
+      if(count > 0) break;
     }
-    else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+    else {
+      serial_rx_fill(dcb);
+      if(serial_rx_readable(dcb)) {
+        count = serial_rx_take(dcb, buf, size);
+        serial_rx_fill(dcb);
+        break;
+      }
     }
-    else
+    if(! block) {
+      count = STREAM_WOULD_BLOCK;
       break;
+    }
+    serial_irq_follow(dcb, SERIAL_RX_READY, &dcb->rx_core);
+    kernel_cv_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO, NO_TIMEOUT);
   }
 
+  Mutex_Unlock(&dcb->spinlock);
   preempt_on;           /* Restart preemption */
 
   return count;
 }
 
+int serial_read(void* dev, char *buf, unsigned int size)
+{
+  return serial_receive((serial_dcb_t*)dev, buf, size, 1);
+}
+
+int serial_try_read(void* dev, char *buf, unsigned int size)
+{
+  return serial_receive((serial_dcb_t*)dev, buf, size, 0);
+}
+
 
 /*
-  A polling driver for serial writes
-  */
+  Interrupt-driven driver for serial writes.
+
+  Writers copy their data to the transmit ring of the terminal and send
+  as much of it as the device accepts. When the device does not accept
+  all of it, it raises SERIAL_TX_READY when it becomes ready again, and
+  the handler sends the rest. Writers sleep only while the ring is full.
+ */
+
+/* 
+  Send the transmit ring to the device, until it is empty or the device 
+  is not ready. Wake up the writers if there is new room.
+  *** MUST BE CALLED WITH tx_spinlock HELD *** 
+ */
+static void serial_tx_drain(serial_dcb_t* dcb)
+{
+  size_t head = dcb->tx_head;
+  while(head != dcb->tx_tail) {
+    size_t offset = head & (SERIAL_TX_SIZE-1);
+    size_t span = SERIAL_TX_SIZE - offset;
+    if(span > dcb->tx_tail - head) span = dcb->tx_tail - head;
+
+    uint n = bios_write_serial_block(dcb->devno, dcb->tx_buf + offset, span);
+    head += n;
+    if(n < span) break;
+  }
+
+  if(head != dcb->tx_head) {
+    dcb->tx_head = head;
+    Cond_Broadcast(&dcb->tx_ready);
+    poll_notify(&dcb->pollq);
+  }
+}
 
-/* Interrupt driver */
 void serial_tx_handler()
 {
-  /* There is nothing to do */
+  int pre = preempt_off;
+
+  /* Drain only the terminals which are ready */
+  uint ready = bios_serial_pending(SERIAL_TX_READY);
+  while(ready) {
+    serial_dcb_t* dcb = &serial_dcb[__builtin_ctz(ready)];
+    ready &= ready-1;
+    Mutex_Lock(&dcb->tx_spinlock);
+    serial_tx_drain(dcb);
+    Mutex_Unlock(&dcb->tx_spinlock);
+  }
+  if(pre) preempt_on;
+}
+
+/*
+  Take tx_mutex without waiting. If it is held, set tx_waiting, so that 
+  the holder notifies the poll queue when it releases it.
+ */
+static int serial_tx_trylock(serial_dcb_t* dcb)
+{
+  if(! __atomic_test_and_set(&dcb->tx_mutex, __ATOMIC_ACQUIRE))
+    return 1;
+  __atomic_store_n(&dcb->tx_waiting, 1, __ATOMIC_SEQ_CST);
+  return ! __atomic_test_and_set(&dcb->tx_mutex, __ATOMIC_SEQ_CST);
 }
 
 /* 
-  Write call 
-  This is currently a polling driver.
+  Write call. This returns when all the data is sent or queued. 
+  If block is 0, this queues only what fits in the transmit ring, and 
+  returns STREAM_WOULD_BLOCK if nothing fits.
 */
-int serial_write(void* dev, const char* buf, unsigned int size)
+static int serial_send(serial_dcb_t* dcb, const char* buf, unsigned int size, int block)
 {
-  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  if(block)
+    Mutex_Lock(&dcb->tx_mutex);
+  else if(! serial_tx_trylock(dcb))
+    return STREAM_WOULD_BLOCK;
+  preempt_off;            /* Stop preemption */
+  Mutex_Lock(&dcb->tx_spinlock);
 
   unsigned int count = 0;
+
+  /* If nothing is queued, send directly from buf */
+  if(dcb->tx_head == dcb->tx_tail)
+    count = bios_write_serial_block(dcb->devno, buf, size);
+
   while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
-
-    if(success) {
-      count++;
-    } 
-    else if(count==0)
-    {
-      yield(SCHED_IO);
+    size_t space = SERIAL_TX_SIZE - (dcb->tx_tail - dcb->tx_head);
+    if(space == 0) {
+      if(! block) break;
+      serial_irq_follow(dcb, SERIAL_TX_READY, &dcb->tx_core);
+      kernel_cv_wait(&dcb->tx_spinlock, &dcb->tx_ready, SCHED_IO, NO_TIMEOUT);
+      continue;
     }
-    else
-      break;
+
+    size_t n = size - count;
+    if(n > space) n = space;
+    size_t offset = dcb->tx_tail & (SERIAL_TX_SIZE-1);
+    size_t span = SERIAL_TX_SIZE - offset;
+    if(span > n) span = n;
+    memcpy(dcb->tx_buf + offset, buf + count, span);
+    memcpy(dcb->tx_buf, buf + count + span, n - span);
+    dcb->tx_tail += n;
+    count += n;
+
+    serial_tx_drain(dcb);
   }
 
+  Mutex_Unlock(&dcb->tx_spinlock);
+  preempt_on;           /* Restart preemption */
+  Mutex_Unlock(&dcb->tx_mutex);
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&dcb->tx_waiting, __ATOMIC_RELAXED)
+     && __atomic_exchange_n(&dcb->tx_waiting, 0, __ATOMIC_ACQ_REL))
+    poll_notify(&dcb->pollq);
+
+  if(count == 0 && size > 0)
+    return STREAM_WOULD_BLOCK;
   return count;  
 }
 
+int serial_write(void* dev, const char* buf, unsigned int size)
+{
+  return serial_send((serial_dcb_t*)dev, buf, size, 1);
+}
+
+int serial_try_write(void* dev, const char* buf, unsigned int size)
+{
+  return serial_send((serial_dcb_t*)dev, buf, size, 0);
+}
+
 
 int serial_close(void* dev) 
 {
@@ -168,6 +470,31 @@ int serial_close(void* dev)
 }
 
 
+/*
+  The device cannot be checked for input without reading it, so 
+  its input is moved to the receive ring.
+ */
+int serial_poll(void* dev, poll_entry* pe)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+  if(pe) poll_register(&dcb->pollq, pe);
+
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  serial_rx_fill(dcb);
+  int mask = serial_rx_readable(dcb) ? POLL_READ : 0;
+  Mutex_Unlock(&dcb->spinlock);
+
+  Mutex_Lock(&dcb->tx_spinlock);
+  if(dcb->tx_tail - dcb->tx_head < SERIAL_TX_SIZE)
+    mask |= POLL_WRITE;
+  Mutex_Unlock(&dcb->tx_spinlock);
+  preempt_on;
+
+  return mask;
+}
+
+
 void* serial_open(uint term)
 {
   assert(term<bios_serial_ports());
@@ -180,7 +507,10 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
-  .Close = serial_close
+  .Close = serial_close,
+  .Poll = serial_poll,
+  .TryRead = serial_try_read,
+  .TryWrite = serial_try_write
 };
 
 
@@ -211,10 +541,64 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    serial_dcb[i].mode = TERMINAL_RAW;
+    serial_dcb[i].rx_core = serial_dcb[i].tx_core = 0;
+    serial_dcb[i].rx_head = serial_dcb[i].rx_tail = serial_dcb[i].rx_eol = 0;
+    poll_queue_init(&serial_dcb[i].pollq);
+    serial_dcb[i].tx_mutex = MUTEX_INIT;
+    serial_dcb[i].tx_waiting = 0;
+    serial_dcb[i].tx_spinlock = MUTEX_INIT;
+    serial_dcb[i].tx_ready = COND_INIT;
+    serial_dcb[i].tx_head = serial_dcb[i].tx_tail = 0;
   }
+}
+
 
+void initialize_device_interrupts()
+{
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
   cpu_interrupt_handler(SERIAL_TX_READY, serial_tx_handler);
+
+  /* 
+    Take over the interrupts of our terminals, now that the handlers are 
+    installed. Interrupts already raised to core 0 are served there.
+   */
+  int pre = preempt_off;
+  for(uint i=cpu_core_id; i<bios_serial_ports(); i+=cpu_cores()) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
+    serial_irq_follow(dcb, SERIAL_RX_READY, &dcb->rx_core);
+    Mutex_Unlock(&dcb->spinlock);
+    Mutex_Lock(&dcb->tx_spinlock);
+    serial_irq_follow(dcb, SERIAL_TX_READY, &dcb->tx_core);
+    Mutex_Unlock(&dcb->tx_spinlock);
+  }
+  if(pre) preempt_on;
+}
+
+
+/* How long to keep trying to send queued output at shutdown */
+#define SERIAL_FLUSH_TIMEOUT 1000000ul
+
+void finalize_devices()
+{
+  /* 
+    Send the output still queued; give up on a terminal that makes no progress.
+    The TX handler may still run on other cores, so the ring is locked.
+   */
+  int pre = preempt_off;
+  for(int i=0; i<bios_serial_ports(); i++) {
+    serial_dcb_t* dcb = &serial_dcb[i];
+    TimerDuration last = bios_clock();
+    Mutex_Lock(&dcb->tx_spinlock);
+    while(dcb->tx_head != dcb->tx_tail && bios_clock() - last < SERIAL_FLUSH_TIMEOUT) {
+      size_t head = dcb->tx_head;
+      serial_tx_drain(dcb);
+      if(dcb->tx_head != head) last = bios_clock();
+    }
+    Mutex_Unlock(&dcb->tx_spinlock);
+  }
+  if(pre) preempt_on;
 }
 
 
@@ -234,3 +618,34 @@ uint device_no(Device_type major)
 }
 
 
+
+
+int sys_TerminalMode(Fid_t fd, terminal_mode mode)
+{
+  if(mode != TERMINAL_RAW && mode != TERMINAL_CANONICAL)
+    return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL) return -1;
+  if(fcb->streamfunc != &devtable[DEV_SERIAL].dev_fops) {
+    FCB_decref(fcb);
+    return -1;
+  }
+
+  /* Input which was not readable may be readable in the new mode */
+  serial_dcb_t* dcb = fcb->streamobj;
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+  terminal_mode old = dcb->mode;
+  dcb->mode = mode;
+  int wake = serial_rx_readable(dcb);
+  if(wake)
+    Cond_Broadcast(&dcb->rx_ready);
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;
+  if(wake)
+    poll_notify(&dcb->pollq);
+
+  FCB_decref(fcb);
+  return old;
+}
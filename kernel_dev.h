@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -34,6 +35,72 @@
 */
 
 
+/**
+  @brief A poll wait queue.
+
+  A stream object which supports @c Poll keeps a queue of the @c Poll
+  calls waiting for it. When the readiness of the stream may have changed,
+  it calls @ref poll_notify to wake them up.
+ */
+typedef struct poll_queue {
+  Mutex lock;           /**< @brief Lock for the list of entries */
+  rlnode entries;       /**< @brief The registered @c poll_entry objects */
+} poll_queue;
+
+
+/** @brief The state of a @c Poll call, shared by its entries. */
+typedef struct poller {
+  Mutex lock;           /**< @brief Lock for this object */
+  CondVar wakeup;       /**< @brief The @c Poll call sleeps here */
+  int triggered;        /**< @brief Set by @ref poll_notify */
+} poller;
+
+
+/** @brief The registration of a @c Poll call (or of an event queue) at a stream. */
+typedef struct poll_entry {
+  poller* owner;        /**< @brief The @c Poll call */
+  poll_queue* queue;    /**< @brief The queue of the entry, or NULL */
+  rlnode node;          /**< @brief Node in the queue */
+
+  /** @brief If not NULL, called by @ref poll_notify instead of waking up the owner.
+
+    It is called with the lock of the queue held. */
+  void (*notify)(struct poll_entry* pe);
+} poll_entry;
+
+
+/** @brief Initialize a poll queue. */
+void poll_queue_init(poll_queue* pq);
+
+/**
+  @brief Register a poll entry at a queue.
+
+  This is done once per entry; later calls do nothing. The call is
+  followed by a full memory barrier, so that a readiness check after it
+  cannot miss a change notified before it.
+ */
+void poll_register(poll_queue* pq, poll_entry* pe);
+
+/** @brief Remove a poll entry from its queue, if any. */
+void poll_unregister(poll_entry* pe);
+
+/**
+  @brief Wake up the @c Poll calls registered at a queue.
+
+  Entries with a @c notify callback (those of event queues) are passed
+  to it instead. This must be called after a change of the state of
+  the stream which may make it ready.
+ */
+void poll_notify(poll_queue* pq);
+
+
+/**
+  @brief Returned by the @c TryRead and @c TryWrite methods of a stream,
+  when the transfer would block.
+ */
+#define STREAM_WOULD_BLOCK (-2)
+
+
 /**
   @brief The device-specific file operations table.
 
@@ -43,6 +110,11 @@
 
   The first argument of each method is taken from the 'streamobj'
   field of the FCB.
+
+  The methods are called without the kernel lock (@c Close may also be
+  called with it held, when a process exits). Therefore, stream objects 
+  must be protected by their own locks, and must block with 
+  @c kernel_cv_wait instead of @c kernel_wait.
   @see FCB
  */
 typedef struct file_operations {
@@ -92,6 +164,84 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+  /** @brief Splice-out operation (optional).
+
+    Pass up to 'size' bytes buffered in stream 'this' to the @c Write
+    method of stream 'out' (whose methods are 'out_ops'), directly from
+    the internal buffer of 'this'. If 'consume' is 0, the data stays in
+    'this' (this implements @c Tee).
+    If no data is available, the thread will block, like @c Read.
+    Return the number of bytes accepted by 'out', 0 for "end of data",
+    or -1 on error.
+
+    Streams which leave this NULL are spliced by the other hook, or by
+    copying through a kernel buffer.
+  */
+    int (*SpliceTo)(void* this, struct file_operations* out_ops, void* out, unsigned int size, int consume);
+
+  /** @brief Splice-in operation (optional).
+
+    Fill up to 'size' bytes of the internal buffer of stream 'this'
+    by calling the @c Read method of stream 'in' (whose methods are 'in_ops'). 
+    If there is no room, the thread will block, like @c Write.
+    Return the number of bytes read from 'in' (0 for "end of data"),
+    or -1 on error.
+  */
+    int (*SpliceFrom)(void* this, struct file_operations* in_ops, void* in, unsigned int size);
+
+  /** @brief Readiness operation (optional).
+
+    Return the readiness of stream 'this', as a mask of @c POLL_READ, 
+    @c POLL_WRITE, @c POLL_HANGUP and @c POLL_ERROR. 
+    If 'pe' is not NULL, first register it (by @ref poll_register) at
+    the queue of the stream, so that @c Poll is woken up when the
+    readiness changes.
+
+    Streams which leave this NULL are always ready for the methods
+    they have.
+  */
+    int (*Poll)(void* this, poll_entry* pe);
+
+  /** @brief Vectored read operation (optional).
+
+    Read up to the total size of the 'n' buffers of 'iov' into them,
+    in order, as a single transfer. This is otherwise like @c Read.
+
+    Streams which leave this NULL are read by calling @c Read for
+    each buffer.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int n);
+
+  /** @brief Vectored write operation (optional).
+
+    Write the 'n' buffers of 'iov', in order, as a single transfer.
+    This is otherwise like @c Write.
+
+    Streams which leave this NULL are written by calling @c Write for
+    each buffer.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int n);
+
+  /** @brief Non-blocking read operation (optional).
+
+    This is like @c Read, but it returns @c STREAM_WOULD_BLOCK instead of
+    blocking. A stream which also has @c Poll must notify its poll queue
+    when a call that would have blocked may succeed.
+
+    I/O rings use this, so that a request never sleeps in its stream.
+    Streams which leave this NULL must not block in @c Read once @c Poll
+    has reported them readable.
+  */
+    int (*TryRead)(void* this, char *buf, unsigned int size);
+
+  /** @brief Non-blocking write operation (optional).
+
+    This is like @c Write, but it returns @c STREAM_WOULD_BLOCK instead of
+    blocking, and it may write only part of the data. It is otherwise
+    like @c TryRead.
+  */
+    int (*TryWrite)(void* this, const char* buf, unsigned int size);
 } file_ops;
 
 
@@ -137,6 +287,30 @@ typedef struct device_control_block
 void initialize_devices();
 
 
+/** 
+  @brief Initialization of device interrupts for a core.
+
+  This function is called by every core at kernel startup, after
+  @ref initialize_devices. It installs the serial interrupt handlers
+  on the core, and moves to it the interrupts of its share of the 
+  terminals: terminal @c i is served by core @c i mod @c cpu_cores(),
+  so that core 0 does not handle the interrupts of every terminal.
+
+  Later, a thread which sleeps for an interrupt of a terminal moves the
+  interrupt to its own core, where it will be woken up.
+ */
+void initialize_device_interrupts();
+
+
+/** 
+  @brief Finalization for devices.
+
+  This function is called at kernel shutdown, after the scheduler has 
+  stopped. It sends the output still queued at the terminals.
+ */
+void finalize_devices();
+
+
 /**
   @brief Open a device.
 
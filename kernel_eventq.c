@@ -0,0 +1,302 @@
+
+#include "tinyos.h"
+#include "kernel_eventq.h"
+#include "kernel_cc.h"
+
+
+static file_ops eventq_fops;
+
+/* Lock for the registrations of all the streams. It is taken before ctl_lock. */
+static Mutex evq_lock = MUTEX_INIT;
+
+
+/*
+  The notification of a registered stream. This is called by poll_notify,
+  with the lock of the poll queue of the stream held.
+ */
+static void eventq_notify(poll_entry* pe)
+{
+  event_registration* reg = (event_registration*) pe;
+  event_queue* eq = reg->eq;
+
+  Mutex_Lock(& eq->lock);
+  if(! reg->on_ready) {
+    reg->on_ready = 1;
+    rlist_push_back(& eq->ready, & reg->ready_node);
+    eq->nready++;
+    Cond_Signal(& eq->has_ready);
+  }
+  Mutex_Unlock(& eq->lock);
+}
+
+
+/* Take a registration off the ready list, if it is on it */
+static void eventq_unready(event_registration* reg)
+{
+  event_queue* eq = reg->eq;
+  Mutex_Lock(& eq->lock);
+  if(reg->on_ready) {
+    reg->on_ready = 0;
+    rlist_remove(& reg->ready_node);
+    eq->nready--;
+  }
+  Mutex_Unlock(& eq->lock);
+}
+
+
+/* Remove a registration from its stream and release it.
+   *** MUST BE CALLED WITH evq_lock AND ctl_lock HELD *** */
+static void eventq_release(event_registration* reg)
+{
+  /* After this, the stream will not notify reg */
+  poll_unregister(& reg->pe);
+  eventq_unready(reg);
+  rlist_remove(& reg->node);
+  rlist_remove(& reg->fcb_node);
+  free(reg);
+}
+
+
+/* Find the registration of a stream.
+   *** MUST BE CALLED WITH ctl_lock HELD *** */
+static event_registration* eventq_find(event_queue* eq, FCB* fcb)
+{
+  for(rlnode* n = eq->registrations.next; n != & eq->registrations; n = n->next) {
+    event_registration* reg = n->obj;
+    if(reg->fcb == fcb) return reg;
+  }
+  return NULL;
+}
+
+
+static int eventq_close(void* this)
+{
+  event_queue* eq = this;
+
+  /* No EventCtl or EventWait can be in progress, as they hold the FCB,
+     but eventq_detach may be */
+  Mutex_Lock(& evq_lock);
+  Mutex_Lock(& eq->ctl_lock);
+  while(! is_rlist_empty(& eq->registrations))
+    eventq_release(eq->registrations.next->obj);
+  Mutex_Unlock(& eq->ctl_lock);
+  Mutex_Unlock(& evq_lock);
+
+  free(eq);
+  return 0;
+}
+
+
+void eventq_detach(FCB* fcb)
+{
+  /* Streams are only added while they are referenced, so the list cannot
+     grow now. Most streams were never added to an event queue. */
+  if(is_rlist_empty(& fcb->evq_registrations))
+    return;
+
+  Mutex_Lock(& evq_lock);
+  while(! is_rlist_empty(& fcb->evq_registrations)) {
+    event_registration* reg = fcb->evq_registrations.next->obj;
+    event_queue* eq = reg->eq;
+
+    /* Wait for any EventWait which is polling the stream */
+    Mutex_Lock(& eq->ctl_lock);
+    eventq_release(reg);
+    Mutex_Unlock(& eq->ctl_lock);
+  }
+  Mutex_Unlock(& evq_lock);
+}
+
+
+static file_ops eventq_fops = {
+  .Close = eventq_close
+};
+
+
+Fid_t sys_EventQueue()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  event_queue* eq = xmalloc(sizeof(event_queue));
+  eq->lock = MUTEX_INIT;
+  eq->ctl_lock = MUTEX_INIT;
+  eq->has_ready = COND_INIT;
+  rlnode_init(& eq->registrations, NULL);
+  rlnode_init(& eq->ready, NULL);
+  eq->nready = 0;
+
+  fcb->streamobj = eq;
+  fcb->streamfunc = &eventq_fops;
+  return fid;
+}
+
+
+/* Return the event queue of an fid, holding a reference to its FCB */
+static event_queue* get_eventq_ref(Fid_t fid, FCB** fcb)
+{
+  *fcb = get_fcb_ref(fid);
+  if(*fcb == NULL) return NULL;
+  if((*fcb)->streamfunc != &eventq_fops) {
+    FCB_decref(*fcb);
+    return NULL;
+  }
+  return (*fcb)->streamobj;
+}
+
+
+int sys_EventCtl(Fid_t efd, event_op op, Fid_t fd, short events, intptr_t data)
+{
+  FCB* eq_fcb;
+  event_queue* eq = get_eventq_ref(efd, &eq_fcb);
+  if(eq == NULL) return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL) {
+    FCB_decref(eq_fcb);
+    return -1;
+  }
+
+  int retcode = 0;
+  Mutex_Lock(& evq_lock);
+  Mutex_Lock(& eq->ctl_lock);
+  event_registration* reg = eventq_find(eq, fcb);
+
+  switch(op) {
+  case EVQ_ADD:
+    /* Event queues cannot be added to event queues */
+    if(reg != NULL || fcb->streamfunc == &eventq_fops) {
+      retcode = -1;
+      break;
+    }
+    reg = xmalloc(sizeof(event_registration));
+    reg->pe.owner = NULL;
+    reg->pe.queue = NULL;
+    reg->pe.notify = eventq_notify;
+    rlnode_init(& reg->pe.node, & reg->pe);
+    reg->eq = eq;
+    reg->fcb = fcb;
+    reg->events = events;
+    reg->data = data;
+    reg->on_ready = 0;
+    rlnode_init(& reg->node, reg);
+    rlnode_init(& reg->ready_node, reg);
+    rlnode_init(& reg->fcb_node, reg);
+    rlist_push_back(& eq->registrations, & reg->node);
+    rlist_push_back(& fcb->evq_registrations, & reg->fcb_node);
+
+    /* Register, and report a stream which is already ready */
+    if(FCB_poll(reg->fcb, & reg->pe) & (reg->events | POLL_HANGUP | POLL_ERROR))
+      eventq_notify(& reg->pe);
+    break;
+
+  case EVQ_MODIFY:
+    if(reg == NULL) {
+      retcode = -1;
+      break;
+    }
+    reg->events = events;
+    reg->data = data;
+    if(FCB_poll(reg->fcb, & reg->pe) & (reg->events | POLL_HANGUP | POLL_ERROR))
+      eventq_notify(& reg->pe);
+    break;
+
+  case EVQ_REMOVE:
+    if(reg == NULL)
+      retcode = -1;
+    else
+      eventq_release(reg);
+    break;
+
+  default:
+    retcode = -1;
+  }
+
+  Mutex_Unlock(& eq->ctl_lock);
+  Mutex_Unlock(& evq_lock);
+
+  FCB_decref(fcb);
+  FCB_decref(eq_fcb);
+  return retcode;
+}
+
+
+/*
+  Report up to max events from the registrations on the ready list.
+  Each registration is re-armed by its Poll method, which also tells
+  whether it is still ready. Only the registrations on the list at the
+  start are looked at, so that a busy stream cannot keep us here.
+ */
+static int eventq_collect(event_queue* eq, event_record* out, unsigned int max)
+{
+  int count = 0;
+
+  Mutex_Lock(& eq->ctl_lock);
+
+  Mutex_Lock(& eq->lock);
+  unsigned int todo = eq->nready;
+  Mutex_Unlock(& eq->lock);
+
+  while(todo-- > 0 && count < max) {
+    Mutex_Lock(& eq->lock);
+    if(is_rlist_empty(& eq->ready)) {
+      Mutex_Unlock(& eq->lock);
+      break;
+    }
+    event_registration* reg = rlist_pop_front(& eq->ready)->obj;
+    reg->on_ready = 0;
+    eq->nready--;
+    Mutex_Unlock(& eq->lock);
+
+    int revents = FCB_poll(reg->fcb, & reg->pe) & (reg->events | POLL_HANGUP | POLL_ERROR);
+    if(revents) {
+      out[count].data = reg->data;
+      out[count].events = revents;
+      count++;
+    }
+  }
+
+  Mutex_Unlock(& eq->ctl_lock);
+  return count;
+}
+
+
+int sys_EventWait(Fid_t efd, event_record* out, unsigned int max, timeout_t timeout)
+{
+  if(out == NULL || max == 0) return -1;
+
+  FCB* eq_fcb;
+  event_queue* eq = get_eventq_ref(efd, &eq_fcb);
+  if(eq == NULL) return -1;
+
+  /* timeout_t is unsigned; a negative timeout means no timeout */
+  TimerDuration deadline = ((long) timeout < 0) ? NO_TIMEOUT
+    : bios_clock() + 1000ull * (TimerDuration) timeout;
+  int count;
+
+  while(1) {
+    count = eventq_collect(eq, out, max);
+    if(count > 0 || timeout == 0) break;
+
+    /* Sleep until the ready list is not empty, or until the deadline */
+    int expired = 0;
+    Mutex_Lock(& eq->lock);
+    while(is_rlist_empty(& eq->ready)) {
+      TimerDuration t = NO_TIMEOUT;
+      if(deadline != NO_TIMEOUT) {
+        TimerDuration now = bios_clock();
+        if(now >= deadline) { expired = 1; break; }
+        t = deadline - now;
+      }
+      kernel_cv_wait(& eq->lock, & eq->has_ready, SCHED_IO, t);
+    }
+    Mutex_Unlock(& eq->lock);
+    if(expired) break;
+  }
+
+  FCB_decref(eq_fcb);
+  return count;
+}
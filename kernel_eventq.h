@@ -0,0 +1,83 @@
+#ifndef __KERNEL_EVENTQ_H
+#define __KERNEL_EVENTQ_H
+
+#include "tinyos.h"
+#include "kernel_streams.h"
+
+/**
+  @file kernel_eventq.h
+  @brief Event queues.
+
+  @defgroup eventq Event queues
+  @ingroup kernel
+  @brief Event queues.
+
+  An event queue is a stream which holds a set of registrations,
+  one for each stream added by @c EventCtl. Each registration is
+  a @c poll_entry at the stream, which stays registered while the
+  registration exists. When the stream notifies its poll queue, the
+  registration is appended to the ready list of the event queue.
+  Therefore, @c EventWait only looks at the registrations on the ready
+  list, and its cost does not depend on the number of registrations.
+
+  Notifications are edge-triggered. @c EventWait takes each registration
+  off the ready list, re-arms it and checks the stream by its @c Poll
+  method. A registration which is ready is reported once; it is put back
+  on the ready list only by a later notification of the stream.
+
+  The lock of the ready list is taken by the notification, which runs
+  with the lock of the poll queue of the stream held. Therefore, the
+  stream methods are never called with the lock of the ready list held.
+  The changes of the registrations and the processing of the ready list
+  are serialized by a second lock, @c ctl_lock.
+
+  A registration does not hold a reference to the FCB of its stream.
+  Instead, the FCB keeps a list of its registrations, and when its last
+  reference is dropped, @c eventq_detach() removes them before the stream
+  is closed. The lists of all FCBs are protected by a global lock, which
+  is taken before @c ctl_lock. Therefore, an event queue is not freed
+  while a registration is removed from it, and a stream is not closed
+  while @c EventWait polls it.
+
+  @{
+*/
+
+
+/** @brief The registration of a stream at an event queue. */
+typedef struct event_registration {
+  poll_entry pe;                /**< @brief The entry at the poll queue of the stream */
+  struct event_queue* eq;       /**< @brief The event queue */
+  FCB* fcb;                     /**< @brief The stream */
+  short events;                 /**< @brief The events to report */
+  intptr_t data;                /**< @brief The user data to report */
+  int on_ready;                 /**< @brief Set while in the ready list */
+  rlnode node;                  /**< @brief Node in the registrations of the queue */
+  rlnode ready_node;            /**< @brief Node in the ready list */
+  rlnode fcb_node;              /**< @brief Node in the registrations of the stream */
+} event_registration;
+
+
+/** @brief The stream object of an event queue. */
+typedef struct event_queue {
+  Mutex lock;                   /**< @brief Lock for the ready list */
+  Mutex ctl_lock;               /**< @brief Lock for the registrations */
+  CondVar has_ready;            /**< @brief @c EventWait sleeps here */
+  rlnode registrations;         /**< @brief All the registrations */
+  rlnode ready;                 /**< @brief The registrations which may be ready */
+  unsigned int nready;          /**< @brief The length of the ready list */
+} event_queue;
+
+
+/** @brief Remove a stream from all the event queues it is added to.
+
+  This is called by @c FCB_decref() when the last reference to the stream
+  is dropped, before the stream is closed.
+
+  @param fcb the stream
+ */
+void eventq_detach(FCB* fcb);
+
+
+/** @} */
+
+#endif
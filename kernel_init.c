@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_socket.h"
 
 
 
@@ -38,6 +39,7 @@ void boot_tinyos_kernel()
     initialize_processes();
     initialize_devices();
     initialize_files();
+    initialize_sockets();
     initialize_scheduler();
 
     /* The boot task is executed normally! */
@@ -47,6 +49,9 @@ void boot_tinyos_kernel()
 
   cpu_core_barrier_sync();
 
+  /* Every core serves the interrupts of some of the terminals */
+  initialize_device_interrupts();
+
 #ifndef NVALGRIND
   VALGRIND_PRINTF_BACKTRACE("TINYOS: Entering scheduler for core %d\n",cpu_core_id);
 #endif
@@ -54,7 +59,8 @@ void boot_tinyos_kernel()
   run_scheduler();
 
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended. */    
+    finalize_devices();
   }
 }
 
@@ -66,6 +72,9 @@ void boot(uint ncores, uint nterm, Task boot_task, int argl, void* args)
   boot_rec.args = args;
 
   vm_boot(boot_tinyos_kernel, ncores, nterm);
+
+  /* All cores have halted */
+  finalize_scheduler();
 }
 
 
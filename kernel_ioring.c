@@ -0,0 +1,345 @@
+
+#include "tinyos.h"
+#include "kernel_ioring.h"
+#include "kernel_cc.h"
+
+
+static file_ops ioring_fops;
+
+
+/*
+  The notification of the stream of a request. This is called by
+  poll_notify, with the lock of the poll queue of the stream held.
+ */
+static void ioring_notify(poll_entry* pe)
+{
+  io_request* req = (io_request*) pe;
+  io_ring_cb* ring = req->ring;
+
+  Mutex_Lock(& ring->lock);
+  if(! req->on_ready) {
+    req->on_ready = 1;
+    rlist_push_back(& ring->ready, & req->ready_node);
+    ring->nready++;
+    Cond_Broadcast(& ring->has_ready);
+  }
+  Mutex_Unlock(& ring->lock);
+}
+
+
+/* The number of completions not yet consumed by the process */
+static unsigned int ioring_cq_count(io_ring_cb* ring)
+{
+  return __atomic_load_n(& ring->shared.cq_tail, __ATOMIC_ACQUIRE)
+    - __atomic_load_n(& ring->shared.cq_head, __ATOMIC_ACQUIRE);
+}
+
+
+/* Append a completion. The caller has made sure that there is room.
+   *** MUST BE CALLED WITH ctl_lock HELD *** */
+static void ioring_post(io_ring_cb* ring, intptr_t data, int result)
+{
+  io_ring* r = & ring->shared;
+  io_cqe* cqe = & r->cq[r->cq_tail & r->mask];
+  cqe->data = data;
+  cqe->result = result;
+  __atomic_store_n(& r->cq_tail, r->cq_tail + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Remove a request from its stream and release it.
+   *** MUST BE CALLED WITH ctl_lock HELD *** */
+static void ioring_release(io_request* req)
+{
+  io_ring_cb* ring = req->ring;
+
+  /* After this, the stream will not notify req */
+  if(req->pe.queue) {
+    poll_unregister(& req->pe);
+    Mutex_Lock(& ring->lock);
+    if(req->on_ready) {
+      rlist_remove(& req->ready_node);
+      ring->nready--;
+    }
+    Mutex_Unlock(& ring->lock);
+  }
+
+  rlist_remove(& req->node);
+  rlist_push_front(& ring->free_requests, & req->node);
+  ring->inflight--;
+
+  /* This may close the stream, so it is done last */
+  FCB_decref(req->fcb);
+}
+
+
+/* 
+  Transfer the data of a request without blocking, if the stream can.
+  Streams without the non-blocking methods do not block once they are
+  reported ready.
+ */
+static int ioring_transfer(FCB* fcb, io_sqe* sqe)
+{
+  file_ops* ops = fcb->streamfunc;
+  if(sqe->opcode == IO_READ)
+    return (ops->TryRead ? ops->TryRead : ops->Read)(fcb->streamobj, sqe->buf, sqe->len);
+  else
+    return (ops->TryWrite ? ops->TryWrite : ops->Write)(fcb->streamobj, sqe->buf, sqe->len);
+}
+
+
+/*
+  Carry out a request, if its stream is ready. This also registers
+  the request at the stream, if it is not registered already.
+  The readiness reported by Poll is only a hint (e.g., a datagram needs
+  room for the whole message), so a transfer may still find that it
+  would block; then the request waits for the next notification.
+  Return 1 if the request was completed (and released), 0 otherwise.
+  *** MUST BE CALLED WITH ctl_lock HELD ***
+ */
+static int ioring_try(io_request* req)
+{
+  FCB* fcb = req->fcb;
+  io_sqe* sqe = & req->sqe;
+  int want = (sqe->opcode == IO_READ) ? POLL_READ : POLL_WRITE;
+  want |= POLL_HANGUP | POLL_ERROR;
+
+  /* A new request is registered only if it has to wait */
+  int registered = (req->pe.queue != NULL);
+  int mask = FCB_poll(fcb, registered ? & req->pe : NULL);
+  if(! (mask & want) && ! registered)
+    mask = FCB_poll(fcb, & req->pe);
+  if(! (mask & want))
+    return 0;
+
+  int result = ioring_transfer(fcb, sqe);
+  if(result == STREAM_WOULD_BLOCK && req->pe.queue == NULL) {
+    /* Register first, so that a change after the transfer is notified */
+    FCB_poll(fcb, & req->pe);
+    result = ioring_transfer(fcb, sqe);
+  }
+  if(result == STREAM_WOULD_BLOCK)
+    return 0;
+
+  ioring_post(req->ring, sqe->data, result);
+  ioring_release(req);
+  return 1;
+}
+
+
+/* Start a request taken from the submission ring.
+   *** MUST BE CALLED WITH ctl_lock HELD *** */
+static void ioring_start(io_ring_cb* ring, io_sqe* sqe)
+{
+  if(sqe->opcode == IO_NOP) {
+    ioring_post(ring, sqe->data, 0);
+    return;
+  }
+
+  FCB* fcb = get_fcb_ref(sqe->fd);
+  if(fcb == NULL) {
+    ioring_post(ring, sqe->data, -1);
+    return;
+  }
+
+  file_ops* ops = fcb->streamfunc;
+  if((sqe->opcode == IO_READ && ops->Read == NULL)
+     || (sqe->opcode == IO_WRITE && ops->Write == NULL)
+     || (sqe->opcode != IO_READ && sqe->opcode != IO_WRITE)) {
+    FCB_decref(fcb);
+    ioring_post(ring, sqe->data, -1);
+    return;
+  }
+
+  /* There is a free request, as inflight < entries */
+  io_request* req = rlist_pop_front(& ring->free_requests)->obj;
+  req->pe.owner = NULL;
+  req->pe.queue = NULL;
+  req->pe.notify = ioring_notify;
+  rlnode_init(& req->pe.node, & req->pe);
+  req->ring = ring;
+  req->fcb = fcb;
+  req->sqe = *sqe;
+  req->on_ready = 0;
+  rlist_push_back(& ring->requests, & req->node);
+  ring->inflight++;
+
+  ioring_try(req);
+}
+
+
+/*
+  Take the new requests from the submission ring, as long as there is
+  room for their completions, and start them. Return their number.
+  *** MUST BE CALLED WITH ctl_lock HELD ***
+ */
+static int ioring_submit(io_ring_cb* ring)
+{
+  io_ring* r = & ring->shared;
+  unsigned int tail = __atomic_load_n(& r->sq_tail, __ATOMIC_ACQUIRE);
+  int count = 0;
+
+  while(r->sq_head != tail && ring->inflight + ioring_cq_count(ring) < r->entries) {
+    io_sqe sqe = r->sq[r->sq_head & r->mask];
+    __atomic_store_n(& r->sq_head, r->sq_head + 1, __ATOMIC_RELEASE);
+    ioring_start(ring, &sqe);
+    count++;
+  }
+  return count;
+}
+
+
+/*
+  Try again the requests on the ready list. Only the requests on the list
+  at the start are looked at, so that a busy stream cannot keep us here.
+  Return the number of requests completed.
+  *** MUST BE CALLED WITH ctl_lock HELD ***
+ */
+static int ioring_process(io_ring_cb* ring)
+{
+  int count = 0;
+
+  Mutex_Lock(& ring->lock);
+  unsigned int todo = ring->nready;
+  Mutex_Unlock(& ring->lock);
+
+  while(todo-- > 0) {
+    Mutex_Lock(& ring->lock);
+    if(is_rlist_empty(& ring->ready)) {
+      Mutex_Unlock(& ring->lock);
+      break;
+    }
+    io_request* req = rlist_pop_front(& ring->ready)->obj;
+    req->on_ready = 0;
+    ring->nready--;
+    Mutex_Unlock(& ring->lock);
+
+    count += ioring_try(req);
+  }
+  return count;
+}
+
+
+static int ioring_close(void* this)
+{
+  io_ring_cb* ring = this;
+
+  /* No IoRingEnter can be in progress, as it holds the FCB */
+  while(! is_rlist_empty(& ring->requests))
+    ioring_release(ring->requests.next->obj);
+  free(ring->pool);
+  free(ring->shared.sq);
+  free(ring->shared.cq);
+  free(ring);
+  return 0;
+}
+
+
+static file_ops ioring_fops = {
+  .Close = ioring_close
+};
+
+
+Fid_t sys_IoRingSetup(unsigned int entries, io_ring** shared)
+{
+  if(entries == 0 || entries > MAX_IO_RING_ENTRIES || shared == NULL)
+    return NOFILE;
+
+  Fid_t fid;
+  FCB* fcb;
+
+  if(! FCB_reserve(1, &fid, &fcb))
+    return NOFILE;
+
+  unsigned int size = 1;
+  while(size < entries) size <<= 1;
+
+  io_ring_cb* ring = xmalloc(sizeof(io_ring_cb));
+  ring->lock = MUTEX_INIT;
+  ring->ctl_lock = MUTEX_INIT;
+  ring->has_ready = COND_INIT;
+  rlnode_init(& ring->requests, NULL);
+  ring->inflight = 0;
+  rlnode_init(& ring->ready, NULL);
+  ring->nready = 0;
+
+  /* There are never more than size requests in progress */
+  ring->pool = xmalloc(size * sizeof(io_request));
+  rlnode_init(& ring->free_requests, NULL);
+  for(unsigned int i = 0; i < size; i++) {
+    io_request* req = & ring->pool[i];
+    rlnode_init(& req->node, req);
+    rlnode_init(& req->ready_node, req);
+    rlist_push_back(& ring->free_requests, & req->node);
+  }
+
+  io_ring* r = & ring->shared;
+  r->entries = size;
+  r->mask = size - 1;
+  r->sq_head = r->sq_tail = 0;
+  r->cq_head = r->cq_tail = 0;
+  r->sq = xmalloc(size * sizeof(io_sqe));
+  r->cq = xmalloc(size * sizeof(io_cqe));
+
+  fcb->streamobj = ring;
+  fcb->streamfunc = &ioring_fops;
+  *shared = r;
+  return fid;
+}
+
+
+int sys_IoRingEnter(Fid_t fid, unsigned int min_complete, timeout_t timeout)
+{
+  FCB* fcb = get_fcb_ref(fid);
+  if(fcb == NULL) return -1;
+  if(fcb->streamfunc != &ioring_fops) {
+    FCB_decref(fcb);
+    return -1;
+  }
+
+  io_ring_cb* ring = fcb->streamobj;
+  if(min_complete > ring->shared.entries) {
+    FCB_decref(fcb);
+    return -1;
+  }
+
+  /* timeout_t is unsigned; a negative timeout means no timeout */
+  TimerDuration deadline = ((long) timeout < 0) ? NO_TIMEOUT
+    : bios_clock() + 1000ull * (TimerDuration) timeout;
+
+  Mutex_Lock(& ring->ctl_lock);
+  int submitted = ioring_submit(ring);
+  ioring_process(ring);
+  Mutex_Unlock(& ring->ctl_lock);
+
+  while(ioring_cq_count(ring) < min_complete) {
+    /* Sleep until a stream is notified, or until the deadline */
+    int expired = 0;
+    Mutex_Lock(& ring->lock);
+    while(is_rlist_empty(& ring->ready) && ioring_cq_count(ring) < min_complete) {
+      TimerDuration t = NO_TIMEOUT;
+      if(deadline != NO_TIMEOUT) {
+        TimerDuration now = bios_clock();
+        if(now >= deadline) { expired = 1; break; }
+        t = deadline - now;
+      }
+      kernel_cv_wait(& ring->lock, & ring->has_ready, SCHED_IO, t);
+    }
+    Mutex_Unlock(& ring->lock);
+    if(expired) break;
+
+    Mutex_Lock(& ring->ctl_lock);
+    int completed = ioring_process(ring);
+    Mutex_Unlock(& ring->ctl_lock);
+
+    /* Other callers may be waiting for these completions */
+    if(completed > 0) {
+      Mutex_Lock(& ring->lock);
+      Cond_Broadcast(& ring->has_ready);
+      Mutex_Unlock(& ring->lock);
+    }
+  }
+
+  FCB_decref(fcb);
+  return submitted;
+}
@@ -0,0 +1,75 @@
+#ifndef __KERNEL_IORING_H
+#define __KERNEL_IORING_H
+
+#include "tinyos.h"
+#include "kernel_streams.h"
+
+/**
+  @file kernel_ioring.h
+  @brief Asynchronous I/O rings.
+
+  @defgroup ioring I/O rings
+  @ingroup kernel
+  @brief Asynchronous I/O rings.
+
+  An I/O ring is a stream whose object holds the submission and
+  completion rings shared with the process (@c io_ring), and the
+  requests in progress.
+
+  Requests are carried out by the threads calling @c IoRingEnter, and
+  never sleep in their streams. A request is tried when it is taken from
+  the submission ring: the readiness of its stream is checked by its
+  @c Poll method. If the stream is ready, the request is carried out
+  by the @c TryRead or @c TryWrite method of the stream, and completed
+  at once. Otherwise, or if the transfer would block after all, the 
+  @c poll_entry of the request is registered at the stream, and the 
+  notification of the stream
+  appends it to the ready list of the ring, as for event queues. Each
+  call to @c IoRingEnter tries the requests on the ready list again.
+  Therefore, the cost of a call depends on the number of requests
+  submitted and of streams which became ready, not on the number of
+  requests in progress.
+
+  The ready list is protected by @c lock, which is taken by the
+  notification of a stream with the lock of its poll queue held.
+  The submission and completion rings and the requests are protected by
+  @c ctl_lock, which is held while the requests are carried out;
+  since the transfers never sleep, neither does a holder of @c ctl_lock.
+
+  Since the requests in progress are at most as many as the entries of
+  the rings, they are taken from a pool allocated with the ring.
+
+  @{
+*/
+
+
+/** @brief A request in progress. */
+typedef struct io_request {
+  poll_entry pe;                /**< @brief The entry at the poll queue of the stream */
+  struct io_ring_cb* ring;      /**< @brief The I/O ring */
+  FCB* fcb;                     /**< @brief The stream (a reference is held) */
+  io_sqe sqe;                   /**< @brief A copy of the submission entry */
+  int on_ready;                 /**< @brief Set while in the ready list */
+  rlnode node;                  /**< @brief Node in the requests of the ring */
+  rlnode ready_node;            /**< @brief Node in the ready list */
+} io_request;
+
+
+/** @brief The stream object of an I/O ring. */
+typedef struct io_ring_cb {
+  Mutex lock;                   /**< @brief Lock for the ready list */
+  Mutex ctl_lock;               /**< @brief Lock for the rings and the requests */
+  CondVar has_ready;            /**< @brief @c IoRingEnter sleeps here */
+  io_request* pool;             /**< @brief The requests, one per ring entry */
+  rlnode free_requests;         /**< @brief The requests not in progress */
+  rlnode requests;              /**< @brief The requests in progress */
+  unsigned int inflight;        /**< @brief The number of requests in progress */
+  rlnode ready;                 /**< @brief The requests whose streams were notified */
+  unsigned int nready;          /**< @brief The length of the ready list */
+  io_ring shared;               /**< @brief The rings shared with the process */
+} io_ring_cb;
+
+
+/** @} */
+
+#endif
@@ -1,9 +1,708 @@
 
 #include "tinyos.h"
+#include "kernel_pipe.h"
+#include "kernel_cc.h"
 
 
-int sys_Pipe(pipe_t* pipe)
+unsigned int pipe_buffer_size = PIPE_BUFFER_SIZE;
+int pipe_spsc_enabled = 1;
+
+
+/* Round the requested capacity to a power of two, in the legal range */
+static size_t pipe_capacity(size_t size)
+{
+  size_t cap = PIPE_MIN_BUFFER_SIZE;
+  while(cap < size && cap < PIPE_MAX_BUFFER_SIZE)
+    cap <<= 1;
+  return cap;
+}
+
+
+pipe_cb* pipe_create(FCB* reader, FCB* writer)
+{
+  size_t cap = pipe_capacity(pipe_buffer_size);
+  pipe_cb* p = xmalloc(sizeof(pipe_cb) + cap);
+
+  p->spinlock = MUTEX_INIT;
+  p->refcount = 2;
+  p->reader = reader;
+  p->writer = writer;
+  p->has_data = COND_INIT;
+  p->has_space = COND_INIT;
+  p->r_position = p->w_position = 0;
+  p->spsc = pipe_spsc_enabled;
+  p->r_active = p->w_active = 0;
+  p->readers_waiting = p->writers_waiting = 0;
+  p->released = COND_INIT;
+  p->claim_waiting = 0;
+  poll_queue_init(& p->pollq[0]);
+  poll_queue_init(& p->pollq[1]);
+  p->reader_pq = & p->pollq[0];
+  p->writer_pq = & p->pollq[1];
+  p->msg = 0;
+  p->msg_left = 0;
+  p->mask = cap-1;
+  return p;
+}
+
+
+void pipe_set_message_mode(pipe_cb* p)
+{
+  p->msg = 1;
+}
+
+
+unsigned int pipe_max_message(pipe_cb* p)
+{
+  return p->mask + 1 - PIPE_MSG_HEADER;
+}
+
+
+/*
+  SPSC mode helpers.
+
+  A caller enters the SPSC data path of an end by setting the end's
+  active flag. If the end is shared (its FCB has other references than 
+  the fid and this call), or another thread is already in the data path 
+  of this end, the pipe switches to locked mode for good.
+
+  After the switch, callers take the lock only after the thread still
+  in the data path of their end has left it. The ring needs no lock 
+  between one reader and one writer, so only callers of the same end
+  must be excluded.
+
+  Splice and Tee claim an end for a whole call, which may sleep inside
+  the other stream. Other callers of the end sleep on @c released until
+  it is released; the @c claim_waiting flag tells the releasing thread
+  that it must take the lock to wake them up. Non-blocking callers do
+  not sleep; the release notifies the poll queue of the end instead.
+ */
+static void spsc_exit(pipe_cb* p, int* active);
+
+static int spsc_enter(pipe_cb* p, int* active, FCB* end)
+{
+  if(! __atomic_load_n(& p->spsc, __ATOMIC_ACQUIRE))
+    return 0;
+
+  if(__atomic_load_n(& end->refcount, __ATOMIC_RELAXED) > 2 
+     || __atomic_exchange_n(active, 1, __ATOMIC_SEQ_CST)) {
+    __atomic_store_n(& p->spsc, 0, __ATOMIC_SEQ_CST);
+    return 0;
+  }
+
+  /* Check again, now that the flag is set */
+  if(! __atomic_load_n(& p->spsc, __ATOMIC_SEQ_CST)) {
+    spsc_exit(p, active);
+    return 0;
+  }
+  return 1;
+}
+
+static void spsc_exit(pipe_cb* p, int* active)
+{
+  __atomic_store_n(active, 0, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(& p->claim_waiting, __ATOMIC_SEQ_CST)) {
+    Mutex_Lock(& p->spinlock);
+    p->claim_waiting = 0;
+    Cond_Broadcast(& p->released);
+    poll_queue* pq = (active == & p->r_active) ? p->reader_pq : p->writer_pq;
+    if(pq) poll_notify(pq);
+    Mutex_Unlock(& p->spinlock);
+  }
+}
+
+/* 
+  Take the lock, once no thread is in the data path of the end. 
+  If block is 0, return 0 without the lock instead of sleeping.
+ */
+static int locked_enter(pipe_cb* p, int* active, int block)
+{
+  Mutex_Lock(& p->spinlock);
+  while(__atomic_load_n(active, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(& p->claim_waiting, 1, __ATOMIC_SEQ_CST);
+    if(! __atomic_load_n(active, __ATOMIC_SEQ_CST)) break;
+    if(! block) {
+      Mutex_Unlock(& p->spinlock);
+      return 0;
+    }
+    kernel_cv_wait(& p->spinlock, & p->released, SCHED_PIPE, NO_TIMEOUT);
+  }
+  return 1;
+}
+
+/* Claim an end, for a call that may sleep holding it */
+static void pipe_claim(pipe_cb* p, int* active, FCB* end)
+{
+  if(spsc_enter(p, active, end)) return;
+  locked_enter(p, active, 1);
+  __atomic_store_n(active, 1, __ATOMIC_RELEASE);
+  Mutex_Unlock(& p->spinlock);
+}
+
+
+/* Copy between the ring and a buffer, at a position that may wrap around */
+static void ring_copy_out(pipe_cb* p, size_t pos, void* buf, size_t count)
+{
+  size_t offset = pos & p->mask;
+  size_t span = p->mask + 1 - offset;
+  if(span > count) span = count;
+  memcpy(buf, p->buffer + offset, span);
+  memcpy((char*)buf + span, p->buffer, count - span);
+}
+
+static void ring_copy_in(pipe_cb* p, size_t pos, const void* buf, size_t count)
+{
+  size_t offset = pos & p->mask;
+  size_t span = p->mask + 1 - offset;
+  if(span > count) span = count;
+  memcpy(p->buffer + offset, buf, span);
+  memcpy(p->buffer, (const char*)buf + span, count - span);
+}
+
+/* The same, for a vector of buffers holding at least count bytes */
+static void ring_copy_outv(pipe_cb* p, size_t pos, const iovec_t* iov, size_t count)
+{
+  for(; count > 0; iov++) {
+    size_t len = (iov->len < count) ? iov->len : count;
+    ring_copy_out(p, pos, iov->base, len);
+    pos += len;
+    count -= len;
+  }
+}
+
+static void ring_copy_inv(pipe_cb* p, size_t pos, const iovec_t* iov, size_t count)
 {
-	return -1;
+  for(; count > 0; iov++) {
+    size_t len = (iov->len < count) ? iov->len : count;
+    ring_copy_in(p, pos, iov->base, len);
+    pos += len;
+    count -= len;
+  }
 }
 
+/* The total size of a vector of buffers */
+static size_t iov_size(const iovec_t* iov, unsigned int n)
+{
+  size_t size = 0;
+  for(unsigned int i = 0; i < n; i++)
+    size += iov[i].len;
+  return size;
+}
+
+
+/*
+  Copy out up to size bytes, in at most two spans. Only one reader
+  may call this at a time.
+ */
+static size_t ring_get(pipe_cb* p, const iovec_t* iov, size_t size)
+{
+  size_t w = __atomic_load_n(& p->w_position, __ATOMIC_ACQUIRE);
+  size_t r = p->r_position;
+  size_t avail = w - r;
+  size_t count = (size < avail) ? size : avail;
+  ring_copy_outv(p, r, iov, count);
+
+  __atomic_store_n(& p->r_position, r + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+
+/*
+  Copy in up to size bytes, in at most two spans. Only one writer
+  may call this at a time.
+ */
+static size_t ring_put(pipe_cb* p, const iovec_t* iov, size_t size)
+{
+  size_t r = __atomic_load_n(& p->r_position, __ATOMIC_ACQUIRE);
+  size_t w = p->w_position;
+  size_t space = p->mask + 1 - (w - r);
+  size_t count = (size < space) ? size : space;
+  ring_copy_inv(p, w, iov, count);
+
+  __atomic_store_n(& p->w_position, w + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+
+/*
+  Copy out up to size bytes of the current message, reading the header
+  of the next message first if needed. Returns 0 if there is no message.
+  Only one reader may call this at a time.
+ */
+static size_t msg_get(pipe_cb* p, const iovec_t* iov, size_t size)
+{
+  size_t w = __atomic_load_n(& p->w_position, __ATOMIC_ACQUIRE);
+  size_t r = p->r_position;
+  if(w == r) return 0;
+
+  if(p->msg_left == 0) {
+    ring_copy_out(p, r, & p->msg_left, PIPE_MSG_HEADER);
+    r += PIPE_MSG_HEADER;
+  }
+
+  size_t count = (size < p->msg_left) ? size : p->msg_left;
+  ring_copy_outv(p, r, iov, count);
+  p->msg_left -= count;
+
+  __atomic_store_n(& p->r_position, r + count, __ATOMIC_RELEASE);
+  return count;
+}
+
+
+/*
+  Copy in a whole message with its header, if there is space for it.
+  Returns 0 if there is not. Only one writer may call this at a time.
+ */
+static size_t msg_put(pipe_cb* p, const iovec_t* iov, size_t size)
+{
+  size_t r = __atomic_load_n(& p->r_position, __ATOMIC_ACQUIRE);
+  size_t w = p->w_position;
+  size_t space = p->mask + 1 - (w - r);
+  if(space < PIPE_MSG_HEADER + size) return 0;
+
+  uint32_t len = size;
+  ring_copy_in(p, w, &len, PIPE_MSG_HEADER);
+  ring_copy_inv(p, w + PIPE_MSG_HEADER, iov, size);
+
+  __atomic_store_n(& p->w_position, w + PIPE_MSG_HEADER + size, __ATOMIC_RELEASE);
+  return size;
+}
+
+
+/*
+  Wake up the sleepers of cv and the pollers of *pq, if the waiting flag
+  shows there may be any. The flag is only set by a thread that found 
+  the buffer empty (or full), or by a poller, so this only happens on 
+  the transitions.
+ */
+static void pipe_wakeup(pipe_cb* p, int* waiting, CondVar* cv, poll_queue** pq)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+    Mutex_Lock(& p->spinlock);
+    *waiting = 0;
+    Cond_Broadcast(cv);
+    if(*pq) poll_notify(*pq);
+    Mutex_Unlock(& p->spinlock);
+  }
+}
+
+
+/*
+  Sleep while the buffer is empty and both ends are open. 
+  Return 1 if there is data, 0 at end of data, and -1 if the read end
+  has been closed. If block is 0, return STREAM_WOULD_BLOCK instead 
+  of sleeping.
+ */
+static int pipe_wait_data(pipe_cb* p, int block)
+{
+  int more;
+  Mutex_Lock(& p->spinlock);
+  while(1) {
+    __atomic_store_n(& p->readers_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(p->reader == NULL) {
+      more = -1; break;
+    }
+    if(__atomic_load_n(& p->w_position, __ATOMIC_ACQUIRE) != p->r_position) {
+      more = 1; break;
+    }
+    if(p->writer == NULL) {
+      more = 0; break;
+    }
+    if(! block) {
+      more = STREAM_WOULD_BLOCK; break;
+    }
+    kernel_cv_wait(& p->spinlock, & p->has_data, SCHED_PIPE, NO_TIMEOUT);
+  }
+  Mutex_Unlock(& p->spinlock);
+  return more;
+}
+
+
+/*
+  Sleep while the buffer has less than need bytes of space and both ends
+  are open. Return 1 if there is space, and -1 if an end is closed. 
+  If block is 0, return STREAM_WOULD_BLOCK instead of sleeping.
+ */
+static int pipe_wait_space(pipe_cb* p, size_t need, int block)
+{
+  int more;
+  Mutex_Lock(& p->spinlock);
+  while(1) {
+    __atomic_store_n(& p->writers_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(p->reader == NULL || p->writer == NULL) {
+      more = -1; break;
+    }
+    if(p->mask + 1 - (p->w_position - __atomic_load_n(& p->r_position, __ATOMIC_ACQUIRE)) >= need) {
+      more = 1; break;
+    }
+    if(! block) {
+      more = STREAM_WOULD_BLOCK; break;
+    }
+    kernel_cv_wait(& p->spinlock, & p->has_space, SCHED_PIPE, NO_TIMEOUT);
+  }
+  Mutex_Unlock(& p->spinlock);
+  return more;
+}
+
+
+/*
+  Read from the pipe into a vector of buffers, sleeping while it is empty 
+  and the write end is open (or returning STREAM_WOULD_BLOCK, if block
+  is 0). Fails if the read end is closed.
+ */
+static int pipe_transfer_out(pipe_cb* p, const iovec_t* iov, unsigned int n, int block)
+{
+  size_t size = iov_size(iov, n);
+
+  while(1) {
+    FCB* end = __atomic_load_n(& p->reader, __ATOMIC_ACQUIRE);
+    if(end == NULL)
+      return -1;
+
+    size_t (*get)(pipe_cb*, const iovec_t*, size_t) = p->msg ? msg_get : ring_get;
+    size_t count;
+    if(spsc_enter(p, & p->r_active, end)) {
+      count = get(p, iov, size);
+      spsc_exit(p, & p->r_active);
+    } else {
+      if(! locked_enter(p, & p->r_active, block))
+        return STREAM_WOULD_BLOCK;
+      count = get(p, iov, size);
+      Mutex_Unlock(& p->spinlock);
+    }
+
+    if(count > 0 || size == 0) {
+      pipe_wakeup(p, & p->writers_waiting, & p->has_space, & p->writer_pq);
+      return count;
+    }
+
+    int more = pipe_wait_data(p, block);
+    if(more <= 0)
+      return more;
+  }
+}
+
+
+int pipe_readv(void* this, const iovec_t* iov, unsigned int n)
+{
+  return pipe_transfer_out(this, iov, n, 1);
+}
+
+
+int pipe_read(void* this, char *buf, unsigned int size)
+{
+  iovec_t iov = { .base = buf, .len = size };
+  return pipe_transfer_out(this, &iov, 1, 1);
+}
+
+
+int pipe_try_read(void* this, char *buf, unsigned int size)
+{
+  iovec_t iov = { .base = buf, .len = size };
+  return pipe_transfer_out(this, &iov, 1, 0);
+}
+
+
+/*
+  Write a vector of buffers to the pipe, sleeping while it is full and
+  the read end is open (or returning STREAM_WOULD_BLOCK, if block is 0).
+  In message mode, the vector is one message.
+ */
+static int pipe_transfer_in(pipe_cb* p, const iovec_t* iov, unsigned int n, int block)
+{
+  size_t size = iov_size(iov, n);
+
+  size_t (*put)(pipe_cb*, const iovec_t*, size_t) = ring_put;
+  size_t need = 1;
+  if(p->msg) {
+    if(size > pipe_max_message(p)) return -1;
+    if(size == 0) return 0;
+    put = msg_put;
+    need = PIPE_MSG_HEADER + size;
+  }
+
+  while(1) {
+    FCB* end = __atomic_load_n(& p->writer, __ATOMIC_ACQUIRE);
+    if(end == NULL || __atomic_load_n(& p->reader, __ATOMIC_ACQUIRE) == NULL)
+      return -1;
+
+    size_t count;
+    if(spsc_enter(p, & p->w_active, end)) {
+      count = put(p, iov, size);
+      spsc_exit(p, & p->w_active);
+    } else {
+      if(! locked_enter(p, & p->w_active, block))
+        return STREAM_WOULD_BLOCK;
+      count = put(p, iov, size);
+      Mutex_Unlock(& p->spinlock);
+    }
+
+    if(count > 0 || size == 0) {
+      pipe_wakeup(p, & p->readers_waiting, & p->has_data, & p->reader_pq);
+      return count;
+    }
+
+    int more = pipe_wait_space(p, need, block);
+    if(more <= 0)
+      return more;
+  }
+}
+
+
+int pipe_writev(void* this, const iovec_t* iov, unsigned int n)
+{
+  return pipe_transfer_in(this, iov, n, 1);
+}
+
+
+int pipe_write(void* this, const char* buf, unsigned int size)
+{
+  iovec_t iov = { .base = (void*) buf, .len = size };
+  return pipe_transfer_in(this, &iov, 1, 1);
+}
+
+
+int pipe_try_write(void* this, const char* buf, unsigned int size)
+{
+  iovec_t iov = { .base = (void*) buf, .len = size };
+  return pipe_transfer_in(this, &iov, 1, 0);
+}
+
+
+/*
+  Pass the buffered data to the Write method of another stream, 
+  one contiguous span at a time.
+ */
+int pipe_splice_to(void* this, file_ops* out_ops, void* out, unsigned int size, int consume)
+{
+  pipe_cb* p = this;
+
+  while(1) {
+    FCB* end = __atomic_load_n(& p->reader, __ATOMIC_ACQUIRE);
+    if(end == NULL)
+      return -1;
+
+    pipe_claim(p, & p->r_active, end);
+
+    size_t r = p->r_position;
+    size_t avail = __atomic_load_n(& p->w_position, __ATOMIC_ACQUIRE) - r;
+
+    if(avail > 0 || size == 0) {
+      size_t count = (size < avail) ? size : avail;
+      size_t done = 0;
+      int rc = 0;
+      while(done < count) {
+        size_t offset = (r + done) & p->mask;
+        size_t span = p->mask + 1 - offset;
+        if(span > count - done) span = count - done;
+        rc = out_ops->Write(out, p->buffer + offset, span);
+        if(rc <= 0) break;
+        done += rc;
+        if((size_t) rc < span) break;
+      }
+
+      if(consume && done > 0)
+        __atomic_store_n(& p->r_position, r + done, __ATOMIC_RELEASE);
+      spsc_exit(p, & p->r_active);
+
+      if(consume && done > 0)
+        pipe_wakeup(p, & p->writers_waiting, & p->has_space, & p->writer_pq);
+      return (done > 0) ? done : rc;
+    }
+
+    spsc_exit(p, & p->r_active);
+    int more = pipe_wait_data(p, 1);
+    if(more <= 0)
+      return more;
+  }
+}
+
+
+/*
+  Fill the buffer from the Read method of another stream.
+ */
+int pipe_splice_from(void* this, file_ops* in_ops, void* in, unsigned int size)
+{
+  pipe_cb* p = this;
+
+  while(1) {
+    FCB* end = __atomic_load_n(& p->writer, __ATOMIC_ACQUIRE);
+    if(end == NULL || __atomic_load_n(& p->reader, __ATOMIC_ACQUIRE) == NULL)
+      return -1;
+
+    pipe_claim(p, & p->w_active, end);
+
+    size_t w = p->w_position;
+    size_t space = p->mask + 1 - (w - __atomic_load_n(& p->r_position, __ATOMIC_ACQUIRE));
+
+    if(space > 0 || size == 0) {
+      size_t offset = w & p->mask;
+      size_t span = p->mask + 1 - offset;
+      if(span > space) span = space;
+      if(span > size) span = size;
+
+      int rc = in_ops->Read(in, p->buffer + offset, span);
+
+      if(rc > 0)
+        __atomic_store_n(& p->w_position, w + rc, __ATOMIC_RELEASE);
+      spsc_exit(p, & p->w_active);
+
+      if(rc > 0)
+        pipe_wakeup(p, & p->readers_waiting, & p->has_data, & p->reader_pq);
+      return rc;
+    }
+
+    spsc_exit(p, & p->w_active);
+    int more = pipe_wait_space(p, 1, 1);
+    if(more <= 0)
+      return more;
+  }
+}
+
+
+/*
+  Closing an end wakes up the sleepers and pollers of both ends, since
+  callers of the closed end may be asleep in it too.
+ */
+int pipe_reader_shut(pipe_cb* p)
+{
+  Mutex_Lock(& p->spinlock);
+  int open = (p->reader != NULL);
+  __atomic_store_n(& p->reader, NULL, __ATOMIC_RELEASE);
+  if(p->reader_pq) poll_notify(p->reader_pq);
+  p->reader_pq = NULL;
+  Cond_Broadcast(& p->has_data);
+  Cond_Broadcast(& p->has_space);
+  if(p->writer_pq) poll_notify(p->writer_pq);
+  Mutex_Unlock(& p->spinlock);
+  return open;
+}
+
+
+int pipe_writer_shut(pipe_cb* p)
+{
+  Mutex_Lock(& p->spinlock);
+  int open = (p->writer != NULL);
+  __atomic_store_n(& p->writer, NULL, __ATOMIC_RELEASE);
+  if(p->writer_pq) poll_notify(p->writer_pq);
+  p->writer_pq = NULL;
+  Cond_Broadcast(& p->has_data);
+  Cond_Broadcast(& p->has_space);
+  if(p->reader_pq) poll_notify(p->reader_pq);
+  Mutex_Unlock(& p->spinlock);
+  return open;
+}
+
+
+void pipe_release(pipe_cb* p)
+{
+  if(__atomic_sub_fetch(& p->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    free(p);
+}
+
+
+int pipe_reader_close(void* this)
+{
+  pipe_reader_shut(this);
+  pipe_release(this);
+  return 0;
+}
+
+
+int pipe_writer_close(void* this)
+{
+  pipe_writer_shut(this);
+  pipe_release(this);
+  return 0;
+}
+
+
+int pipe_reader_poll(void* this, poll_entry* pe)
+{
+  pipe_cb* p = this;
+  int mask = 0;
+
+  Mutex_Lock(& p->spinlock);
+  if(pe && p->reader_pq) {
+    poll_register(p->reader_pq, pe);
+    __atomic_store_n(& p->readers_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  if(p->reader == NULL)
+    mask = POLL_HANGUP;    /* The read end is shut down */
+  else {
+    if(__atomic_load_n(& p->w_position, __ATOMIC_ACQUIRE) != p->r_position)
+      mask |= POLL_READ;
+    if(p->writer == NULL)
+      mask |= POLL_READ | POLL_HANGUP;
+  }
+  Mutex_Unlock(& p->spinlock);
+  return mask;
+}
+
+
+int pipe_writer_poll(void* this, poll_entry* pe)
+{
+  pipe_cb* p = this;
+  int mask = 0;
+  size_t need = p->msg ? PIPE_MSG_HEADER + 1 : 1;
+
+  Mutex_Lock(& p->spinlock);
+  if(pe && p->writer_pq) {
+    poll_register(p->writer_pq, pe);
+    __atomic_store_n(& p->writers_waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  /* Nothing is reported once the write end is shut down */
+  if(p->writer != NULL) {
+    if(p->reader == NULL)
+      mask |= POLL_ERROR;
+    else if(p->mask + 1 - (p->w_position - __atomic_load_n(& p->r_position, __ATOMIC_ACQUIRE)) >= need)
+      mask |= POLL_WRITE;
+  }
+  Mutex_Unlock(& p->spinlock);
+  return mask;
+}
+
+
+static file_ops pipe_reader_fops = {
+  .Read = pipe_read,
+  .TryRead = pipe_try_read,
+  .ReadV = pipe_readv,
+  .Close = pipe_reader_close,
+  .SpliceTo = pipe_splice_to,
+  .Poll = pipe_reader_poll
+};
+
+static file_ops pipe_writer_fops = {
+  .Write = pipe_write,
+  .TryWrite = pipe_try_write,
+  .WriteV = pipe_writev,
+  .Close = pipe_writer_close,
+  .SpliceFrom = pipe_splice_from,
+  .Poll = pipe_writer_poll
+};
+
+
+int sys_Pipe(pipe_t* pipe)
+{
+  Fid_t fid[2];
+  FCB* fcb[2];
+
+  if(! FCB_reserve(2, fid, fcb))
+    return -1;
+
+  pipe_cb* p = pipe_create(fcb[0], fcb[1]);
+
+  fcb[0]->streamobj = p;
+  fcb[0]->streamfunc = &pipe_reader_fops;
+  fcb[1]->streamobj = p;
+  fcb[1]->streamfunc = &pipe_writer_fops;
+
+  pipe->read = fid[0];
+  pipe->write = fid[1];
+  return 0;
+}
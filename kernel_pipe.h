@@ -0,0 +1,224 @@
+#ifndef __KERNEL_PIPE_H
+#define __KERNEL_PIPE_H
+
+#include "tinyos.h"
+#include "kernel_streams.h"
+
+/**
+  @file kernel_pipe.h
+  @brief Pipes.
+
+  @defgroup pipe Pipes
+  @ingroup kernel
+  @brief Pipes.
+
+  A pipe is a ring buffer shared by two streams, the read end and
+  the write end. The capacity of the buffer is a power of two, so that
+  the read and write positions are free-running counters, and the
+  offset of a position in the buffer is obtained by masking.
+
+  Data is copied in and out of the buffer in whole spans (at most two
+  per call, when the span wraps around the end of the buffer, and one
+  or two per buffer for the vectored calls).
+  Readers sleep only when the buffer is empty and writers only when it
+  is full; therefore, they are woken up only on the empty to non-empty
+  and full to non-full transitions.
+
+  A new pipe starts in single-producer/single-consumer (SPSC) mode.
+  In this mode, the reader only stores @c r_position and the writer only
+  stores @c w_position (with release semantics), so that the data path
+  takes no lock. The lock is only taken to sleep and to wake up a sleeper,
+  using the @c readers_waiting and @c writers_waiting flags.
+  Once an end is shared (by @c Dup2, by @c Exec, or by two threads
+  calling into the same end at once), the pipe falls back for good to the
+  locked mode, where every call holds @c spinlock.
+
+  The read end supports the @c SpliceTo hook, which passes spans of the
+  buffer to the @c Write method of another stream, and the write end the
+  @c SpliceFrom hook, which fills the buffer by the @c Read method of
+  another stream. These calls hold their end (by @c r_active or @c w_active)
+  while the other stream may sleep; other callers of the same end sleep on
+  @c released until the end is released.
+
+  @{
+*/
+
+/** @brief The default capacity of a pipe buffer, in bytes. */
+#ifndef PIPE_BUFFER_SIZE
+#define PIPE_BUFFER_SIZE (16*1024)
+#endif
+
+/** @brief The size of the header of each message, in message mode. */
+#define PIPE_MSG_HEADER sizeof(uint32_t)
+
+/** @brief The smallest capacity of a pipe buffer, in bytes. */
+#define PIPE_MIN_BUFFER_SIZE 64
+
+/** @brief The largest capacity of a pipe buffer, in bytes. */
+#define PIPE_MAX_BUFFER_SIZE (16*1024*1024)
+
+
+/**
+  @brief Pipe control block.
+
+  This is the stream object for both ends of a pipe.
+ */
+typedef struct pipe_control_block {
+  Mutex spinlock;          /**< @brief Lock for this object */
+  unsigned int refcount;   /**< @brief The holders of this object, one for each end at first */
+
+  FCB* reader;             /**< @brief The read end, or NULL if closed */
+  FCB* writer;             /**< @brief The write end, or NULL if closed */
+
+  CondVar has_data;        /**< @brief Readers wait here for the buffer to become non-empty */
+  CondVar has_space;       /**< @brief Writers wait here for the buffer to become non-full */
+
+  size_t r_position;       /**< @brief Total bytes read (free-running) */
+  size_t w_position;       /**< @brief Total bytes written (free-running) */
+
+  int spsc;                /**< @brief Set while in SPSC mode */
+  int r_active;            /**< @brief Set while a reader is in the SPSC data path */
+  int w_active;            /**< @brief Set while a writer is in the SPSC data path */
+  int readers_waiting;     /**< @brief Set when a reader may sleep on @c has_data */
+  int writers_waiting;     /**< @brief Set when a writer may sleep on @c has_space */
+  CondVar released;        /**< @brief Callers wait here for a claimed end to be released */
+  int claim_waiting;       /**< @brief Set when a caller may sleep on @c released */
+
+  poll_queue* reader_pq;   /**< @brief The poll queue of the read end, or NULL if closed */
+  poll_queue* writer_pq;   /**< @brief The poll queue of the write end, or NULL if closed */
+  poll_queue pollq[2];     /**< @brief The poll queues of the ends of a plain pipe */
+
+  int msg;                 /**< @brief Set in message mode */
+  uint32_t msg_left;       /**< @brief Bytes of the current message not yet read */
+
+  size_t mask;             /**< @brief The capacity of the buffer minus 1 */
+  char buffer[];           /**< @brief The ring buffer */
+} pipe_cb;
+
+
+/**
+  @brief The capacity of the buffer of new pipes, in bytes.
+
+  This is rounded up to a power of two, in the range
+  @c PIPE_MIN_BUFFER_SIZE to @c PIPE_MAX_BUFFER_SIZE, when a pipe is created.
+  The default is @c PIPE_BUFFER_SIZE.
+ */
+extern unsigned int pipe_buffer_size;
+
+/**
+  @brief Allow new pipes to start in SPSC mode.
+
+  If 0, new pipes use the locked mode from the start. The default is 1.
+ */
+extern int pipe_spsc_enabled;
+
+
+/**
+  @brief Create a pipe object.
+
+  The new pipe is connected to the two FCBs, which are not initialized
+  by this call. Besides @c Pipe(), this is used by sockets, which are
+  connected by a pair of pipes.
+
+  @param reader the FCB of the read end
+  @param writer the FCB of the write end
+  @returns the new pipe object
+ */
+pipe_cb* pipe_create(FCB* reader, FCB* writer);
+
+/**
+  @brief Put a new pipe in message mode.
+
+  This must be called before the pipe is used.
+ */
+void pipe_set_message_mode(pipe_cb* p);
+
+/**
+  @brief The largest message that can be written to a message pipe.
+
+  A @c Write of a longer message fails.
+ */
+unsigned int pipe_max_message(pipe_cb* p);
+
+/** @brief The @c Read method of the read end of a pipe. */
+int pipe_read(void* this, char *buf, unsigned int size);
+
+/** @brief The @c Write method of the write end of a pipe. */
+int pipe_write(void* this, const char* buf, unsigned int size);
+
+/** @brief The @c TryRead method of the read end of a pipe. */
+int pipe_try_read(void* this, char *buf, unsigned int size);
+
+/** @brief The @c TryWrite method of the write end of a pipe. 
+
+  In message mode, this writes the whole message or nothing.
+ */
+int pipe_try_write(void* this, const char* buf, unsigned int size);
+
+/** @brief The @c ReadV method of the read end of a pipe. */
+int pipe_readv(void* this, const iovec_t* iov, unsigned int n);
+
+/** @brief The @c WriteV method of the write end of a pipe. 
+
+  In message mode, the whole vector is written as one message.
+ */
+int pipe_writev(void* this, const iovec_t* iov, unsigned int n);
+
+/**
+  @brief Close the read end of a pipe, without releasing the pipe.
+
+  Callers of either end that are asleep in the pipe are woken up; 
+  later calls to the read end fail, and so do writes.
+  This is used by sockets, which hold their pipes until they are closed,
+  so that @c ShutDown cannot free a pipe under a concurrent call.
+
+  @returns 1 if the read end was open, 0 otherwise
+ */
+int pipe_reader_shut(pipe_cb* p);
+
+/**
+  @brief Close the write end of a pipe, without releasing the pipe.
+
+  Callers of either end that are asleep in the pipe are woken up; 
+  later calls to the write end fail, and reads return 0 once the
+  buffer is empty.
+
+  @returns 1 if the write end was open, 0 otherwise
+ */
+int pipe_writer_shut(pipe_cb* p);
+
+/**
+  @brief Drop a reference to a pipe.
+
+  A pipe starts with one reference for each end, and is freed when the
+  last one is dropped.
+ */
+void pipe_release(pipe_cb* p);
+
+/** @brief The @c Close method of the read end of a pipe. 
+
+  This closes the read end and releases its reference to the pipe.
+ */
+int pipe_reader_close(void* this);
+
+/** @brief The @c Close method of the write end of a pipe. 
+
+  This closes the write end and releases its reference to the pipe.
+ */
+int pipe_writer_close(void* this);
+
+/** @brief The @c Poll method of the read end of a pipe. */
+int pipe_reader_poll(void* this, poll_entry* pe);
+
+/** @brief The @c Poll method of the write end of a pipe. */
+int pipe_writer_poll(void* this, poll_entry* pe);
+
+/** @brief The @c SpliceTo method of the read end of a pipe. */
+int pipe_splice_to(void* this, file_ops* out_ops, void* out, unsigned int size, int consume);
+
+/** @brief The @c SpliceFrom method of the write end of a pipe. */
+int pipe_splice_from(void* this, file_ops* in_ops, void* in, unsigned int size);
+
+/** @} */
+
+#endif
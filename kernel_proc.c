@@ -36,6 +36,7 @@ static inline void initialize_PCB(PCB* pcb)
   pcb->argl = 0;
   pcb->args = NULL;
 
+  pcb->fidt_spinlock = MUTEX_INIT;
   for(int i=0;i<MAX_FILEID;i++)
     pcb->FIDT[i] = NULL;
 
@@ -51,6 +52,9 @@ static inline void initialize_PCB(PCB* pcb)
 
 static PCB* pcb_freelist;
 
+/* Lock for pcb_freelist and process_count */
+static Mutex pcb_freelist_spinlock = MUTEX_INIT;
+
 void initialize_processes()
 {
   /* initialize the PCBs */
@@ -75,32 +79,30 @@ void initialize_processes()
 }
 
 
-/*
-  Must be called with kernel_mutex held
-*/
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  Mutex_Lock(& pcb_freelist_spinlock);
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
+  Mutex_Unlock(& pcb_freelist_spinlock);
 
   return pcb;
 }
 
-/*
-  Must be called with kernel_mutex held
-*/
 void release_PCB(PCB* pcb)
 {
+  Mutex_Lock(& pcb_freelist_spinlock);
   pcb->pstate = FREE;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
   process_count--;
+  Mutex_Unlock(& pcb_freelist_spinlock);
 }
 
 
@@ -172,11 +174,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
+    Mutex_Lock(& curproc->fidt_spinlock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(& curproc->fidt_spinlock);
   }
 
 
@@ -198,7 +202,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = thread_init(NULL, newproc, start_main_thread, call, argl, newproc->args);
     wakeup(newproc->main_thread);
   }
 
@@ -61,6 +61,11 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
+  Mutex fidt_spinlock;    /**< @brief Lock for @c FIDT 
+
+                             The system calls on streams do not hold the kernel
+                             lock, therefore all accesses to @c FIDT by a live
+                             process must hold this lock. */
   FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
 
 } PCB;
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <errno.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
@@ -11,10 +12,20 @@
 #include <valgrind/valgrind.h>
 #endif
 
+#ifndef YIELD_CALLS
 #define YIELD_CALLS 2000  // here is the maximum yield calls for the threads boosting
-#define PRIORITY_QUEUES 50 // we have choose 50 queues for the MLFQ
+#endif
+
+unsigned int sched_boost_period = YIELD_CALLS;
+
+/* The total number of yield calls, over all cores */
+static unsigned int yield_calls;
 
-int yield_calls;
+/* Incremented at every priority boost */
+static unsigned int boost_epoch;
+
+/* The number of priority boosts so far */
+static unsigned long boost_count;
 /********************************************
 	
 	Core table and CCB-related declarations.
@@ -95,25 +106,58 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/*
+  When MMAPPED_THREAD_MEM is defined (the default, see the Makefile), thread
+  blocks are allocated with mmap, and the page between the TCB and the stack
+  is a guard page, with access PROT_NONE. Since the stack grows downwards,
+  towards the TCB, a stack overflow is detected as a seg.fault, instead of
+  silently corrupting the TCB.
+
+  +-------------+
+  |   TCB       |
+  +-------------+
+  | guard page  |
+  +-------------+
+  |             |
+  |    stack    |
+  |      ^      |
+  |      |      |
+  +-------------+
+ */
+#ifdef MMAPPED_THREAD_MEM
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+#else
+#define THREAD_GUARD_SIZE 0
+#endif
+
+/* The size of the memory block of a thread with the given stack size */
+#define THREAD_BLOCK_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
+
+#define THREAD_SIZE THREAD_BLOCK_SIZE(THREAD_STACK_SIZE)
 
-//#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread, with a guard page below the stack.
  */
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
 void* allocate_thread(size_t size)
 {
 	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
 
+	/* 
+	  Each guard page splits the mapping, so it costs one more entry in the
+	  process memory map. When the limit of the map count is reached 
+	  (vm.max_map_count), mprotect fails with ENOMEM and the thread simply
+	  runs without a guard page.
+	 */
+	if (mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE) != 0)
+		assert(errno == ENOMEM);
+
 	return ptr;
 }
 #else
@@ -132,6 +176,77 @@ void* allocate_thread(size_t size)
 #endif
 
 
+/*
+  The thread pool.
+  ----------------
+
+  Thread blocks (TCB and stack) are not returned to the allocator when a
+  thread is released, but kept for reuse. Reused blocks have already been
+  faulted in, so a new thread does not pay for page faults on its stack.
+
+  Each core keeps a small cache of free blocks in its CCB, which is only
+  touched by the core itself with preemption off, so it needs no lock.
+  When the cache is empty, a batch of blocks is taken from the global depot,
+  and when it is full, a batch is moved to the depot. Only when the depot
+  is also empty is a new block allocated.
+
+  The free blocks in the depot are linked through an rlnode stored at the
+  start of each block.
+*/
+static rlnode thread_depot;
+static Mutex thread_depot_spinlock = MUTEX_INIT;
+static unsigned long thread_allocs; /* blocks allocated so far */
+
+static TCB* thread_pool_get()
+{
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	if (core->thread_cache_count > 0)
+		core->thread_cache_hits++;
+	else {
+		core->thread_cache_misses++;
+		Mutex_Lock(&thread_depot_spinlock);
+		while (core->thread_cache_count < THREAD_CACHE_BATCH && !is_rlist_empty(&thread_depot))
+			core->thread_cache[core->thread_cache_count++] = rlist_pop_front(&thread_depot);
+		Mutex_Unlock(&thread_depot_spinlock);
+	}
+
+	void* ptr = NULL;
+	if (core->thread_cache_count > 0)
+		ptr = core->thread_cache[--core->thread_cache_count];
+
+	if (preempt)
+		preempt_on;
+
+	if (ptr == NULL) {
+		/* The allocated thread size must be a multiple of page size */
+		ptr = allocate_thread(THREAD_SIZE);
+		__atomic_add_fetch(&thread_allocs, 1, __ATOMIC_RELAXED);
+	}
+	return (TCB*)ptr;
+}
+
+static void thread_pool_put(TCB* tcb)
+{
+	int preempt = preempt_off;
+	CCB* core = &CURCORE;
+
+	if (core->thread_cache_count == THREAD_CACHE_SIZE) {
+		Mutex_Lock(&thread_depot_spinlock);
+		for (int i = 0; i < THREAD_CACHE_BATCH; i++) {
+			rlnode* node = rlnode_init(core->thread_cache[--core->thread_cache_count], NULL);
+			rlist_push_front(&thread_depot, node);
+		}
+		Mutex_Unlock(&thread_depot_spinlock);
+	}
+	core->thread_cache[core->thread_cache_count++] = tcb;
+
+	if (preempt)
+		preempt_on;
+}
+
+
 
 
 /*
@@ -155,8 +270,27 @@ static void thread_start()
 
 TCB* spawn_thread(PCB* pcb, void (*func)())
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	return spawn_thread_stack(pcb, func, THREAD_STACK_SIZE);
+}
+
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* Round the stack size to whole pages, within limits */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	if (stack_size < THREAD_MIN_STACK_SIZE)
+		stack_size = THREAD_MIN_STACK_SIZE;
+	if (stack_size > THREAD_MAX_STACK_SIZE)
+		stack_size = THREAD_MAX_STACK_SIZE;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	/* Only blocks of the default size are pooled */
+	TCB* tcb;
+	if (stack_size == THREAD_STACK_SIZE)
+		tcb = thread_pool_get();
+	else
+		tcb = (TCB*)allocate_thread(THREAD_BLOCK_SIZE(stack_size));
+	tcb->stack_size = stack_size;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -164,6 +298,9 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->owner_pcb = pcb;
 	tcb->ptcb = NULL;
 	tcb->priority = PRIORITY_QUEUES - 1;
+	tcb->state_spinlock = MUTEX_INIT;
+	tcb->last_core = cpu_core_id;
+	tcb->boost_epoch = __atomic_load_n(&boost_epoch, __ATOMIC_RELAXED);
 
 	/* Initialize the other attributes */
 	tcb->type = NORMAL_THREAD;
@@ -179,13 +316,13 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -197,7 +334,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called from gain(), after the TCB has been switched out for good.
  */
 void release_TCB(TCB* tcb)
 {
@@ -205,7 +342,10 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_pool_put(tcb);
+	else
+		free_thread(tcb, THREAD_BLOCK_SIZE(tcb->stack_size));
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -223,18 +363,146 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
+  Each core has its own ready queues, one doubly linked list per priority
+  level, stored in its CCB and protected by the CCB's sched_spinlock.
+  A ready thread is queued at the core it last ran on, so that threads tend
+  to stay on the same core. An idle core steals work from the core with the
+  most ready threads before it halts.
+
+  The state and phase of each thread are protected by the thread's own
+  state_spinlock. Therefore, a wakeup() or a yield() only touches the locks of
+  the threads and the cores involved.
+
+  Also, the scheduler keeps all the sleeping threads with a timeout in a
+  timer wheel, protected by timeout_spinlock.
+
+  Lock order:  TCB.state_spinlock  -->  CCB.sched_spinlock
+               TCB.state_spinlock  -->  timeout_spinlock
+  The timeout handling, which must go against this order, uses a try-lock.
+*/
+
+_Static_assert(PRIORITY_QUEUES <= 64, "The ready_mask of a CCB has 64 bits");
+
+Mutex timeout_spinlock = MUTEX_INIT; /* spinlock for the timer wheel */
+
+/* Try to lock a TCB without spinning. Returns 1 on success. */
+static inline int tcb_trylock(TCB* tcb)
+{
+	return ! __atomic_test_and_set(&tcb->state_spinlock, __ATOMIC_ACQUIRE);
+}
+
+/*
+  The timer wheel.
+  ----------------
+
+  Time is measured in ticks of TIMER_TICK usec. The wheel has TIMER_LEVELS
+  levels of TIMER_SLOTS slots each. A slot of level l holds the threads whose
+  wakeup tick falls within a span of TIMER_SLOTS^l ticks. Level 0 slots hold
+  the threads expiring at one particular tick.
+
+  Every time the level-0 index wraps around, the current slot of level 1 is 
+  cascaded down, i.e., its threads are re-inserted into the wheel, and so on
+  for higher levels. Threads whose time has come are moved to TIMER_EXPIRED,
+  from where they are made ready.
+
+  Thus, inserting and cancelling a timeout take O(1) time, independently of
+  the number of sleeping threads. Timeouts beyond the span of the wheel are 
+  parked in the farthest slot, and re-inserted when they are cascaded.
+
+  The intrusive sched_node of a TCB is used, since a sleeping thread is
+  never in a ready queue.
+*/
+
+#define TIMER_TICK 1000ul  /* usec per tick */
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+static rlnode TIMER_WHEEL[TIMER_LEVELS][TIMER_SLOTS];
+static rlnode TIMER_EXPIRED;  /* Threads whose timeout has expired */
+static TimerDuration timer_now;  /* The last tick processed by the wheel */
+static volatile uint timeout_count;  /* Number of threads in the wheel and TIMER_EXPIRED */
+
+/* The index of the slot for expiry tick t at the given level */
+#define TIMER_INDEX(t, level) (((t) >> ((level)*TIMER_BITS)) & TIMER_MASK)
+
+static inline TimerDuration timer_tick_of(TimerDuration usec)
+{
+	/* Round up, so that we never wake up early */
+	return (usec + TIMER_TICK - 1) / TIMER_TICK;
+}
+
+/*
+  Insert a thread into the wheel, relative to timer_now.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_insert(TCB* tcb)
+{
+	TimerDuration expires = timer_tick_of(tcb->wakeup_time);
+
+	if (expires <= timer_now) {
+		rlist_push_back(&TIMER_EXPIRED, &tcb->sched_node);
+		return;
+	}
 
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
+	TimerDuration delta = expires - timer_now;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >= (1ull << ((level + 1) * TIMER_BITS)))
+		level++;
+
+	/* Park far away timeouts at the end of the wheel */
+	if (delta >= (1ull << (TIMER_LEVELS * TIMER_BITS)))
+		expires = timer_now + (1ull << (TIMER_LEVELS * TIMER_BITS)) - 1;
+
+	rlist_push_back(&TIMER_WHEEL[level][TIMER_INDEX(expires, level)], &tcb->sched_node);
+}
 
-  Both of these structures are protected by @c sched_spinlock.
+/*
+  Re-insert all threads of a slot.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
 */
+static void timer_wheel_cascade(int level)
+{
+	rlnode slot;
+	rlnode_new(&slot);
+	rlist_append(&slot, &TIMER_WHEEL[level][TIMER_INDEX(timer_now, level)]);
+
+	while (!is_rlist_empty(&slot))
+		timer_wheel_insert(rlist_pop_front(&slot)->tcb);
+}
+
+/*
+  Advance the wheel up to the tick of curtime, moving expired threads
+  to TIMER_EXPIRED.
+
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timer_wheel_advance(TimerDuration curtime)
+{
+	TimerDuration curtick = curtime / TIMER_TICK;
+
+	while (timer_now < curtick) {
+		/* Nothing to do on an empty wheel */
+		if (timeout_count == 0) {
+			timer_now = curtick;
+			break;
+		}
+
+		timer_now++;
+
+		/* Cascade the higher levels whose turn has come */
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			if (TIMER_INDEX(timer_now, level - 1) != 0)
+				break;
+			timer_wheel_cascade(level);
+		}
 
-rlnode SCHED[PRIORITY_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+		rlist_append(&TIMER_EXPIRED, &TIMER_WHEEL[0][TIMER_INDEX(timer_now, 0)]);
+	}
+}
 
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
@@ -245,9 +513,9 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Possibly add TCB to the scheduler timer wheel.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
@@ -256,45 +524,107 @@ static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 		TimerDuration curtime = bios_clock();
 		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		Mutex_Lock(&timeout_spinlock);
+		timer_wheel_advance(curtime);
+		timer_wheel_insert(tcb);
+		timeout_count++;
+		Mutex_Unlock(&timeout_spinlock);
+	}
+}
+
+/*
+  Anti-starvation for the MLFQ.
+
+  Every sched_boost_period calls to yield(), all threads are moved to the
+  highest priority level. The ready threads of every core are moved
+  eagerly by sched_boost(). Threads that are not in a ready queue at the
+  time (running or sleeping) are boosted lazily by sched_boost_check(), the
+  next time they pass through the scheduler, by comparing the epoch of
+  their last boost with the global boost_epoch.
+
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static void sched_boost_check(TCB* tcb)
+{
+	unsigned int epoch = __atomic_load_n(&boost_epoch, __ATOMIC_RELAXED);
+	if (tcb->boost_epoch != epoch) {
+		tcb->boost_epoch = epoch;
+		tcb->priority = PRIORITY_QUEUES - 1;
+	}
+}
+
+static void sched_boost()
+{
+	unsigned int epoch = __atomic_add_fetch(&boost_epoch, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&boost_count, 1, __ATOMIC_RELAXED);
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* core = &cctx[c];
+		rlnode* top = &core->ready_queue[PRIORITY_QUEUES - 1];
+
+		Mutex_Lock(&core->sched_spinlock);
+		/* Keep the relative order of the levels: higher levels go first */
+		for (int level = PRIORITY_QUEUES - 2; level >= 0; level--) {
+			rlnode* queue = &core->ready_queue[level];
+			if (is_rlist_empty(queue))
+				continue;
+			for (rlnode* p = queue->next; p != queue; p = p->next) {
+				p->tcb->priority = PRIORITY_QUEUES - 1;
+				p->tcb->boost_epoch = epoch;
+			}
+			rlist_append(top, queue);
+		}
+		if (core->ready_count > 0)
+			core->ready_mask = 1ull << (PRIORITY_QUEUES - 1);
+		Mutex_Unlock(&core->sched_spinlock);
 	}
 }
 
 /*
-  Add TCB to the end of the scheduler list.
+  Add TCB to the end of the ready queue of its priority, at the
+  core it last ran on.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_queue_add(TCB* tcb)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb -> priority], &tcb->sched_node);
+	CCB* core = &cctx[tcb->last_core];
+
+	/* A thread that slept through a boost is boosted now */
+	sched_boost_check(tcb);
 
-	/* Restart possibly halted cores */
+	/* Insert at the end of the scheduling list */
+	Mutex_Lock(&core->sched_spinlock);
+	rlist_push_back(&core->ready_queue[tcb->priority], &tcb->sched_node);
+	core->ready_mask |= 1ull << tcb->priority;
+	core->ready_count++;
+	core->level_enqueued[tcb->priority]++;
+	Mutex_Unlock(&core->sched_spinlock);
+
+	/* Restart possibly halted cores: the owner of the queue if it sleeps, 
+	   else somebody who can steal the thread */
+	if (core != &CURCORE)
+		cpu_core_restart(core->id);
 	cpu_core_restart_one();
 }
 
 /*
 	Adjust the state of a thread to make it READY.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
 static void sched_make_ready(TCB* tcb)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timer wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in some slot of the wheel, or in TIMER_EXPIRED; fix it */
+		Mutex_Lock(&timeout_spinlock);
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
 		rlist_remove(&tcb->sched_node);
+		timeout_count--;
+		Mutex_Unlock(&timeout_spinlock);
 		tcb->wakeup_time = NO_TIMEOUT;
 	}
 
@@ -307,59 +637,150 @@ static void sched_make_ready(TCB* tcb)
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Advance the timer wheel and wake up the threads whose timeout
+  has expired.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Since this goes against the lock order, a thread whose state_spinlock is
+  busy is left in TIMER_EXPIRED for the next call.
 */
 static void sched_wakeup_expired_timeouts()
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	/* A quick check without locking, which is the common case */
+	if (timeout_count == 0)
+		return;
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
+	TimerDuration curtime = bios_clock();
+	if (curtime / TIMER_TICK == timer_now && is_rlist_empty(&TIMER_EXPIRED))
+		return;
+
+	Mutex_Lock(&timeout_spinlock);
+	timer_wheel_advance(curtime);
+
+	while (1) {
+		/* Find an expired thread that we can lock */
+		TCB* tcb = NULL;
+		for (rlnode* n = TIMER_EXPIRED.next; n != &TIMER_EXPIRED; n = n->next)
+			if (tcb_trylock(n->tcb)) {
+				tcb = n->tcb;
+				break;
+			}
+		if (tcb == NULL)
 			break;
+
+		/* Take it out of the list ourselves */
+		rlist_remove(&tcb->sched_node);
+		timeout_count--;
+		tcb->wakeup_time = NO_TIMEOUT;
+		Mutex_Unlock(&timeout_spinlock);
+
 		sched_make_ready(tcb);
+		Mutex_Unlock(&tcb->state_spinlock);
+
+		Mutex_Lock(&timeout_spinlock);
 	}
+	Mutex_Unlock(&timeout_spinlock);
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Pop the highest priority thread from the ready queues of a core,
+  or return NULL if they are empty.
+
+  The highest non-empty level is the highest set bit of ready_mask,
+  so this takes constant time.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
 */
-static TCB* sched_queue_select(TCB* current)
+static TCB* sched_queue_pop(CCB* core)
 {
-	int maxPriority = 0;
-	int i;
+	if (core->ready_mask == 0)
+		return NULL;
 
-	//here traverse all queues to find the highest priority thread 
-	//Check if we have empty queues
-	for( i = PRIORITY_QUEUES - 1; i >= 0; i--){
-		int emptyQueue = is_rlist_empty(&SCHED[i]);
+	int level = 63 - __builtin_clzll(core->ready_mask);
+	rlnode* queue = &core->ready_queue[level];
+	assert(!is_rlist_empty(queue));
 
-		//check for emply queues
-		if(emptyQueue == 0){
-			maxPriority = i;
-			break;
+	TCB* tcb = rlist_pop_front(queue)->tcb;
+	if (is_rlist_empty(queue))
+		core->ready_mask &= ~(1ull << level);
+	core->ready_count--;
+
+	return tcb;
+}
+
+/*
+  Steal the highest priority thread of the core with the most
+  ready threads. Return NULL if no core has ready threads.
+*/
+static TCB* sched_steal()
+{
+	CCB* victim = NULL;
+	uint maxcount = 0;
+
+	/* Find the busiest core, without locking */
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (c != cpu_core_id && cctx[c].ready_count > maxcount) {
+			victim = &cctx[c];
+			maxcount = victim->ready_count;
 		}
 	}
+	if (victim == NULL)
+		return NULL;
 
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[maxPriority]);
+	Mutex_Lock(&victim->sched_spinlock);
+	TCB* tcb = sched_queue_pop(victim);
+	Mutex_Unlock(&victim->sched_spinlock);
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	if (tcb != NULL) {
+		tcb->last_core = cpu_core_id;
+		CURCORE.steals++;
+	}
+	return tcb;
+}
+
+#if defined(SCHED_STATISTICS)
+/* The CPU cycle counter, for the statistics */
+static inline unsigned long long sched_cycles()
+{
+#if defined(__x86__) || defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+#endif
+
+/*
+  Remove the head of the scheduler list, if any, and
+  return it. If the core has no ready threads, the current
+  thread is kept if still ready, else the core tries to 
+  steal work from other cores. As a last resort the idle 
+  thread is returned.
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	Mutex_Lock(&CURCORE.sched_spinlock);
+#if defined(SCHED_STATISTICS)
+	unsigned long long t0 = sched_cycles();
+	TCB* next_thread = sched_queue_pop(&CURCORE);
+	CURCORE.select_cycles += sched_cycles() - t0;
+	CURCORE.select_count++;
+#else
+	TCB* next_thread = sched_queue_pop(&CURCORE);
+#endif
+	Mutex_Unlock(&CURCORE.sched_spinlock);
+
+	if (next_thread == NULL && current->state == READY)
+		next_thread = current;
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = sched_steal();
+
+	if (next_thread == NULL)
+		next_thread = &CURCORE.idle_thread;
 
 	next_thread->its = QUANTUM;
 
 	return next_thread;
-
 }
 
 /*
@@ -373,14 +794,14 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
 		sched_make_ready(tcb);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -400,7 +821,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -413,8 +834,8 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	/* Release the thread spinlock before calling yield() !!! */
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -429,21 +850,26 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 void yield(enum SCHED_CAUSE cause)
 {
 
-	yield_calls++; //increase the counter of yield calls as needed
-
 	/* Reset the timer, so that we are not interrupted by ALARM */
 	TimerDuration remaining = bios_cancel_timer();
 
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+	/* Boost all threads periodically, so that no thread starves.
+	   This takes the sched_spinlock of every core, so it must run
+	   with preemption off. */
+	unsigned int calls = __atomic_add_fetch(&yield_calls, 1, __ATOMIC_RELAXED);
+	if (sched_boost_period > 0 && calls % sched_boost_period == 0)
+		sched_boost();
 
-	Mutex_Lock(&sched_spinlock);
+	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
 
 	/* Update CURTHREAD state */
+	Mutex_Lock(&current->state_spinlock);
 	if (current->state == RUNNING)
 		current->state = READY;
+	Mutex_Unlock(&current->state_spinlock);
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
@@ -453,6 +879,9 @@ void yield(enum SCHED_CAUSE cause)
 	/* Wake up threads whose sleep timeout has expired */
 	sched_wakeup_expired_timeouts();
 
+	/* Catch up with any boost that happened while we were running */
+	if (current->type != IDLE_THREAD)
+		sched_boost_check(current);
 
 	/*
 	We have consider that lowest priority queue is 0 and 
@@ -504,8 +933,6 @@ void yield(enum SCHED_CAUSE cause)
 	/* Save the current TCB for the gain phase */
 	CURCORE.previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
-
 	/* Switch contexts */
 	if (current != next) {
 		CURTHREAD = next;
@@ -532,35 +959,40 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
 	TCB* current = CURTHREAD;
 
 	/* Mark current state */
+	Mutex_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->last_core = cpu_core_id;
+	Mutex_Unlock(&current->state_spinlock);
 
 	/* Take care of the previous thread */
 	TCB* prev = CURCORE.previous_thread;
 	if (current != prev) {
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
 				sched_queue_add(prev);
 			break;
 		case EXITED:
-			release_TCB(prev);
 			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
-	}
+		Mutex_Unlock(&prev->state_spinlock);
 
-	Mutex_Unlock(&sched_spinlock);
+		/* Nobody else can touch an exited thread */
+		if (prev_state == EXITED)
+			release_TCB(prev);
+	}
 
 	/* Reset preemption as needed */
 	if (preempt)
@@ -591,15 +1023,85 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
-	/* Initialize the priority queue of MLFQ */
-	for(int i = 0; i < PRIORITY_QUEUES; i++){
-		rlnode_init(&SCHED[i], NULL);
+	/* Initialize the per-core priority queues of MLFQ */
+	for(int c = 0; c < MAX_CORES; c++){
+		cctx[c].sched_spinlock = MUTEX_INIT;
+		cctx[c].ready_mask = 0;
+		cctx[c].ready_count = 0;
+		cctx[c].steals = 0;
+#if defined(SCHED_STATISTICS)
+		cctx[c].select_count = 0;
+		cctx[c].select_cycles = 0;
+#endif
+		cctx[c].thread_cache_count = 0;
+		cctx[c].thread_cache_hits = 0;
+		cctx[c].thread_cache_misses = 0;
+		for(int i = 0; i < PRIORITY_QUEUES; i++){
+			rlnode_init(&cctx[c].ready_queue[i], NULL);
+			cctx[c].level_enqueued[i] = 0;
+		}
 	}
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	/* Initialize the timer wheel */
+	for(int l = 0; l < TIMER_LEVELS; l++)
+		for(int i = 0; i < TIMER_SLOTS; i++)
+			rlnode_init(&TIMER_WHEEL[l][i], NULL);
+	rlnode_init(&TIMER_EXPIRED, NULL);
+	timer_now = bios_clock() / TIMER_TICK;
+	timeout_count = 0;
+
+	/* Initialize the thread pool */
+	rlnode_init(&thread_depot, NULL);
+	thread_allocs = 0;
 
     /* here reset the counter number of yield calls */
 	yield_calls = 0;
+	boost_epoch = 0;
+	boost_count = 0;
+}
+
+void sched_print_stats(FILE* out)
+{
+	fprintf(out, "priority boosts: %lu (period %u yields)\n", boost_count, sched_boost_period);
+	fprintf(out, "level    enqueued\n");
+	for (int level = PRIORITY_QUEUES - 1; level >= 0; level--) {
+		unsigned long enqueued = 0;
+		for (uint c = 0; c < MAX_CORES; c++)
+			enqueued += cctx[c].level_enqueued[level];
+		if (enqueued > 0)
+			fprintf(out, "%5d  %10lu\n", level, enqueued);
+	}
+
+	unsigned long hits = 0, misses = 0;
+	for (uint c = 0; c < MAX_CORES; c++) {
+		hits += cctx[c].thread_cache_hits;
+		misses += cctx[c].thread_cache_misses;
+	}
+	fprintf(out, "thread cache: %lu hits, %lu misses, %lu blocks allocated\n",
+		hits, misses, thread_allocs);
+}
+
+void sched_select_hold(unsigned long* count, unsigned long long* cycles)
+{
+	*count = 0;
+	*cycles = 0;
+#if defined(SCHED_STATISTICS)
+	for (uint c = 0; c < MAX_CORES; c++) {
+		*count += cctx[c].select_count;
+		*cycles += cctx[c].select_cycles;
+	}
+#endif
+}
+
+void finalize_scheduler()
+{
+	/* Return the blocks of the thread pool to the allocator */
+	for (uint c = 0; c < MAX_CORES; c++) {
+		while (cctx[c].thread_cache_count > 0)
+			free_thread(cctx[c].thread_cache[--cctx[c].thread_cache_count], THREAD_SIZE);
+	}
+	while (!is_rlist_empty(&thread_depot))
+		free_thread(rlist_pop_front(&thread_depot), THREAD_SIZE);
 }
 
 void run_scheduler()
@@ -616,6 +1118,8 @@ void run_scheduler()
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
+	curcore->idle_thread.last_core = curcore->id;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.its = QUANTUM;
@@ -671,6 +1175,9 @@ void acquire_PTCB(TCB* tcb, Task task, int argl, void*args)
 {
 	PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB));
 
+	ptcb->tcb = tcb;
+	tcb->ptcb = ptcb;
+
 	ptcb->task = task;
 	ptcb->argl = argl;
 	ptcb->args = args;
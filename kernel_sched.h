@@ -24,6 +24,15 @@
 #include "tinyos.h"
 #include "util.h"
 
+/** 
+  @brief Define this to measure how long the scheduler holds the ready-queue
+  lock, at the cost of reading the cycle counter on every context switch.
+  @see sched_select_hold
+ */
+#if 0
+#define SCHED_STATISTICS
+#endif
+
 /*****************************
  *
  *  The Thread Control Block
@@ -145,6 +154,11 @@ typedef struct thread_control_block {
 
 	int priority; // Priority of the threads
 
+	Mutex state_spinlock; /**< @brief Protects @c state and @c phase against concurrent changes */
+	uint last_core; /**< @brief The core this thread last ran on; its ready queue is preferred */
+	uint boost_epoch; /**< @brief The last priority boost this thread has received */
+	size_t stack_size; /**< @brief The size of the stack of this thread */
+
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
@@ -169,15 +183,43 @@ typedef struct thread_control_block {
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The minimum thread stack size, for @c spawn_thread_stack(). */
+#define THREAD_MIN_STACK_SIZE (16 * 1024)
+
+/** @brief The maximum thread stack size, for @c spawn_thread_stack(). */
+#define THREAD_MAX_STACK_SIZE (8 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief The number of priority levels of the MLFQ scheduler.
+
+  Level 0 is the lowest priority and level @c PRIORITY_QUEUES-1 is the highest.
+  There can be at most 64 levels, so that the non-empty levels of a core fit
+  in the bits of @c CCB.ready_mask.
+ */
+#define PRIORITY_QUEUES 50
+
+/** @brief The number of free thread blocks cached by each core.
+
+  @see THREAD_CACHE_BATCH
+ */
+#define THREAD_CACHE_SIZE 16
+
+/** @brief The number of free thread blocks moved at once between a core's cache 
+  and the global depot. */
+#define THREAD_CACHE_BATCH (THREAD_CACHE_SIZE/2)
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
+
+  Each core owns a set of ready queues, one per priority level, protected by 
+  its own @c sched_spinlock. A core that runs out of ready threads steals
+  work from the ready queues of the busiest core, before halting.
  */
 typedef struct core_control_block {
 	uint id; /**< @brief The core id */
@@ -186,6 +228,23 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_spinlock; /**< @brief Protects the ready queues of this core */
+	rlnode ready_queue[PRIORITY_QUEUES]; /**< @brief The ready queues of this core, one per priority */
+	uint64_t ready_mask; /**< @brief Bit @c i is set iff @c ready_queue[i] is non-empty */
+	volatile uint ready_count; /**< @brief Number of threads in the ready queues of this core */
+
+	unsigned long steals; /**< @brief Number of threads this core has stolen from other cores */
+	unsigned long level_enqueued[PRIORITY_QUEUES]; /**< @brief Number of times a thread was added to the ready queue of each priority level */
+#if defined(SCHED_STATISTICS)
+	unsigned long select_count; /**< @brief Number of times @c sched_spinlock was taken to select the next thread */
+	unsigned long long select_cycles; /**< @brief Cycles @c sched_spinlock was held to select the next thread */
+#endif
+
+	void* thread_cache[THREAD_CACHE_SIZE]; /**< @brief Free thread blocks, kept for reuse by this core */
+	uint thread_cache_count; /**< @brief Number of blocks in @c thread_cache */
+	unsigned long thread_cache_hits; /**< @brief Number of threads spawned from @c thread_cache */
+	unsigned long thread_cache_misses; /**< @brief Number of threads spawned when @c thread_cache was empty */
+
 } CCB;
 
 
@@ -236,6 +295,18 @@ TCB* cur_thread();
 */
 TCB* spawn_thread(PCB* pcb, void (*func)());
 
+/**
+	@brief Create a new thread with a given stack size.
+
+	This is like @c spawn_thread(), except that the new thread gets a stack of
+	@c stack_size bytes, rounded up to whole pages, and clamped between 
+	@c THREAD_MIN_STACK_SIZE and @c THREAD_MAX_STACK_SIZE. A @c stack_size
+	of 0 selects the default @c THREAD_STACK_SIZE.
+
+    @see spawn_thread
+*/
+TCB* spawn_thread_stack(PCB* pcb, void (*func)(), size_t stack_size);
+
 /**
   @brief Wakeup a blocked thread.
 
@@ -305,6 +376,46 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+  This function is called after all cores have left the scheduler, to
+  release the memory kept by the scheduler for reuse.
+ */
+void finalize_scheduler(void);
+
+/**
+  @brief The period of the MLFQ priority boost, in calls to @c yield().
+
+  Every @c sched_boost_period calls to @c yield() (over all cores), all threads
+  are moved to the highest priority level, so that CPU-bound threads that have
+  sunk to the low levels are not starved by I/O-bound threads. The default is
+  @c YIELD_CALLS. A value of 0 disables the boost.
+ */
+extern unsigned int sched_boost_period;
+
+/**
+  @brief Print scheduler statistics.
+
+  This prints the number of priority boosts and, for each priority level, the
+  number of times a thread was added to the ready queue of that level, summed
+  over all cores. This counts enqueue events, not the time spent in the queue.
+  It also prints the hits and misses of the per-core thread caches.
+  It is meant to be called after @c boot() returns.
+ */
+void sched_print_stats(FILE* out);
+
+/**
+  @brief Return the hold time of the ready-queue lock when selecting a thread.
+
+  This stores in @c count the number of times the scheduler took
+  @c sched_spinlock to select the next thread, and in @c cycles the total
+  number of CPU cycles it held the lock, summed over all cores. Cycles are
+  only counted on x86 (they read 0 elsewhere), and both are 0 unless
+  @c SCHED_STATISTICS is defined.
+ */
+void sched_select_hold(unsigned long* count, unsigned long long* cycles);
+
 /**
   @brief Quantum (in microseconds) 
 
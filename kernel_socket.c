@@ -1,32 +1,559 @@
-
 #include "tinyos.h"
+#include "kernel_socket.h"
+#include "kernel_cc.h"
+#include "kernel_sched.h"
+
+
+unsigned int socket_backlog = SOCKET_BACKLOG;
+
+/* The listeners at each port */
+static port_entry PORT_MAP[MAX_PORT+1];
+
+
+void initialize_sockets()
+{
+	for(port_t port = 0; port <= MAX_PORT; port++) {
+		PORT_MAP[port].spinlock = MUTEX_INIT;
+		rlnode_init(& PORT_MAP[port].listeners, NULL);
+	}
+}
+
+
+static void socket_decref(socket_cb* scb)
+{
+	if(__atomic_sub_fetch(& scb->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+		free(scb);
+}
+
+
+static socket_cb* socket_create(FCB* fcb, port_t port, socket_kind kind)
+{
+	socket_cb* scb = xmalloc(sizeof(socket_cb));
+	scb->refcount = 1;
+	scb->fcb = fcb;
+	scb->type = SOCKET_UNBOUND;
+	scb->kind = kind;
+	scb->reuse_port = 0;
+	scb->port = port;
+	poll_queue_init(& scb->pollq);
+	return scb;
+}
+
+
+/*
+	The stream methods.
+
+	The type of a socket is read without the lock. A socket becomes a peer
+	only after its pipes are set, and it never stops being one.
+	A peer holds its pipes until it is closed, and ShutDown only closes
+	their ends, so the pipes cannot be freed under a concurrent call.
+ */
+
+static int socket_is_peer(socket_cb* scb)
+{
+	return __atomic_load_n(& scb->type, __ATOMIC_ACQUIRE) == SOCKET_PEER;
+}
+
+static int socket_read(void* this, char *buf, unsigned int size)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_read(scb->peer.read_pipe, buf, size);
+}
+
+static int socket_write(void* this, const char* buf, unsigned int size)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_write(scb->peer.write_pipe, buf, size);
+}
+
+static int socket_try_read(void* this, char *buf, unsigned int size)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_try_read(scb->peer.read_pipe, buf, size);
+}
+
+static int socket_try_write(void* this, const char* buf, unsigned int size)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_try_write(scb->peer.write_pipe, buf, size);
+}
+
+static int socket_readv(void* this, const iovec_t* iov, unsigned int n)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_readv(scb->peer.read_pipe, iov, n);
+}
+
+static int socket_writev(void* this, const iovec_t* iov, unsigned int n)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_writev(scb->peer.write_pipe, iov, n);
+}
+
+static int socket_splice_to(void* this, file_ops* out_ops, void* out, unsigned int size, int consume)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_splice_to(scb->peer.read_pipe, out_ops, out, size, consume);
+}
+
+static int socket_splice_from(void* this, file_ops* in_ops, void* in, unsigned int size)
+{
+	socket_cb* scb = this;
+	if(! socket_is_peer(scb)) return -1;
+
+	return pipe_splice_from(scb->peer.write_pipe, in_ops, in, size);
+}
+
+
+/* Shut down one direction of a peer. Returns 0 if already shut down. */
+static int shutdown_read(socket_cb* scb)
+{
+	return pipe_reader_shut(scb->peer.read_pipe);
+}
+
+static int shutdown_write(socket_cb* scb)
+{
+	return pipe_writer_shut(scb->peer.write_pipe);
+}
+
+
+static void listener_close(socket_cb* lsc)
+{
+	listener_socket* l = & lsc->listener;
+	port_entry* pe = & PORT_MAP[lsc->port];
+
+	Mutex_Lock(& pe->spinlock);
+	rlist_remove(& l->port_node);
+	Mutex_Unlock(& pe->spinlock);
+
+	Mutex_Lock(& l->spinlock);
+	l->closed = 1;
+
+	/* Wake up Accept and all Connect calls; the connectors will remove
+	   their requests from the queue. */
+	Cond_Broadcast(& l->req_available);
+	Cond_Broadcast(& l->has_room);
+	for(rlnode* n = l->queue.next; n != & l->queue; n = n->next) {
+		connection_request* req = n->obj;
+		Cond_Signal(& req->connected_cv);
+	}
+	Mutex_Unlock(& l->spinlock);
+}
+
+
+static int socket_close(void* this)
+{
+	socket_cb* scb = this;
+
+	switch(scb->type) {
+		case SOCKET_LISTENER:
+			listener_close(scb);
+			break;
+		case SOCKET_PEER:
+			shutdown_read(scb);
+			shutdown_write(scb);
+			pipe_release(scb->peer.read_pipe);
+			pipe_release(scb->peer.write_pipe);
+			break;
+		default:
+			break;
+	}
+
+	socket_decref(scb);
+	return 0;
+}
+
+
+static int socket_poll(void* this, poll_entry* pe)
+{
+	socket_cb* scb = this;
+	int mask = 0;
+
+	switch(__atomic_load_n(& scb->type, __ATOMIC_ACQUIRE)) {
+		case SOCKET_LISTENER: {
+			listener_socket* l = & scb->listener;
+			Mutex_Lock(& l->spinlock);
+			if(pe) poll_register(& scb->pollq, pe);
+			if(! is_rlist_empty(& l->queue) || l->closed)
+				mask = POLL_READ;
+			Mutex_Unlock(& l->spinlock);
+			break;
+		}
+		case SOCKET_PEER: {
+			mask |= pipe_reader_poll(scb->peer.read_pipe, pe);
+			mask |= pipe_writer_poll(scb->peer.write_pipe, pe);
+			break;
+		}
+		default:
+			/* Nothing to wait for, but the timeout */
+			if(pe) poll_register(& scb->pollq, pe);
+			break;
+	}
+	return mask;
+}
+
+
+static file_ops socket_fops = {
+	.Read = socket_read,
+	.Write = socket_write,
+	.Close = socket_close,
+	.SpliceTo = socket_splice_to,
+	.SpliceFrom = socket_splice_from,
+	.Poll = socket_poll,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.TryRead = socket_try_read,
+	.TryWrite = socket_try_write
+};
+
+/* Splicing the pipes of datagram sockets would lose the message headers */
+static file_ops datagram_socket_fops = {
+	.Read = socket_read,
+	.Write = socket_write,
+	.Close = socket_close,
+	.Poll = socket_poll,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.TryRead = socket_try_read,
+	.TryWrite = socket_try_write
+};
+
+
+/* Return the FCB of a socket with a reference held, or NULL */
+static FCB* get_socket_fcb(Fid_t fid)
+{
+	FCB* fcb = get_fcb_ref(fid);
+	if(fcb && fcb->streamfunc != &socket_fops && fcb->streamfunc != &datagram_socket_fops) {
+		FCB_decref(fcb);
+		return NULL;
+	}
+	return fcb;
+}
+
+
+/*
+	Sleep at a condition of a listener, until an absolute deadline 
+	(or NO_TIMEOUT). Returns 0 if the deadline has passed.
+	*** MUST BE CALLED WITH THE LISTENER spinlock HELD ***
+ */
+static int socket_wait(listener_socket* l, CondVar* cv, TimerDuration deadline)
+{
+	TimerDuration timeout = NO_TIMEOUT;
+	if(deadline != NO_TIMEOUT) {
+		TimerDuration now = bios_clock();
+		if(now >= deadline) return 0;
+		timeout = deadline - now;
+	}
+	kernel_cv_wait(& l->spinlock, cv, SCHED_PIPE, timeout);
+	return 1;
+}
+
+
+
+static file_ops* socket_ops(socket_kind kind)
+{
+	return (kind == SOCKET_DATAGRAM) ? &datagram_socket_fops : &socket_fops;
+}
 
 
 Fid_t sys_Socket(port_t port)
 {
-	return NOFILE;
+	return sys_SocketWithKind(port, SOCKET_STREAM);
+}
+
+
+Fid_t sys_SocketWithKind(port_t port, socket_kind kind)
+{
+	if(port < NOPORT || port > MAX_PORT)
+		return NOFILE;
+	if(kind != SOCKET_STREAM && kind != SOCKET_DATAGRAM)
+		return NOFILE;
+
+	Fid_t fid;
+	FCB* fcb;
+	if(! FCB_reserve(1, &fid, &fcb))
+		return NOFILE;
+
+	fcb->streamobj = socket_create(fcb, port, kind);
+	fcb->streamfunc = socket_ops(kind);
+	return fid;
+}
+
+
+int sys_ReusePort(Fid_t sock)
+{
+	FCB* fcb = get_socket_fcb(sock);
+	if(fcb == NULL) return -1;
+
+	socket_cb* scb = fcb->streamobj;
+	int rc = -1;
+	if(__atomic_load_n(& scb->type, __ATOMIC_ACQUIRE) == SOCKET_UNBOUND) {
+		scb->reuse_port = 1;
+		rc = 0;
+	}
+
+	FCB_decref(fcb);
+	return rc;
+}
+
+
+/* Move an unbound socket to SOCKET_BUSY. Returns 0 if it is not unbound. */
+static int socket_claim(socket_cb* scb)
+{
+	socket_type unbound = SOCKET_UNBOUND;
+	return __atomic_compare_exchange_n(& scb->type, &unbound, SOCKET_BUSY,
+			0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+
+/* Check if a socket may listen at a port with other listeners */
+static int may_share_port(socket_cb* scb, port_entry* pe)
+{
+	if(is_rlist_empty(& pe->listeners)) return 1;
+	socket_cb* other = pe->listeners.next->obj;
+	return scb->reuse_port && other->reuse_port && scb->kind == other->kind;
 }
 
+
 int sys_Listen(Fid_t sock)
 {
-	return -1;
+	FCB* fcb = get_socket_fcb(sock);
+	if(fcb == NULL) return -1;
+
+	socket_cb* scb = fcb->streamobj;
+	int rc = -1;
+	if(scb->port == NOPORT) goto finish;
+
+	if(! socket_claim(scb)) goto finish;
+
+	port_entry* pe = & PORT_MAP[scb->port];
+	Mutex_Lock(& pe->spinlock);
+	if(may_share_port(scb, pe)) {
+		listener_socket* l = & scb->listener;
+		l->spinlock = MUTEX_INIT;
+		rlnode_init(& l->port_node, scb);
+		rlnode_init(& l->queue, NULL);
+		l->req_available = COND_INIT;
+		l->has_room = COND_INIT;
+		l->backlog = socket_backlog > 0 ? socket_backlog : 1;
+		l->pending = 0;
+		l->closed = 0;
+		rlist_push_back(& pe->listeners, & l->port_node);
+		rc = 0;
+	}
+	Mutex_Unlock(& pe->spinlock);
+
+	__atomic_store_n(& scb->type, (rc == 0) ? SOCKET_LISTENER : SOCKET_UNBOUND, __ATOMIC_RELEASE);
+
+finish:
+	FCB_decref(fcb);
+	return rc;
 }
 
 
 Fid_t sys_Accept(Fid_t lsock)
 {
-	return NOFILE;
+	FCB* fcb = get_socket_fcb(lsock);
+	if(fcb == NULL) return NOFILE;
+
+	/* Hold the listener by its own reference, so that closing lsock
+	   while we sleep will close the listener and wake us up. */
+	socket_cb* lsc = fcb->streamobj;
+	int ok = (__atomic_load_n(& lsc->type, __ATOMIC_ACQUIRE) == SOCKET_LISTENER);
+	if(ok) __atomic_add_fetch(& lsc->refcount, 1, __ATOMIC_RELAXED);
+	FCB_decref(fcb);
+	if(! ok) return NOFILE;
+
+	/* Get the fid of the new peer before waiting */
+	Fid_t fid;
+	FCB* sfcb;
+	if(! FCB_reserve(1, &fid, &sfcb)) {
+		socket_decref(lsc);
+		return NOFILE;
+	}
+
+	listener_socket* l = & lsc->listener;
+
+	Mutex_Lock(& l->spinlock);
+	while(is_rlist_empty(& l->queue) && ! l->closed)
+		kernel_cv_wait(& l->spinlock, & l->req_available, SCHED_PIPE, NO_TIMEOUT);
+
+	if(l->closed) {
+		Mutex_Unlock(& l->spinlock);
+		FCB_unreserve(1, &fid, &sfcb);
+		socket_decref(lsc);
+		return NOFILE;
+	}
+
+	connection_request* req = rlist_pop_front(& l->queue)->obj;
+	__atomic_store_n(& l->pending, l->pending - 1, __ATOMIC_RELAXED);
+	Cond_Signal(& l->has_room);
+
+	/* Connect the two peers by a pair of pipes */
+	socket_cb* srv = socket_create(sfcb, lsc->port, lsc->kind);
+	socket_cb* cli = req->peer;
+	pipe_cb* to_cli = pipe_create(cli->fcb, sfcb);
+	pipe_cb* to_srv = pipe_create(sfcb, cli->fcb);
+	if(lsc->kind == SOCKET_DATAGRAM) {
+		pipe_set_message_mode(to_cli);
+		pipe_set_message_mode(to_srv);
+	}
+	to_cli->reader_pq = to_srv->writer_pq = & cli->pollq;
+	to_srv->reader_pq = to_cli->writer_pq = & srv->pollq;
+
+	srv->peer.read_pipe = to_srv;
+	srv->peer.write_pipe = to_cli;
+	srv->type = SOCKET_PEER;
+
+	cli->peer.read_pipe = to_cli;
+	cli->peer.write_pipe = to_srv;
+	__atomic_store_n(& cli->type, SOCKET_PEER, __ATOMIC_RELEASE);
+
+	req->admitted = 1;
+	Cond_Signal(& req->connected_cv);
+	Mutex_Unlock(& l->spinlock);
+
+	sfcb->streamobj = srv;
+	sfcb->streamfunc = socket_ops(srv->kind);
+
+	socket_decref(lsc);
+	return fid;
+}
+
+
+/*
+	Choose the listener of a port for a new connection, and return it
+	with a reference held, or NULL if the port has no listener. 
+	The listeners are taken round-robin, skipping those whose backlog is
+	full, unless all of them are full.
+ */
+static socket_cb* pick_listener(port_entry* pe)
+{
+	socket_cb* lsc = NULL;
+
+	Mutex_Lock(& pe->spinlock);
+	if(! is_rlist_empty(& pe->listeners)) {
+		rlnode* node = pe->listeners.next;
+		for(rlnode* n = node; n != & pe->listeners; n = n->next) {
+			socket_cb* cand = n->obj;
+			listener_socket* l = & cand->listener;
+			if(__atomic_load_n(& l->pending, __ATOMIC_RELAXED) < l->backlog) {
+				node = n; break;
+			}
+		}
+		/* Move it to the back, for the round-robin */
+		rlist_push_back(& pe->listeners, rlist_remove(node));
+		lsc = node->obj;
+		__atomic_add_fetch(& lsc->refcount, 1, __ATOMIC_RELAXED);
+	}
+	Mutex_Unlock(& pe->spinlock);
+	return lsc;
 }
 
 
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
-	return -1;
+	if(port <= NOPORT || port > MAX_PORT)
+		return -1;
+
+	FCB* fcb = get_socket_fcb(sock);
+	if(fcb == NULL) return -1;
+
+	socket_cb* scb = fcb->streamobj;
+	/* timeout_t is unsigned; a negative timeout means no timeout */
+	TimerDuration deadline = ((long) timeout < 0) ? NO_TIMEOUT
+		: bios_clock() + 1000ull * (TimerDuration) timeout;
+	int rc = -1;
+
+	/* Claim the socket, so that it cannot listen or connect elsewhere */
+	if(! socket_claim(scb)) {
+		FCB_decref(fcb);
+		return -1;
+	}
+
+	/* Find a listener, holding it in case it is closed while we sleep */
+	socket_cb* lsc = pick_listener(& PORT_MAP[port]);
+	if(lsc == NULL || lsc->kind != scb->kind)
+		goto finish;
+
+	listener_socket* l = & lsc->listener;
+	Mutex_Lock(& l->spinlock);
+
+	/* Wait for room in the backlog */
+	while(l->pending >= l->backlog && ! l->closed)
+		if(! socket_wait(l, & l->has_room, deadline))
+			goto unlock;
+	if(l->closed)
+		goto unlock;
+
+	connection_request req;
+	req.admitted = 0;
+	req.peer = scb;
+	req.connected_cv = COND_INIT;
+	rlnode_init(& req.queue_node, &req);
+
+	rlist_push_back(& l->queue, & req.queue_node);
+	__atomic_store_n(& l->pending, l->pending + 1, __ATOMIC_RELAXED);
+	Cond_Signal(& l->req_available);
+	poll_notify(& lsc->pollq);
+
+	/* Wait to be admitted */
+	while(! req.admitted && ! l->closed)
+		if(! socket_wait(l, & req.connected_cv, deadline))
+			break;
+
+	if(req.admitted) {
+		rc = 0;
+	} else {
+		/* The request is still in the queue */
+		rlist_remove(& req.queue_node);
+		__atomic_store_n(& l->pending, l->pending - 1, __ATOMIC_RELAXED);
+		Cond_Signal(& l->has_room);
+	}
+
+unlock:
+	Mutex_Unlock(& l->spinlock);
+finish:
+	if(rc != 0)
+		__atomic_store_n(& scb->type, SOCKET_UNBOUND, __ATOMIC_RELEASE);
+	if(lsc) socket_decref(lsc);
+	FCB_decref(fcb);
+	return rc;
 }
 
 
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
-	return -1;
+	if(how < SHUTDOWN_READ || how > SHUTDOWN_BOTH)
+		return -1;
+
+	FCB* fcb = get_socket_fcb(sock);
+	if(fcb == NULL) return -1;
+
+	socket_cb* scb = fcb->streamobj;
+	int rc = -1;
+
+	if(socket_is_peer(scb)) {
+		if(how & SHUTDOWN_READ) shutdown_read(scb);
+		if(how & SHUTDOWN_WRITE) shutdown_write(scb);
+		rc = 0;
+	}
+
+	FCB_decref(fcb);
+	return rc;
 }
 
@@ -0,0 +1,139 @@
+#ifndef __KERNEL_SOCKET_H
+#define __KERNEL_SOCKET_H
+
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_pipe.h"
+
+/**
+	@file kernel_socket.h
+	@brief Local sockets.
+
+	@defgroup socket Sockets
+	@ingroup kernel
+	@brief Local sockets.
+
+	A socket is created unbound. It may become a listener, by @c Listen,
+	or a peer, either by @c Connect or as the result of @c Accept.
+
+	Listeners are found by port in @c PORT_MAP, which has an entry for
+	each legal port. A port normally has at most one listener, but sockets
+	marked by @c ReusePort may listen at the same port; new connections
+	are then spread over them round-robin, skipping listeners whose
+	backlog is full.
+
+	A listener holds a queue of connection requests, whose length is
+	bounded by its backlog. @c Connect sleeps until there is room in the
+	queue and then until @c Accept admits the request, with a timeout for
+	both waits.
+
+	A connected pair of peers is joined by two pipes, one for each
+	direction. The read pipe of each peer is the write pipe of the other,
+	so the data path of a socket is the data path of a pipe. The pipes
+	of datagram sockets are in message mode. Both pipe ends of a peer
+	notify the poll queue of the peer, and a listener notifies its own
+	queue when a connection request arrives.
+
+	Each port entry has a lock for its list of listeners, and each listener
+	a lock for its queue and for the requests in it, so that listeners
+	sharing a port do not contend with each other on @c Accept.
+	The data path takes only the locks of the pipes.
+
+	@{
+*/
+
+/** @brief The default backlog of a listener. */
+#ifndef SOCKET_BACKLOG
+#define SOCKET_BACKLOG 16
+#endif
+
+
+/** @brief The state of a socket. */
+typedef enum {
+	SOCKET_UNBOUND,		/**< @brief Not yet listening or connected */
+	SOCKET_LISTENER,	/**< @brief Accepting connections at a port */
+	SOCKET_BUSY,		/**< @brief In a call to @c Listen or @c Connect */
+	SOCKET_PEER			/**< @brief Connected to another socket */
+} socket_type;
+
+
+/** @brief The listener part of a socket. */
+typedef struct listener_socket {
+	Mutex spinlock;				/**< @brief Lock for this listener and its requests */
+	rlnode port_node;			/**< @brief Node in the listeners of the port */
+	rlnode queue;				/**< @brief Queue of connection requests */
+	CondVar req_available;		/**< @brief Accept waits here for requests */
+	CondVar has_room;			/**< @brief Connect waits here for room in the queue */
+	unsigned int backlog;		/**< @brief The maximum length of the queue */
+	unsigned int pending;		/**< @brief The current length of the queue */
+	int closed;					/**< @brief Set when the listener is closed */
+} listener_socket;
+
+
+/** @brief The peer part of a socket. */
+typedef struct peer_socket {
+	pipe_cb* read_pipe;			/**< @brief Incoming data, held until the socket is closed */
+	pipe_cb* write_pipe;		/**< @brief Outgoing data, held until the socket is closed */
+} peer_socket;
+
+
+/**
+	@brief Socket control block.
+
+	This is the stream object of a socket. Besides the FCB, it is referenced
+	by @c Accept and @c Connect calls while they sleep, so that it survives
+	a concurrent @c Close.
+ */
+typedef struct socket_control_block {
+	unsigned int refcount;		/**< @brief Reference counter */
+	FCB* fcb;					/**< @brief The stream of this socket */
+	socket_type type;			/**< @brief The state of this socket */
+	socket_kind kind;			/**< @brief Stream or datagram */
+	int reuse_port;				/**< @brief Set by @c ReusePort */
+	poll_queue pollq;			/**< @brief The @c Poll queue of this socket */
+	port_t port;				/**< @brief The port of this socket, or @c NOPORT */
+
+	union {
+		listener_socket listener;
+		peer_socket peer;
+	};
+} socket_cb;
+
+
+/** @brief A connection request, queued at a listener by @c Connect. */
+typedef struct connection_request {
+	int admitted;				/**< @brief Set by @c Accept */
+	socket_cb* peer;			/**< @brief The connecting socket */
+	CondVar connected_cv;		/**< @brief @c Connect waits here */
+	rlnode queue_node;			/**< @brief Node in the listener queue */
+} connection_request;
+
+
+/** @brief An entry of the port table. */
+typedef struct port_entry {
+	Mutex spinlock;				/**< @brief Lock for the list of listeners */
+	rlnode listeners;			/**< @brief The listeners, in round-robin order */
+} port_entry;
+
+
+/**
+	@brief Initialization for sockets.
+
+	This function is called at kernel startup.
+ */
+void initialize_sockets();
+
+
+/**
+	@brief The backlog of new listeners.
+
+	A @c Connect finding this many requests queued at the listener sleeps
+	until one is accepted. Values less than 1 are taken as 1. The default
+	is @c SOCKET_BACKLOG.
+ */
+extern unsigned int socket_backlog;
+
+
+/** @} */
+
+#endif
@@ -1,3 +1,4 @@
+#include <limits.h>
 
 #include "util.h"
 #include "tinyos.h"
@@ -5,12 +6,16 @@
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_eventq.h"
 
 #define MAX_FILES MAX_PROC
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
 
+/* Lock for FCB_freelist */
+static Mutex FCB_freelist_spinlock = MUTEX_INIT;
+
 
 void initialize_files()
 {
@@ -19,39 +24,52 @@ void initialize_files()
 
     FT[i].refcount = 0;
     rlnode_init(& FT[i].freelist_node, &FT[i]);
+    rlnode_init(& FT[i].evq_registrations, NULL);
     rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
   }
 }
 
 
+/* 
+  The stream of a reserved FCB, until the stream object is set. Other 
+  threads of the process may access the fid in the meantime.
+ */
+static int reserved_close(void* this) { return 0; }
+static file_ops reserved_fops = { .Close = reserved_close };
+
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(& FCB_freelist_spinlock);
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = &reserved_fops;
   }
-  else
-    return NULL;
+  Mutex_Unlock(& FCB_freelist_spinlock);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
+  Mutex_Lock(& FCB_freelist_spinlock);
   rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(& FCB_freelist_spinlock);
 }
 
 
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(& fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(& fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    eventq_detach(fcb);
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -68,6 +86,8 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
     size_t f=0;
     uint i;
 
+    Mutex_Lock(& cur->fidt_spinlock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +95,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +106,19 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
     for(i=0;i<num;i++) {
 	cur->FIDT[fid[i]]=fcb[i];
 	FCB_incref(fcb[i]);
     }
+    Mutex_Unlock(& cur->fidt_spinlock);
     return 1;
+
+fail:
+    Mutex_Unlock(& cur->fidt_spinlock);
+    return 0;
 }
 
 
@@ -101,11 +126,13 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(& cur->fidt_spinlock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
 	cur->FIDT[fid[i]] = NULL;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(& cur->fidt_spinlock);
 }
 
 
@@ -124,37 +151,40 @@ FCB* get_fcb(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  return __atomic_load_n(& CURPROC->FIDT[fid], __ATOMIC_ACQUIRE);
+}
+
+
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->fidt_spinlock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(& cur->fidt_spinlock);
+  return fcb;
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = devread(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,51 +193,284 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
 
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = devwrite(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+/* Check the size of a vector. Return 0 if the total does not fit in an int. */
+static int iov_check(const iovec_t* iov, unsigned int n)
+{
+  if(n > 0 && iov == NULL) return 0;
+  size_t total = 0;
+  for(unsigned int i = 0; i < n; i++) {
+    total += iov[i].len;
+    if(total > INT_MAX) return 0;
+  }
+  return 1;
+}
+
 
+/*
+  Read a vector by calling Read for each buffer, stopping after
+  the first short read.
+ */
+static int readv_loop(FCB* fcb, const iovec_t* iov, unsigned int n)
+{
+  int done = 0;
+  for(unsigned int i = 0; i < n; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = fcb->streamfunc->Read(fcb->streamobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (done > 0) ? done : rc;
+    done += rc;
+    if((unsigned int) rc < iov[i].len) break;
   }
+  return done;
+}
 
 
+/*
+  Write a vector by calling Write for each buffer, stopping after
+  the first short write.
+ */
+static int writev_loop(FCB* fcb, const iovec_t* iov, unsigned int n)
+{
+  int done = 0;
+  for(unsigned int i = 0; i < n; i++) {
+    if(iov[i].len == 0) continue;
+    int rc = fcb->streamfunc->Write(fcb->streamobj, iov[i].base, iov[i].len);
+    if(rc < 0) return (done > 0) ? done : rc;
+    done += rc;
+    if((unsigned int) rc < iov[i].len) break;
+  }
+  return done;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int retcode = -1;
+  if(! iov_check(iov, iovcnt)) return -1;
+
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    file_ops* ops = fcb->streamfunc;
+    if(ops->ReadV)
+      retcode = ops->ReadV(fcb->streamobj, iov, iovcnt);
+    else if(ops->Read)
+      retcode = readv_loop(fcb, iov, iovcnt);
+
+    FCB_decref(fcb);
+  }
+
   return retcode;
 }
 
 
-int sys_Close(int fd)
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  int retcode = -1;
+  if(! iov_check(iov, iovcnt)) return -1;
 
-  FCB* fcb = get_fcb(fd);
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+    file_ops* ops = fcb->streamfunc;
+    if(ops->WriteV)
+      retcode = ops->WriteV(fcb->streamobj, iov, iovcnt);
+    else if(ops->Write)
+      retcode = writev_loop(fcb, iov, iovcnt);
+
+    FCB_decref(fcb);
   }
 
   return retcode;
 }
 
 
+/* The size of the kernel buffer used to splice streams without hooks */
+#define SPLICE_COPY_SIZE 1024
+
+/*
+  Splice by copying through a kernel buffer. All the data read is
+  written, unless Write fails.
+ */
+static int splice_copy(FCB* in, FCB* out, unsigned int size)
+{
+  char buffer[SPLICE_COPY_SIZE];
+  if(size > SPLICE_COPY_SIZE) size = SPLICE_COPY_SIZE;
+
+  int count = in->streamfunc->Read(in->streamobj, buffer, size);
+  if(count <= 0) return count;
+
+  int done = 0;
+  while(done < count) {
+    int rc = out->streamfunc->Write(out->streamobj, buffer+done, count-done);
+    if(rc <= 0) break;
+    done += rc;
+  }
+  return (done > 0) ? done : -1;
+}
+
+
+/*
+  Helper for Splice and Tee. Get the two streams, checking that
+  they can be read and written, and that they are not the same object.
+ */
+static int splice_streams(Fid_t fin, Fid_t fout, unsigned int size, int consume)
+{
+  int retcode = -1;
+
+  FCB* in = get_fcb_ref(fin);
+  FCB* out = get_fcb_ref(fout);
+  if(in == NULL || out == NULL) goto finish;
+
+  file_ops* iops = in->streamfunc;
+  file_ops* oops = out->streamfunc;
+
+  if(oops->Write == NULL || (iops->Read == NULL && iops->SpliceTo == NULL))
+    goto finish;
+
+  /* Splicing a pipe into itself could block for ever */
+  if(in->streamobj != NULL && in->streamobj == out->streamobj)
+    goto finish;
+
+  if(iops->SpliceTo)
+    retcode = iops->SpliceTo(in->streamobj, oops, out->streamobj, size, consume);
+  else if(! consume) 
+    retcode = -1;  /* Data that is not buffered cannot be left in place */
+  else if(oops->SpliceFrom)
+    retcode = oops->SpliceFrom(out->streamobj, iops, in->streamobj, size);
+  else
+    retcode = splice_copy(in, out, size);
+
+finish:
+  if(in) FCB_decref(in);
+  if(out) FCB_decref(out);
+  return retcode;
+}
+
+
+int sys_Splice(Fid_t fin, Fid_t fout, unsigned int size)
+{
+  return splice_streams(fin, fout, size, 1);
+}
+
+
+int sys_Tee(Fid_t fin, Fid_t fout, unsigned int size)
+{
+  return splice_streams(fin, fout, size, 0);
+}
+
+
+int FCB_poll(FCB* fcb, poll_entry* pe)
+{
+  file_ops* ops = fcb->streamfunc;
+  if(ops->Poll)
+    return ops->Poll(fcb->streamobj, pe);
+  return (ops->Read ? POLL_READ : 0) | (ops->Write ? POLL_WRITE : 0);
+}
+
+
+int sys_Poll(pollfd* fds, unsigned int n, timeout_t timeout)
+{
+  if(n > MAX_FILEID) return -1;
+
+  FCB* fcb[MAX_FILEID];
+  poll_entry pe[MAX_FILEID];
+  poller pl = { .lock = MUTEX_INIT, .wakeup = COND_INIT, .triggered = 0 };
+
+  for(unsigned int i = 0; i < n; i++) {
+    fds[i].revents = 0;
+    fcb[i] = (fds[i].fd < 0) ? NULL : get_fcb_ref(fds[i].fd);
+    pe[i].owner = &pl;
+    pe[i].queue = NULL;
+    pe[i].notify = NULL;
+    rlnode_init(& pe[i].node, & pe[i]);
+  }
+
+  /* timeout_t is unsigned; a negative timeout means no timeout */
+  TimerDuration deadline = ((long) timeout < 0) ? NO_TIMEOUT
+    : bios_clock() + 1000ull * (TimerDuration) timeout;
+  int ready;
+
+  while(1) {
+    /* A notification after this point will be seen below */
+    __atomic_store_n(& pl.triggered, 0, __ATOMIC_SEQ_CST);
+
+    /* Register while checking, unless this is a plain check */
+    int wait = (timeout != 0);
+    ready = 0;
+    for(unsigned int i = 0; i < n; i++) {
+      if(fds[i].fd < 0) continue;
+      if(fcb[i] == NULL)
+        fds[i].revents = POLL_INVALID;
+      else
+        fds[i].revents = FCB_poll(fcb[i], wait ? &pe[i] : NULL) 
+          & (fds[i].events | POLL_HANGUP | POLL_ERROR);
+      if(fds[i].revents) ready++;
+    }
+    if(ready > 0 || ! wait) break;
+
+    /* Sleep until notified, or until the deadline */
+    int expired = 0;
+    Mutex_Lock(& pl.lock);
+    while(! pl.triggered) {
+      TimerDuration t = NO_TIMEOUT;
+      if(deadline != NO_TIMEOUT) {
+        TimerDuration now = bios_clock();
+        if(now >= deadline) { expired = 1; break; }
+        t = deadline - now;
+      }
+      kernel_cv_wait(& pl.lock, & pl.wakeup, SCHED_IO, t);
+    }
+    Mutex_Unlock(& pl.lock);
+    if(expired) break;
+  }
+
+  for(unsigned int i = 0; i < n; i++) {
+    poll_unregister(& pe[i]);
+    if(fcb[i]) FCB_decref(fcb[i]);
+  }
+  return ready;
+}
+
+
+int sys_Close(int fd)
+{
+  if(fd<0 || fd>=MAX_FILEID) return -1;
+
+  int retcode = 0;  /* Closing a closed fd is legal! */
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(& cur->fidt_spinlock);
+  FCB* fcb = cur->FIDT[fd];
+  cur->FIDT[fd] = NULL;
+  Mutex_Unlock(& cur->fidt_spinlock);
+
+  /* The stream is closed outside the lock, as Close() may block */
+  if(fcb)
+    retcode = FCB_decref(fcb);
+
+  return retcode;
+}
+
+
 /*
   Copy file descriptor oldfd into file descriptor newfd.
 
@@ -221,18 +484,25 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  FCB* new = NULL;
+
+  Mutex_Lock(& cur->fidt_spinlock);
+  FCB* old = cur->FIDT[oldfd];
 
   if(old==NULL) {
     retcode = -1;
   }
-  else if(old!=new) {
-    if(new)
-      FCB_decref(new);
+  else if(old!=cur->FIDT[newfd]) {
+    new = cur->FIDT[newfd];
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    cur->FIDT[newfd] = old;
   }
+  Mutex_Unlock(& cur->fidt_spinlock);
+
+  /* Close the replaced stream outside the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -44,6 +44,7 @@ typedef struct file_control_block
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
   rlnode freelist_node;		/**< @brief Intrusive list node */
+  rlnode evq_registrations;	/**< @brief The event queue registrations of the stream */
 } FCB;
 
 
@@ -67,8 +68,9 @@ void FCB_incref(FCB* fcb);
 /**
 	@brief Decrease the reference count of the fcb.
 
-	If the reference count drops to 0, release the FCB, calling the 
-	Close method and returning its return value.
+	If the reference count drops to 0, remove the stream from any event
+	queues, then release the FCB, calling the Close method and returning
+	its return value.
 	If the reference count is still >0, return 0. 
 
 	@param fcb  the fcb whose reference count is decreased
@@ -78,6 +80,19 @@ void FCB_incref(FCB* fcb);
 int FCB_decref(FCB* fcb);
 
 
+/**
+  @brief Return the readiness of a stream.
+
+  This calls the @c Poll method of the stream, if it has one. Otherwise,
+  the stream is ready for the methods it has.
+
+  @param fcb the stream
+  @param pe a poll entry to register at the stream, or NULL
+  @returns a mask of @c POLL_READ, @c POLL_WRITE, @c POLL_HANGUP and @c POLL_ERROR
+ */
+int FCB_poll(FCB* fcb, poll_entry* pe);
+
+
 /** @brief Acquire a number of FCBs and corresponding fids.
 
    Given an array of fids and an array of pointers to FCBs  of
@@ -122,12 +137,26 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 	This routine will return NULL if the fid is not legal.
 
+	The returned FCB may be closed at any time by another thread of 
+	the process. Use @ref get_fcb_ref to access the stream safely.
+
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
  */
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, holding a reference.
+
+	This routine will return NULL if the fid is not legal. Otherwise,
+	the FCB cannot be closed until the caller calls @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
@@ -41,6 +41,13 @@ void NAME SIG \
 	POST_CALL\
 }\
 
+/* without the kernel lock */
+#define SYSCALL_UNLOCKED(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	return sys_##NAME ARGS;\
+}\
+
 
 SYSCALLS
 
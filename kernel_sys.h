@@ -4,30 +4,53 @@
 #include "bios.h"
 #include "tinyos.h"
 
+/*
+	The system call table. 
+
+	Calls declared with SYSCALL (SYSCALLV for void) are executed holding
+	the kernel lock. Calls declared with SYSCALL_UNLOCKED do not take the
+	kernel lock; they either touch only per-thread state, or they lock
+	the objects they use (the FIDT of the current process, the FCB table
+	and the stream objects).
+ */
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
-SYSCALL(GetPid, int, (void), ())\
-SYSCALL(GetPPid, int, (void), ())\
+SYSCALL_UNLOCKED(GetPid, int, (void), ())\
+SYSCALL_UNLOCKED(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
-SYSCALL(ThreadSelf, Tid_t, (void), ())\
+SYSCALL(CreateThreadWithStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
+SYSCALL_UNLOCKED(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
-SYSCALL(GetTerminalDevices, unsigned int, (), ())\
-SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
-SYSCALL(OpenNull, Fid_t, (), ())\
-SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
-SYSCALL(Close,int,(Fid_t fd),(fd))\
-SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
-SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
-SYSCALL(Socket, Fid_t, (port_t port), (port))\
-SYSCALL(Listen, int, (Fid_t sock), (sock))\
-SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
-SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
-SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
+SYSCALL_UNLOCKED(GetTerminalDevices, unsigned int, (), ())\
+SYSCALL_UNLOCKED(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
+SYSCALL_UNLOCKED(TerminalMode, int, (Fid_t fd, terminal_mode mode), (fd, mode))\
+SYSCALL_UNLOCKED(OpenNull, Fid_t, (), ())\
+SYSCALL_UNLOCKED(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_UNLOCKED(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL_UNLOCKED(ReadV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL_UNLOCKED(WriteV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL_UNLOCKED(Close,int,(Fid_t fd),(fd))\
+SYSCALL_UNLOCKED(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL_UNLOCKED(Splice,int, (Fid_t fin, Fid_t fout, unsigned int size), (fin,fout,size))\
+SYSCALL_UNLOCKED(Tee,int, (Fid_t fin, Fid_t fout, unsigned int size), (fin,fout,size))\
+SYSCALL_UNLOCKED(Poll,int, (pollfd* fds, unsigned int n, timeout_t timeout), (fds,n,timeout))\
+SYSCALL_UNLOCKED(EventQueue, Fid_t, (), ())\
+SYSCALL_UNLOCKED(EventCtl, int, (Fid_t eq, event_op op, Fid_t fd, short events, intptr_t data), (eq, op, fd, events, data))\
+SYSCALL_UNLOCKED(EventWait, int, (Fid_t eq, event_record* out, unsigned int max, timeout_t timeout), (eq, out, max, timeout))\
+SYSCALL_UNLOCKED(IoRingSetup, Fid_t, (unsigned int entries, io_ring** ring), (entries, ring))\
+SYSCALL_UNLOCKED(IoRingEnter, int, (Fid_t ring, unsigned int min_complete, timeout_t timeout), (ring, min_complete, timeout))\
+SYSCALL_UNLOCKED(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL_UNLOCKED(Socket, Fid_t, (port_t port), (port))\
+SYSCALL_UNLOCKED(SocketWithKind, Fid_t, (port_t port, socket_kind kind), (port, kind))\
+SYSCALL_UNLOCKED(ReusePort, int, (Fid_t sock), (sock))\
+SYSCALL_UNLOCKED(Listen, int, (Fid_t sock), (sock))\
+SYSCALL_UNLOCKED(Accept, Fid_t, (Fid_t lsock), (lsock))\
+SYSCALL_UNLOCKED(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
+SYSCALL_UNLOCKED(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
 
 
@@ -39,9 +62,12 @@ RET sys_ ## NAME SIG;
 #define SYSCALLV(NAME, SIG, ARGS)\
 void sys_ ## NAME SIG;
 
+#define SYSCALL_UNLOCKED SYSCALL
+
 SYSCALLS
 
 #undef SYSCALL
 #undef SYSCALLV
+#undef SYSCALL_UNLOCKED
 
 #endif
\ No newline at end of file
@@ -3,14 +3,23 @@
 #include "kernel_sched.h"
 #include "kernel_proc.h"
 #include "kernel_cc.h"
+#include "kernel_streams.h"
 
 /** 
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadWithStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size)
 {
   PCB* PCBcurrent = CURPROC;
-  TCB* tcb = spawn_thread(PCBcurrent, start_main_thread_ptcb);
+  TCB* tcb = spawn_thread_stack(PCBcurrent, start_main_thread_ptcb, stack_size);
   //aquire a PTCB
   acquire_PTCB(tcb,task,argl,args);
 
@@ -61,14 +70,19 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     kernel_wait(&(ptcb->exit_cv),SCHED_USER);
   }
   // Waited for the PTCB to finish and now we decrease the amount of TCB
-  ptcb->refcount = ptcb->refcount + 1;
+  ptcb->refcount = ptcb->refcount - 1;
+
+  // A thread detached while we were waiting cannot be joined
+  if(ptcb->detached == 1){
+    return -1;
+  }
 
   // Check if the exitval is null then save the exit from PTCB to exitval
   if(exitval != NULL){
     *exitval = ptcb->exitval;
   }
 
-  // Check if refcount = 1 then free the PTCB and clear the memory
+  // The last joiner frees the PTCB and clears the memory
   if(ptcb->refcount == 1){
     rlist_remove(&(ptcb->ptcb_list_node));
     free(ptcb);
@@ -96,7 +110,6 @@ int sys_ThreadDetach(Tid_t tid)
 
   ptcb -> detached = 1;  //DO the flug = 1 (true) of the detached
   kernel_broadcast(&ptcb -> exit_cv); //use kernel_broadcast to broadcast all threads that waiting in threaJoin
-  ptcb -> refcount = 1; //reset the refcount (=1)
 
   return 0;
 }
@@ -143,7 +156,7 @@ void sys_ThreadExit(int exitval)
     assert(is_rlist_empty(&process->exited_list));
 
     // Clean the PTCB 
-    while(is_rlist_empty(&process->list_ptcb) != 0){
+    while(!is_rlist_empty(&process->list_ptcb)){
       rlnode* ptcb_list_node;
       ptcb_list_node = rlist_pop_front(&process->list_ptcb);
       free(ptcb_list_node->ptcb);
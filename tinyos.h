@@ -319,6 +319,24 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is like `CreateThread`, except that `stack_size` is a hint 
+  for the size of the stack of the new thread, in bytes. Threads with
+  small stacks cost less memory, so that many more of them can exist
+  at the same time. The size is rounded up to whole pages and kept 
+  between 16 kbytes and 8 Mbytes. A `stack_size` of 0 selects the default
+  stack size (128 kbytes).
+
+  A thread that overflows its stack is killed by a segmentation fault.
+
+  @param task a function to execute
+  @param stack_size the size of the stack of the new thread
+  @see CreateThread
+  */
+Tid_t CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -400,6 +418,36 @@ unsigned int GetTerminalDevices();
 Fid_t OpenTerminal(unsigned int termno);
 
 
+/** @brief The line discipline of a terminal.
+  @see TerminalMode
+ */
+typedef enum {
+  TERMINAL_RAW,       /**< @brief A read returns the input available (the default) */
+  TERMINAL_CANONICAL  /**< @brief A read returns input up to the end of a line */
+} terminal_mode;
+
+
+/** @brief Set the line discipline of a terminal.
+
+  In @c TERMINAL_RAW mode, a @c Read from the terminal returns as soon as
+  some input is available. In @c TERMINAL_CANONICAL mode, a @c Read blocks
+  until a complete line is available (or the input buffer of the terminal
+  is full), and returns at most up to the end of the line, including the
+  newline. Therefore, a @c Read with a large enough buffer returns one line.
+
+  The mode belongs to the terminal device, not to the stream: it applies to
+  every stream on the same terminal. Terminals start in @c TERMINAL_RAW mode.
+
+  @param fd the file ID of a stream on a terminal
+  @param mode the new mode
+  @return the previous mode on success, so that the caller can restore it,
+   or -1 on error. Possible errors are:
+   - The file ID is not legal, or it is not a terminal.
+   - The mode is not legal.
+ */
+int TerminalMode(Fid_t fd, terminal_mode mode);
+
+
 /** @brief Open a stream on the null device.
 
   The null device is a virtual device representing an "infinite"
@@ -458,6 +506,59 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief A buffer of a vectored @c ReadV or @c WriteV call. */
+typedef struct io_vector {
+  void* base;         /**< @brief The start of the buffer */
+  unsigned int len;   /**< @brief The size of the buffer in bytes */
+} iovec_t;
+
+
+/** @brief Read bytes from a stream into several buffers.
+
+  This is like @c Read, but the data is placed into the @c iovcnt buffers
+  of array @c iov, in order, filling each buffer before the next. 
+  Pipes and sockets do this in a single transfer, so that a call returns
+  as much data as a @c Read of the total size would. For other streams,
+  the buffers are read one at a time, stopping after the first short read.
+
+  On a datagram socket, a call reads (part of) a single message.
+
+  @param fd  the file ID of the stream to read from
+  @param iov an array of @c iovcnt buffers
+  @param iovcnt the number of buffers
+  @return the number of bytes copied, 0 if we have reached EOF, or -1, indicating some error.
+        Possible errors are:
+         - The file descriptor is invalid.
+         - The total size of the buffers is larger than @c INT_MAX.
+         - There was a I/O runtime problem.
+  @see Read
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/** @brief Write bytes to a stream from several buffers.
+
+  This is like @c Write, but the data is taken from the @c iovcnt buffers
+  of array @c iov, in order. Pipes and sockets do this in a single transfer.
+  For other streams, the buffers are written one at a time, stopping after
+  the first short write.
+
+  On a datagram socket, the buffers are sent as a single message. This 
+  allows a header and a payload to be sent without copying them together.
+
+  @param fd  the file ID of the stream to write to
+  @param iov an array of @c iovcnt buffers
+  @param iovcnt the number of buffers
+  @return the number of bytes copied, or -1 on error. 
+   Possible errors are:
+   - The file id is invalid.
+   - The total size of the buffers is larger than @c INT_MAX.
+   - There was a I/O runtime problem.
+  @see Write
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
 /** @brief Close a file id.
    
 
@@ -489,6 +590,188 @@ int Close(Fid_t fd);
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Move bytes from one stream to another.
+
+  Move up to @c size bytes from stream @c fin to stream @c fout, without
+  passing them through a user buffer. If no data is available at @c fin,
+  the call blocks, like @c Read.
+
+  When @c fin is the read end of a pipe, the data is written to @c fout
+  directly from the pipe buffer. When @c fout is the write end of a pipe,
+  the data is read from @c fin directly into the pipe buffer. Between other
+  streams, the data is copied through a small kernel buffer.
+
+  @param fin the file id to read from
+  @param fout the file id to write to
+  @param size the maximum number of bytes to move
+  @return the number of bytes moved, 0 if @c fin has reached EOF, or -1 on error.
+  Possible reasons for failure:
+  - Either fid is invalid, @c fin cannot be read or @c fout cannot be written.
+  - @c fin and @c fout are the two ends of the same pipe.
+  - There was a I/O runtime problem.
+  @see Tee
+ */
+int Splice(Fid_t fin, Fid_t fout, unsigned int size);
+
+
+/** @brief Copy bytes from one stream to another, without consuming them.
+
+  This is like @c Splice, but the bytes are not removed from @c fin. 
+  Therefore, @c fin must be the read end of a pipe; a subsequent @c Read or 
+  @c Splice on @c fin will return the same bytes.
+
+  @param fin the file id to copy from (the read end of a pipe)
+  @param fout the file id to write to
+  @param size the maximum number of bytes to copy
+  @return the number of bytes copied, 0 if @c fin has reached EOF, or -1 on error.
+  Possible reasons for failure:
+  - Either fid is invalid, or @c fout cannot be written.
+  - @c fin is not the read end of a pipe.
+  - @c fin and @c fout are the two ends of the same pipe.
+  @see Splice
+ */
+int Tee(Fid_t fin, Fid_t fout, unsigned int size);
+
+
+/** @brief Poll events.
+
+  These are the bits of @c pollfd::events and @c pollfd::revents.
+  @see Poll
+ */
+enum poll_events {
+  POLL_READ = 1,      /**< @brief @c Read (or @c Accept) will not block */
+  POLL_WRITE = 2,     /**< @brief @c Write will not block */
+  POLL_HANGUP = 4,    /**< @brief The other end is closed (always reported) */
+  POLL_ERROR = 8,     /**< @brief @c Write will fail (always reported) */
+  POLL_INVALID = 16   /**< @brief The file id is not open (always reported) */
+};
+
+
+/** @brief A stream to wait for, in a call to @c Poll.
+  @see Poll
+ */
+typedef struct poll_fd {
+  Fid_t fd;           /**< @brief The file id, or a negative value to skip this entry */
+  short events;       /**< @brief The events to wait for */
+  short revents;      /**< @brief The events found, set by @c Poll */
+} pollfd;
+
+
+/** @brief Wait until one of several streams is ready.
+
+  For each of the @c n entries of array @c fds, this call checks
+  whether the stream @c fd is ready for one of the @c events 
+  (@c POLL_READ, @c POLL_WRITE), and stores the events found in @c revents.
+  The events @c POLL_HANGUP, @c POLL_ERROR and @c POLL_INVALID are stored
+  in @c revents whether they are requested or not. Entries with a negative
+  @c fd are skipped.
+
+  If no entry has any event, the call sleeps until one does, or until
+  @c timeout msec have passed. A timeout of 0 returns at once, and a 
+  negative timeout means no timeout.
+
+  Pipes, sockets, serial terminals and the null device report their
+  readiness. Other streams are always reported ready.
+
+  @param fds an array of @c n entries
+  @param n the number of entries, at most @c MAX_FILEID
+  @param timeout the time to wait in msec
+  @return the number of entries with a non-zero @c revents (0 on timeout),
+    or -1 on error. Possible reasons for failure:
+    - @c n is larger than @c MAX_FILEID.
+ */
+int Poll(pollfd* fds, unsigned int n, timeout_t timeout);
+
+
+/** @brief The operations of @c EventCtl. */
+typedef enum {
+  EVQ_ADD,            /**< @brief Add a stream to the event queue */
+  EVQ_MODIFY,         /**< @brief Change the events and data of a stream */
+  EVQ_REMOVE          /**< @brief Remove a stream from the event queue */
+} event_op;
+
+
+/** @brief An event reported by @c EventWait.
+  @see EventWait
+ */
+typedef struct event_record {
+  intptr_t data;      /**< @brief The data given to @c EventCtl for the stream */
+  short events;       /**< @brief The events found */
+} event_record;
+
+
+/** @brief Create an event queue.
+
+  An event queue holds a set of streams and the events to wait for
+  on each of them. Unlike @c Poll, the streams are given once, by
+  @c EventCtl, and the cost of @c EventWait depends only on the number
+  of streams which became ready, not on the number of streams registered.
+
+  The new event queue is a stream, which is released by @c Close.
+
+  @returns a file id for the new event queue, or @c NOFILE on error.
+  Possible reasons for failure:
+  - The maximum number of file ids for the process has been reached.
+  @see EventCtl
+  @see EventWait
+ */
+Fid_t EventQueue();
+
+
+/** @brief Change the streams of an event queue.
+
+  Operation @c EVQ_ADD adds the stream @c fd to event queue @c eq,
+  to wait for @c events (@c POLL_READ, @c POLL_WRITE). The value of
+  @c data is reported with the events of the stream.
+  Operation @c EVQ_MODIFY changes the events and data of a stream which
+  was added before, and @c EVQ_REMOVE removes it (@c events and @c data
+  are ignored).
+
+  The event queue does not keep the stream open. When the last file id
+  of the stream is closed (file ids made by @c Dup2 keep it open), the
+  stream is removed from the event queue, and it is not reported again.
+  Closing the event queue removes its streams, but does not close them.
+
+  @param eq the event queue
+  @param op the operation
+  @param fd the stream
+  @param events the events to wait for
+  @param data the value to report with the events
+  @returns 0 on success and -1 on error. Possible reasons for failure:
+  - @c eq is not an event queue, or @c fd is not a valid file id.
+  - @c op is @c EVQ_ADD and the stream is already added, or it is an event queue.
+  - @c op is @c EVQ_MODIFY or @c EVQ_REMOVE and the stream is not added.
+ */
+int EventCtl(Fid_t eq, event_op op, Fid_t fd, short events, intptr_t data);
+
+
+/** @brief Wait for events on the streams of an event queue.
+
+  This call stores up to @c max events in array @c events and returns
+  their number. As with @c Poll, @c POLL_HANGUP and @c POLL_ERROR are
+  reported whether they are requested or not.
+
+  Events are edge-triggered: a stream is reported when it becomes
+  ready, or when it is added (or modified) while ready. It is not reported
+  again until it is notified again (e.g., by new data, or space after
+  a read), even if it remains ready.
+
+  If no stream has any event, the call sleeps until one does, or until
+  @c timeout msec have passed. A timeout of 0 returns at once, and a 
+  negative timeout means no timeout.
+
+  @param eq the event queue
+  @param events an array of @c max events
+  @param max the size of the array
+  @param timeout the time to wait in msec
+  @returns the number of events stored (0 on timeout), or -1 on error.
+  Possible reasons for failure:
+  - @c eq is not an event queue.
+  - @c events is NULL, or @c max is 0.
+ */
+int EventWait(Fid_t eq, event_record* events, unsigned int max, timeout_t timeout);
+
 /*******************************************
  *
  * Pipes
@@ -571,6 +854,65 @@ typedef int16_t port_t;
 */
 Fid_t Socket(port_t port);
 
+
+/**
+	@brief Socket kinds.
+
+	@see SocketWithKind
+*/
+typedef enum {
+	SOCKET_STREAM,		/**< @brief A byte stream, as returned by @c Socket */
+	SOCKET_DATAGRAM		/**< @brief A stream of messages with preserved boundaries */
+} socket_kind;
+
+
+/**
+	@brief Return a new socket of the given kind, bound on a port.
+
+	This is like @c Socket, but the new socket may be a datagram socket.
+	A datagram socket can only be connected to a listener which is also
+	a datagram socket, and the sockets returned by @c Accept for a datagram
+	listener are datagram sockets.
+
+	On a connected datagram socket, each @c Write sends one message, which is
+	written whole, or not at all. A @c Read returns bytes from one message
+	only: the whole message, if the buffer is large enough, or else its first
+	bytes, with the rest returned by the next calls to @c Read.
+	A @c Write of an empty message does nothing, and a @c Write of a message
+	that is longer than the socket buffer fails.
+
+	@param port the port the new socket will be bound to
+	@param kind the kind of the new socket
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is illegal
+		- the kind is illegal
+		- the available file ids for the process are exhausted
+	@see Socket
+*/
+Fid_t SocketWithKind(port_t port, socket_kind kind);
+
+/**
+	@brief Allow a socket to listen at a port shared with other listeners.
+
+	Normally, @c Listen fails if the port already has a listener. If this
+	call is made on an unbound socket before @c Listen, the socket may
+	listen at the same port as other listening sockets of the same kind,
+	for which this call was also made. New connections to the port are
+	spread over its listeners round-robin, skipping those whose queue of
+	pending connections is full.
+
+	This allows, e.g., a thread per core to accept connections on the
+	same port, each on its own listening socket.
+
+	@param sock the socket to mark
+	@returns 0 on success and -1 on error. Possible reasons for error:
+		- the file id is not legal
+		- the socket is not an unbound socket
+	@see Listen
+*/
+int ReusePort(Fid_t sock);
+
 /**
 	@brief Initialize a socket as a listening socket.
 
@@ -581,13 +923,15 @@ Fid_t Socket(port_t port);
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless all the listeners of the
+	port were marked by @c ReusePort.
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
 		- the file id is not legal
 		- the socket is not bound to a port
 		- the port bound to the socket is occupied by another listener
+		  (unless both sockets were marked by @c ReusePort)
 		- the socket has already been initialized
 	@see Socket
  */
@@ -695,6 +1039,131 @@ int ShutDown(Fid_t sock, shutdown_mode how);
 
 
 
+/*******************************************
+ *
+ * Asynchronous I/O
+ *
+ *******************************************/
+
+
+/** @brief The maximum number of entries of an I/O ring. */
+#define MAX_IO_RING_ENTRIES 4096
+
+
+/** @brief The operations of asynchronous I/O requests. */
+typedef enum {
+  IO_NOP,             /**< @brief Do nothing; completes at once with result 0 */
+  IO_READ,            /**< @brief @c Read from a stream */
+  IO_WRITE            /**< @brief @c Write to a stream */
+} io_opcode;
+
+
+/** @brief A submission queue entry: an I/O request. */
+typedef struct io_sqe {
+  io_opcode opcode;   /**< @brief The operation */
+  Fid_t fd;           /**< @brief The stream */
+  void* buf;          /**< @brief The buffer to read into or write from */
+  unsigned int len;   /**< @brief The size of the buffer */
+  intptr_t data;      /**< @brief A value copied to the completion */
+} io_sqe;
+
+
+/** @brief A completion queue entry: the result of a request. */
+typedef struct io_cqe {
+  intptr_t data;      /**< @brief The @c data of the request */
+  int result;         /**< @brief What @c Read or @c Write would return */
+} io_cqe;
+
+
+/**
+  @brief The rings of an I/O ring, shared by the process and the kernel.
+
+  The submission ring @c sq and the completion ring @c cq have
+  @c entries entries each, a power of two. Positions are free-running
+  counters; the entry of position @c i is at index @c (i & mask).
+
+  The process writes requests at @c sq[sq_tail & mask] and then advances
+  @c sq_tail; the kernel advances @c sq_head as it takes them.
+  The kernel writes completions at @c cq[cq_tail & mask] and then advances
+  @c cq_tail; the process advances @c cq_head as it consumes them.
+  Each side stores its own counter with release semantics, and loads the
+  counter of the other side with acquire semantics (e.g., by
+  @c __atomic_store_n and @c __atomic_load_n). The process must not place
+  more than @c entries requests on the submission ring before they are
+  taken by @c IoRingEnter.
+
+  @see IoRingSetup
+ */
+typedef struct io_ring {
+  unsigned int entries;   /**< @brief The size of each ring */
+  unsigned int mask;      /**< @brief @c entries minus 1 */
+  unsigned int sq_head;   /**< @brief Advanced by the kernel */
+  unsigned int sq_tail;   /**< @brief Advanced by the process */
+  unsigned int cq_head;   /**< @brief Advanced by the process */
+  unsigned int cq_tail;   /**< @brief Advanced by the kernel */
+  io_sqe* sq;             /**< @brief The submission ring */
+  io_cqe* cq;             /**< @brief The completion ring */
+} io_ring;
+
+
+/** @brief Create an I/O ring.
+
+  An I/O ring accepts @c Read and @c Write requests on many streams
+  and completes each of them when its stream is ready, so that a single
+  thread can overlap I/O on pipes, sockets and terminals without blocking
+  on any of them. Requests are placed on the submission ring and
+  completions are found on the completion ring, and many of them can be
+  passed by a single call to @c IoRingEnter.
+
+  The I/O ring is a stream, which is released by @c Close, along with its
+  rings and any requests not yet completed.
+
+  @param entries the number of entries of each ring, rounded up to a 
+    power of two
+  @param ring the location to store the address of the rings
+  @returns a file id for the new I/O ring, or @c NOFILE on error.
+  Possible reasons for failure:
+  - @c entries is 0 or larger than @c MAX_IO_RING_ENTRIES, or @c ring is NULL.
+  - The maximum number of file ids for the process has been reached.
+  @see IoRingEnter
+ */
+Fid_t IoRingSetup(unsigned int entries, io_ring** ring);
+
+
+/** @brief Submit requests and wait for completions.
+
+  This call takes the new requests of the submission ring and starts them.
+  A request whose stream is ready is carried out at once; the others are
+  carried out later, during this or a later call, when their streams
+  become ready. Thus, a request never blocks, except on streams which do
+  not report their readiness (see @c Poll). A request also waits, without
+  blocking, when its stream is ready but cannot take it yet, as with a 
+  datagram larger than the free space of its socket. The result of a @c Read
+  or @c Write request may be short, as the request transfers only the
+  data that can be transferred without blocking.
+
+  The number of requests in progress plus the completions not yet
+  consumed is at most @c entries; further requests stay on the
+  submission ring until completions are consumed.
+
+  The call then waits until there are at least @c min_complete
+  completions on the completion ring, or until @c timeout msec have 
+  passed. A negative timeout means no timeout.
+
+  Requests for file ids which are not open complete with result -1.
+
+  @param ring the I/O ring
+  @param min_complete the number of completions to wait for
+  @param timeout the time to wait in msec
+  @returns the number of requests taken from the submission ring, or -1
+    on error. Possible reasons for failure:
+    - @c ring is not an I/O ring.
+    - @c min_complete is larger than @c entries.
+ */
+int IoRingEnter(Fid_t ring, unsigned int min_complete, timeout_t timeout);
+
+
+
 /*******************************************
  *
  * System information
@@ -401,6 +401,9 @@ int ListPrograms(size_t argc, const char** argv)
 
 #define REMOTE_SERVER_DEFAULT_PORT 20
 
+/* The longest command accepted by the remote server */
+#define RSRV_MAX_ARGS 2048
+
 /*
   The server's "global variables".
  */
@@ -445,7 +448,7 @@ static int rsrv_listener_thread(int port, void* __globals);
 /* the thread that accepts new connections */
 static int rsrv_listener_thread(int port, void* __globals)
 {
-	Fid_t lsock = Socket(port);
+	Fid_t lsock = SocketWithKind(port, SOCKET_DATAGRAM);
 	if(Listen(lsock) == -1) {
 		printf("Cannot listen to the given port: %d\n", port);
 		return -1;
@@ -620,18 +623,6 @@ static void log_truncate(void* __globals)
 
 
 
-/* Helper to receive a message */
-static int recv_message(Fid_t sock, void* buf, size_t len)
-{
-	size_t count = 0;
-	while(count<len) {
-		int rc = Read(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or end of stream */
-		count += rc;
-	}
-	return count==len;
-}
-
 /* Helper to execute a remote process */
 static int rsrv_process(size_t argc, const char** argv)
 {
@@ -669,26 +660,18 @@ static int rsrv_client(int sock, void* __globals)
 
 	log_message(__globals, "Client[%6zu]: started", ID);
 	
-        /* Get the command from the client. The protocol is
-	   [int argl, void* args] where argl is the length of
-	   the subsequent message args.
+	/* Get the command from the client. The protocol is a single
+	   message [args], of at most RSRV_MAX_ARGS bytes.
 	 */
-	int argl;
-	if(! recv_message(sock, &argl, sizeof(argl))) {
+	char args[RSRV_MAX_ARGS];
+	int argl = Read(sock, args, RSRV_MAX_ARGS);
+	if(argl < 1) {
 		log_message(__globals,
 			    "Cliend[%6zu]: error in receiving request, aborting", ID);
 		goto finish;
 	}
-		
-	assert(argl>0 && argl <= 2048);
+
 	{
-		char args[argl];
-		if(! recv_message(sock, args, argl)) {
-			log_message(__globals,
-				    "Cliend[%6zu]: error in receiving request, aborting", ID);
-			goto finish;		
-		}
-		
 		/* Prepare to execute subprocess */
 		size_t argc = argscount(argl, args);	
 		const char* argv[argc+2];
@@ -723,14 +706,9 @@ finish:
 /* helper for RemoteClient */
 static void send_message(Fid_t sock, void* buf, size_t len)
 {
-	size_t count = 0;
-	while(count<len) {
-		int rc = Write(sock, buf+count, len-count);
-		if(rc<1) break;  /* Error or End of stream */
-		count += rc;
-	}
-	if(count!=len) {
-		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
+	int rc = Write(sock, buf, len);
+	if(rc < 0 || (size_t) rc != len) {
+		printf("In client: I/O error writing %zu bytes\n", len);
 		Exit(1);
 	}
 }
@@ -741,7 +719,7 @@ int RemoteClient(size_t argc, const char** argv)
 	checkargs(1);
 	
 	/* Create a socket to the server */
-	Fid_t sock = Socket(NOPORT);
+	Fid_t sock = SocketWithKind(NOPORT, SOCKET_DATAGRAM);
 	if(Connect(sock, REMOTE_SERVER_DEFAULT_PORT, 1000)==-1) {
 		printf("Could not connect to the server\n");
 		return -1;
@@ -751,11 +729,14 @@ int RemoteClient(size_t argc, const char** argv)
 
 	/* Make up the message */
 	int argl = argvlen(argc-1, argv+1);
+	if(argl > RSRV_MAX_ARGS) {
+		printf("The command is too long\n");
+		return -1;
+	}
 	char args[argl];
 	argvpack(args, argc-1, argv+1);
 
 	/* Send message */
-	send_message(sock, &argl, sizeof(argl));
 	send_message(sock, args, argl);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
@@ -892,6 +873,14 @@ int Shell(size_t argc, const char** argv)
 	fin = fidopen(0, "r");
 	fout = fidopen(1, "w");		
 
+	/* On a terminal, each Read returns a whole command line, so it is 
+	   safe to buffer the input: nothing is read past the line. 
+	   The previous mode is restored on exit, since an enclosing shell
+	   may have set it. */
+	int oldmode = TerminalMode(0, TERMINAL_CANONICAL);
+	if(oldmode != -1)
+		setvbuf(fin, NULL, _IOFBF, BUFSIZ);
+
 	fprintf(fout,"Starting tinyos shell\nType 'help' for help, 'exit' to quit.\n");
 
 	const int ARGN = 128;
@@ -940,6 +929,8 @@ int Shell(size_t argc, const char** argv)
 	}
 	fprintf(fout,"Exiting\n");
 finished:
+	if(oldmode != -1)
+		TerminalMode(0, oldmode);
 	free(cmdline);
 	fclose(fin);
 	fclose(fout);
@@ -5,8 +5,12 @@
 #include <time.h>
 #include <math.h>
 #include <setjmp.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
 
 #include "util.h"
+#include "bios.h"
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
@@ -510,6 +514,85 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+/*
+	Test that a large number of concurrent timed waits all terminate 
+	correctly, either by timeout or by broadcast.
+ */
+
+/* defined with the concurrency tests */
+void mark_time(struct timeval* t);
+double time_since(struct timeval* t0);
+
+struct many_timedwaits {
+	Mutex mx;
+	CondVar never;		/* nobody signals this */
+	CondVar bcast;		/* broadcast by the main thread */
+	CondVar all_waiting;
+	int N;
+	int waiting;
+	int timed_out;
+	int signalled;
+};
+
+static int many_timedwaits_thread(int i, void* args)
+{
+	struct many_timedwaits* W = args;
+	Mutex_Lock(&W->mx);
+	if(++W->waiting == W->N)
+		Cond_Signal(&W->all_waiting);
+	if(i % 2 == 0) {
+		if(Cond_TimedWait(&W->mx, &W->never, 200 + (i % 500)) == 0)
+			W->timed_out++;
+	} else {
+		if(Cond_TimedWait(&W->mx, &W->bcast, 3600000) == 1)
+			W->signalled++;
+	}
+	Mutex_Unlock(&W->mx);
+	return 0;
+}
+
+BOOT_TEST(test_cond_timedwait_many,
+	"Test that 10000 concurrent timed waits on condition variables terminate\n"
+	"on timeout, or on broadcast, in a timely manner.",
+	.timeout = 120
+	)
+{
+	const int N = 10000;
+	struct many_timedwaits W = { .mx = MUTEX_INIT, .never = COND_INIT, .bcast = COND_INIT,
+		.all_waiting = COND_INIT, .N = N, .waiting = 0, .timed_out = 0, .signalled = 0 };
+
+	Tid_t* tid = xmalloc(N*sizeof(Tid_t));
+
+	struct timeval t0;
+	mark_time(&t0);
+
+	for(int i=0; i<N; i++) {
+		tid[i] = CreateThread(many_timedwaits_thread, i, &W);
+		ASSERT(tid[i] != NOTHREAD);
+	}
+
+	Mutex_Lock(&W.mx);
+	while(W.waiting < N)
+		Cond_Wait(&W.mx, &W.all_waiting);
+	Cond_Broadcast(&W.bcast);
+	Mutex_Unlock(&W.mx);
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+
+	double T = time_since(&t0);
+	MSG("%d timed waits completed in %.3f sec\n", N, T);
+
+	ASSERT(W.timed_out == N/2);
+	ASSERT(W.signalled == N/2);
+	ASSERT(T < 30.0);
+
+	free(tid);
+	return 0;
+}
+
+
+
 /*********************************************
  *
  *
@@ -920,6 +1003,7 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_timedwait_many,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1398,6 +1482,117 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
+/* Use about 'depth' kbytes of stack */
+static int use_stack(int depth)
+{
+	volatile char frame[1024];
+	frame[0] = depth;
+	if(depth <= 1) return frame[0];
+	return use_stack(depth-1) + frame[0];
+}
+
+static int small_stack_thread(int argl, void* args)
+{
+	use_stack(argl);
+	return argl;
+}
+
+BOOT_TEST(test_create_thread_with_stack,
+	"Test that threads with a given stack size can be created and joined."
+	)
+{
+	unsigned int sizes[] = { 0, 1, 16*1024, 100*1000, 1<<30 };
+	for(int i=0; i<5; i++) {
+		int exitval;
+		Tid_t t = CreateThreadWithStack(small_stack_thread, 8, NULL, sizes[i]);
+		ASSERT(t!=NOTHREAD);
+		ASSERT(ThreadJoin(t, &exitval)==0);
+		ASSERT(exitval==8);
+	}
+	return 0;
+}
+
+
+/* Scheduler tuning and instrumentation, from kernel_sched.c */
+extern unsigned int sched_boost_period;
+extern int pipe_spsc_enabled;
+extern unsigned int socket_backlog;
+void sched_print_stats(FILE* out);
+
+static struct boost_load {
+	Mutex mx;
+	unsigned long count;
+} boost_load;
+
+/* Contend for a mutex, so that Mutex_Lock yields with preemption on */
+static int boost_contend_thread(int argl, void* args)
+{
+	struct boost_load* B = &boost_load;
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < 0.3) {
+		Mutex_Lock(&B->mx);
+		B->count++;
+		for(volatile int i=0; i<1000; i++);
+		Mutex_Unlock(&B->mx);
+	}
+	return 0;
+}
+
+static int boost_load_main(int argl, void* args)
+{
+	Tid_t tid[argl];
+	for(int i=0; i<argl; i++)
+		tid[i] = CreateThread(boost_contend_thread, 0, NULL);
+	for(int i=0; i<argl; i++)
+		ThreadJoin(tid[i], NULL);
+	return 0;
+}
+
+BARE_TEST(test_boost_every_yield,
+	"Test that the scheduler survives a priority boost on every yield, with\n"
+	"preemption and contended mutexes on several cores.",
+	.timeout = 30
+	)
+{
+	unsigned int saved_period = sched_boost_period;
+	sched_boost_period = 1;
+	boost_load.mx = MUTEX_INIT;
+	boost_load.count = 0;
+	boot(4, 0, boost_load_main, 16, NULL);
+	sched_boost_period = saved_period;
+	ASSERT(boost_load.count > 0);
+}
+
+
+#ifdef MMAPPED_THREAD_MEM
+
+static int overflow_stack_main(int argl, void* args)
+{
+	Tid_t t = CreateThreadWithStack(small_stack_thread, 64, NULL, 16*1024);
+	ThreadJoin(t, NULL);
+	return 0;
+}
+
+BARE_TEST(test_stack_overflow_guard,
+	"Test that a thread overflowing its stack hits the guard page, instead of\n"
+	"corrupting memory."
+	)
+{
+	pid_t pid = fork();
+	ASSERT(pid != -1);
+	if(pid == 0) {
+		boot(1, 0, overflow_stack_main, 0, NULL);
+		exit(0);
+	}
+	int status;
+	ASSERT(waitpid(pid, &status, 0) == pid);
+	ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+}
+
+#endif
+
+
 TEST_SUITE(thread_tests, 
 	"A suite of tests for threads."
 	)
@@ -1416,6 +1611,11 @@ TEST_SUITE(thread_tests,
 	&test_main_exit_cleanup,
 	&test_noexit_cleanup,
 	&test_cyclic_joins,
+	&test_create_thread_with_stack,
+	&test_boost_every_yield,
+#ifdef MMAPPED_THREAD_MEM
+	&test_stack_overflow_guard,
+#endif
 	NULL
 };
 
@@ -1633,6 +1833,501 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
+/*
+	A thread that reads a pipe to exhaustion.
+ */
+static int pipe_drain_thread(int fd, void* args)
+{
+	size_t* count = args;
+	char buffer[65536];
+	int rc;
+	while((rc = Read(fd, buffer, sizeof(buffer))) > 0)
+		*count += rc;
+	return 0;
+}
+
+static int pipe_writer_thread(int n, void* args)
+{
+	Fid_t fid = *(Fid_t*) args;
+	char buffer[1000];
+	while(n > 0) {
+		int rc = Write(fid, buffer, n < 1000 ? n : 1000);
+		ASSERT(rc > 0);
+		n -= rc;
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_threads_share_end,
+	"Test a pipe whose write end is used by several threads of the same process\n"
+	"at the same time, with the reader in another thread."
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+
+	const int nthreads = 4, N = 1000000;
+	Tid_t tid[nthreads];
+	for(int i=0; i<nthreads; i++)
+		tid[i] = CreateThread(pipe_writer_thread, N, &pipe.write);
+
+	size_t count = 0;
+	Tid_t reader = CreateThread(pipe_drain_thread, pipe.read, &count);
+
+	for(int i=0; i<nthreads; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	Close(pipe.write);
+	ASSERT(ThreadJoin(reader, NULL)==0);
+	ASSERT(count == nthreads*N);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice_and_tee,
+	"Test Splice and Tee between pipes, and between pipes and the null device."
+	)
+{
+	pipe_t A, B;
+	ASSERT(Pipe(&A)==0);
+	ASSERT(Pipe(&B)==0);
+	char buffer[32];
+
+	ASSERT(Write(A.write, "Hello world", 12)==12);
+
+	/* Tee leaves the data in A */
+	ASSERT(Tee(A.read, B.write, 100)==12);
+	ASSERT(Splice(A.read, B.write, 100)==12);
+	ASSERT(Read(B.read, buffer, 32)==24);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	ASSERT(strcmp(buffer+12, "Hello world")==0);
+
+	/* The ends of the same pipe cannot be spliced */
+	ASSERT(Write(A.write, "Hello world", 12)==12);
+	ASSERT(Splice(A.read, A.write, 100)==-1);
+	ASSERT(Tee(A.read, A.write, 100)==-1);
+
+	/* Splice to and from a device */
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull != NOFILE);
+	ASSERT(Splice(A.read, fnull, 5)==5);
+	ASSERT(Read(A.read, buffer, 32)==7);
+	ASSERT(strcmp(buffer, " world")==0);
+	ASSERT(Splice(fnull, B.write, 10)==10);
+	ASSERT(Read(B.read, buffer, 32)==10);
+	for(int i=0; i<10; i++) ASSERT(buffer[i]==0);
+
+	/* Tee needs a pipe to read from */
+	ASSERT(Tee(fnull, B.write, 10)==-1);
+
+	/* Wrong direction */
+	ASSERT(Splice(B.write, A.write, 10)==-1);
+	ASSERT(Splice(A.read, B.read, 10)==-1);
+
+	/* End of data */
+	Close(A.write);
+	ASSERT(Splice(A.read, B.write, 10)==0);
+	ASSERT(Tee(A.read, B.write, 10)==0);
+
+	/* Closed reader */
+	Close(B.read);
+	ASSERT(Splice(fnull, B.write, 10)==-1);
+	return 0;
+}
+
+
+struct splice_args { Fid_t from, to; };
+
+static int splice_thread(int size, void* args)
+{
+	struct splice_args* S = args;
+	return Splice(S->from, S->to, size);
+}
+
+static int read_one_thread(int fd, void* args)
+{
+	char* c = args;
+	return Read(fd, c, 1);
+}
+
+BOOT_TEST(test_splice_holds_end,
+	"Test that a reader of a pipe waits for a Splice from the same pipe,\n"
+	"which sleeps because its output pipe is full, and then proceeds."
+	)
+{
+	pipe_t A, B;
+	ASSERT(Pipe(&A)==0);
+	ASSERT(Pipe(&B)==0);
+
+	/* Fill B */
+	static char buffer[1024];
+	pollfd fds = { .fd = B.write, .events = POLL_WRITE };
+	while(Poll(&fds, 1, 0)==1)
+		ASSERT(Write(B.write, buffer, sizeof(buffer)) > 0);
+
+	ASSERT(Write(A.write, "abc", 3)==3);
+	struct splice_args S = { A.read, B.write };
+	Tid_t ts = CreateThread(splice_thread, 100, &S);
+	char c = 0;
+	Tid_t tr = CreateThread(read_one_thread, A.read, &c);
+
+	/* Let both threads block */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+	ASSERT(c == 0);
+
+	/* Unblock the splice; the reader then finds A empty */
+	ASSERT(Read(B.read, buffer, sizeof(buffer))==sizeof(buffer));
+	int rc;
+	ASSERT(ThreadJoin(ts, &rc)==0);
+	ASSERT(rc == 3);
+	ASSERT(Write(A.write, "d", 1)==1);
+	ASSERT(ThreadJoin(tr, &rc)==0);
+	ASSERT(rc == 1);
+	ASSERT(c == 'd');
+	return 0;
+}
+
+
+/* Write a byte to a pipe after 50 msec */
+static int delayed_write_thread(int fd, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+	ASSERT(Write(fd, "x", 1)==1);
+	return 0;
+}
+
+BOOT_TEST(test_poll_pipe,
+	"Test Poll on pipes, the null device and bad file ids."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	Fid_t fnull = OpenNull();
+
+	pollfd fds[4] = {
+		{ .fd = p.read, .events = POLL_READ },
+		{ .fd = p.write, .events = POLL_WRITE },
+		{ .fd = fnull, .events = POLL_READ|POLL_WRITE },
+		{ .fd = -1, .events = POLL_READ }
+	};
+
+	/* The write end and the null device are ready */
+	ASSERT(Poll(fds, 4, 0)==2);
+	ASSERT(fds[0].revents==0);
+	ASSERT(fds[1].revents==POLL_WRITE);
+	ASSERT(fds[2].revents==(POLL_READ|POLL_WRITE));
+	ASSERT(fds[3].revents==0);
+
+	/* Timeout */
+	struct timeval t0;
+	mark_time(&t0);
+	ASSERT(Poll(fds, 1, 100)==0);
+	ASSERT(time_since(&t0) >= 0.09);
+
+	/* Wake up on data */
+	Tid_t t = CreateThread(delayed_write_thread, p.write, NULL);
+	ASSERT(Poll(fds, 1, -1)==1);
+	ASSERT(fds[0].revents==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	char c;
+	ASSERT(Read(p.read, &c, 1)==1);
+
+	/* Bad file ids, and too many entries */
+	fds[3].fd = 13;
+	ASSERT(Poll(fds+3, 1, -1)==1);
+	ASSERT(fds[3].revents==POLL_INVALID);
+	pollfd many[MAX_FILEID+1];
+	ASSERT(Poll(many, MAX_FILEID+1, 0)==-1);
+
+	/* A full pipe is not ready for writing */
+	static char buffer[1024];
+	while(Poll(fds+1, 1, 0)==1)
+		ASSERT(Write(p.write, buffer, sizeof(buffer)) > 0);
+	ASSERT(Read(p.read, buffer, sizeof(buffer)) > 0);
+	ASSERT(Poll(fds+1, 1, -1)==1);
+
+	/* Hangup and error */
+	Close(p.write);
+	ASSERT(Poll(fds, 1, -1)==1);
+	ASSERT(fds[0].revents & POLL_HANGUP);
+
+	pipe_t q;
+	ASSERT(Pipe(&q)==0);
+	Close(q.read);
+	fds[1].fd = q.write;
+	ASSERT(Poll(fds+1, 1, -1)==1);
+	ASSERT(fds[1].revents==POLL_ERROR);
+	return 0;
+}
+
+
+BOOT_TEST(test_vectored_io,
+	"Test ReadV and WriteV on pipes, and on a stream without vectored methods."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	/* Gather, then scatter at different boundaries */
+	char a[] = "Hello", b[] = " ", c[] = "world";
+	iovec_t out[4] = {
+		{ .base = a, .len = 5 }, { .base = NULL, .len = 0 },
+		{ .base = b, .len = 1 }, { .base = c, .len = 6 }
+	};
+	ASSERT(WriteV(p.write, out, 4)==12);
+
+	char x[3], y[20];
+	iovec_t in[2] = { { .base = x, .len = 3 }, { .base = y, .len = 20 } };
+	ASSERT(ReadV(p.read, in, 2)==12);
+	ASSERT(memcmp(x, "Hel", 3)==0);
+	ASSERT(strcmp(y, "lo world")==0);
+
+	/* A short vectored read leaves the rest */
+	ASSERT(WriteV(p.write, out, 4)==12);
+	in[1].len = 4;
+	ASSERT(ReadV(p.read, in, 2)==7);
+	ASSERT(memcmp(y, "lo w", 4)==0);
+	ASSERT(Read(p.read, y, 20)==5);
+	ASSERT(strcmp(y, "orld")==0);
+
+	/* Empty vectors, and errors */
+	ASSERT(WriteV(p.write, out, 0)==0);
+	ASSERT(WriteV(p.write, NULL, 1)==-1);
+	ASSERT(ReadV(p.write, in, 2)==-1);
+	ASSERT(WriteV(p.read, out, 4)==-1);
+	ASSERT(WriteV(13, out, 4)==-1);
+	iovec_t huge[2] = { { .base = y, .len = 1u<<31 }, { .base = y, .len = 1u<<31 } };
+	ASSERT(WriteV(p.write, huge, 2)==-1);
+
+	/* The null device has no vectored methods */
+	Fid_t fnull = OpenNull();
+	ASSERT(WriteV(fnull, out, 4)==12);
+	memset(y, 1, sizeof(y));
+	in[1].len = 20;
+	ASSERT(ReadV(fnull, in, 2)==23);
+	ASSERT(x[0]==0 && y[19]==0);
+
+	/* End of data */
+	Close(p.write);
+	ASSERT(ReadV(p.read, in, 2)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_event_queue,
+	"Test event queues on pipes: adding, modifying and removing streams, edge-triggered "
+	"events, timeouts and errors."
+	)
+{
+	pipe_t p, q;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(Pipe(&q)==0);
+	Fid_t eq = EventQueue();
+	ASSERT(eq!=NOFILE);
+
+	event_record ev[4];
+
+	/* Errors */
+	ASSERT(EventCtl(p.read, EVQ_ADD, q.read, POLL_READ, 0)==-1);
+	ASSERT(EventCtl(eq, EVQ_ADD, 13, POLL_READ, 0)==-1);
+	ASSERT(EventCtl(eq, EVQ_ADD, eq, POLL_READ, 0)==-1);
+	ASSERT(EventCtl(eq, EVQ_MODIFY, p.read, POLL_READ, 0)==-1);
+	ASSERT(EventCtl(eq, EVQ_REMOVE, p.read, 0, 0)==-1);
+	ASSERT(EventWait(p.read, ev, 4, 0)==-1);
+	ASSERT(EventWait(eq, ev, 0, 0)==-1);
+
+	/* A stream ready when added is reported once */
+	ASSERT(EventCtl(eq, EVQ_ADD, p.read, POLL_READ, 10)==0);
+	ASSERT(EventCtl(eq, EVQ_ADD, p.read, POLL_READ, 10)==-1);
+	ASSERT(EventCtl(eq, EVQ_ADD, q.write, POLL_WRITE, 20)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].data==20 && ev[0].events==POLL_WRITE);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	/* Timeout */
+	struct timeval t0;
+	mark_time(&t0);
+	ASSERT(EventWait(eq, ev, 4, 100)==0);
+	ASSERT(time_since(&t0) >= 0.09);
+
+	/* Wake up on data, which is reported once */
+	Tid_t t = CreateThread(delayed_write_thread, p.write, NULL);
+	ASSERT(EventWait(eq, ev, 4, -1)==1);
+	ASSERT(ev[0].data==10 && ev[0].events==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	/* New data is a new edge */
+	ASSERT(Write(p.write, "x", 1)==1);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	char buf[2];
+	ASSERT(Read(p.read, buf, 2)==2);
+
+	/* At most max events are returned; the rest are kept */
+	pipe_t r;
+	ASSERT(Pipe(&r)==0);
+	ASSERT(EventCtl(eq, EVQ_ADD, r.read, POLL_READ, 30)==0);
+	ASSERT(Write(p.write, "x", 1)==1);
+	ASSERT(Write(r.write, "x", 1)==1);
+	ASSERT(EventWait(eq, ev, 1, 0)==1);
+	ASSERT(ev[0].data==10);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].data==30);
+
+	/* Modify reports a stream which is ready */
+	ASSERT(EventCtl(eq, EVQ_MODIFY, p.read, POLL_READ, 11)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].data==11);
+
+	/* A removed stream is not reported */
+	ASSERT(EventCtl(eq, EVQ_REMOVE, r.read, 0, 0)==0);
+	ASSERT(Write(r.write, "x", 1)==1);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	/* The stream stays added while it has another fid */
+	Fid_t dup = MAX_FILEID-1;
+	ASSERT(Dup2(p.read, dup)==0);
+	Close(p.read);
+	ASSERT(Write(p.write, "x", 1)==1);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].data==11);
+
+	/* Closing its last fid closes the stream and removes it */
+	Close(dup);
+	ASSERT(Write(p.write, "x", 1)==-1);
+	ASSERT(EventCtl(eq, EVQ_REMOVE, dup, 0, 0)==-1);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	/* Hangup is always reported */
+	ASSERT(EventCtl(eq, EVQ_ADD, r.read, 0, 40)==0);
+	Close(r.write);
+	ASSERT(EventWait(eq, ev, 4, -1)==1);
+	ASSERT(ev[0].data==40 && (ev[0].events & POLL_HANGUP));
+
+	/* Closing the queue does not close the streams */
+	ASSERT(Write(q.write, "x", 1)==1);
+	ASSERT(Close(eq)==0);
+	ASSERT(Read(q.read, buf, 2)==1);
+	return 0;
+}
+
+
+/* Helpers for I/O rings */
+static void ring_submit(io_ring* r, io_opcode op, Fid_t fd, void* buf, unsigned int len, intptr_t data)
+{
+	io_sqe* sqe = & r->sq[r->sq_tail & r->mask];
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->buf = buf;
+	sqe->len = len;
+	sqe->data = data;
+	__atomic_store_n(& r->sq_tail, r->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static int ring_complete(io_ring* r, io_cqe* cqe)
+{
+	if(r->cq_head == __atomic_load_n(& r->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+	*cqe = r->cq[r->cq_head & r->mask];
+	__atomic_store_n(& r->cq_head, r->cq_head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+BOOT_TEST(test_io_ring,
+	"Test I/O rings on pipes: immediate and deferred completions, timeouts,\n"
+	"the limit of requests in progress, and errors."
+	)
+{
+	io_ring* r;
+	ASSERT(IoRingSetup(0, &r)==NOFILE);
+	ASSERT(IoRingSetup(MAX_IO_RING_ENTRIES+1, &r)==NOFILE);
+	ASSERT(IoRingSetup(4, NULL)==NOFILE);
+
+	Fid_t ring = IoRingSetup(3, &r);
+	ASSERT(ring!=NOFILE);
+	ASSERT(r->entries==4 && r->mask==3);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	io_cqe cqe = {0};
+	char buf[16];
+
+	/* Errors */
+	ASSERT(IoRingEnter(p.read, 0, 0)==-1);
+	ASSERT(IoRingEnter(ring, 5, 0)==-1);
+
+	/* No-ops, bad file ids, and streams without the method complete at once */
+	ring_submit(r, IO_NOP, NOFILE, NULL, 0, 1);
+	ring_submit(r, IO_READ, 13, buf, 16, 2);
+	ring_submit(r, IO_WRITE, p.read, buf, 16, 3);
+	ASSERT(IoRingEnter(ring, 3, 0)==3);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==1 && cqe.result==0);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==2 && cqe.result==-1);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==3 && cqe.result==-1);
+	ASSERT(! ring_complete(r, &cqe));
+
+	/* A read of an empty pipe is deferred */
+	ring_submit(r, IO_READ, p.read, buf, 16, 10);
+	struct timeval t0;
+	mark_time(&t0);
+	ASSERT(IoRingEnter(ring, 1, 100)==1);
+	ASSERT(time_since(&t0) >= 0.09);
+	ASSERT(! ring_complete(r, &cqe));
+
+	/* A write completes at once, and makes the read complete */
+	ring_submit(r, IO_WRITE, p.write, "hello", 5, 11);
+	ASSERT(IoRingEnter(ring, 2, -1)==1);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==11 && cqe.result==5);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==10 && cqe.result==5);
+	ASSERT(memcmp(buf, "hello", 5)==0);
+
+	/* Wake up on data written by another thread */
+	ring_submit(r, IO_READ, p.read, buf, 16, 12);
+	Tid_t t = CreateThread(delayed_write_thread, p.write, NULL);
+	ASSERT(IoRingEnter(ring, 1, -1)==1);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==12 && cqe.result==1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* At most 4 requests in progress, or completions not consumed */
+	pipe_t q;
+	ASSERT(Pipe(&q)==0);
+	for(int i = 0; i < 4; i++)
+		ring_submit(r, IO_READ, q.read, buf+4*i, 4, 20+i);
+	ASSERT(IoRingEnter(ring, 0, 0)==4);
+	ring_submit(r, IO_NOP, NOFILE, NULL, 0, 24);
+	ASSERT(IoRingEnter(ring, 0, 0)==0);
+	ASSERT(Write(q.write, "abcdefghijkl", 12)==12);
+	ASSERT(IoRingEnter(ring, 3, -1)==0);
+	for(int i = 0; i < 3; i++) {
+		ASSERT(ring_complete(r, &cqe));
+		ASSERT(cqe.data==20+i && cqe.result==4);
+	}
+	ASSERT(memcmp(buf, "abcdefghijkl", 12)==0);
+	ASSERT(IoRingEnter(ring, 0, 0)==1);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==24);
+
+	/* End of data completes a read */
+	Close(q.write);
+	ASSERT(IoRingEnter(ring, 1, -1)==0);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==23 && cqe.result==0);
+
+	/* The ring may be closed with requests in progress */
+	ring_submit(r, IO_READ, p.read, buf, 16, 30);
+	ASSERT(IoRingEnter(ring, 0, 0)==1);
+	ASSERT(Close(ring)==0);
+	ASSERT(Write(p.write, "x", 1)==1);
+	ASSERT(Read(p.read, buf, 16)==1);
+	return 0;
+}
+
+
 TEST_SUITE(pipe_tests,
 	"A suite of tests for pipes. We are focusing on correctness, not performance."
 	)
@@ -1643,6 +2338,13 @@ TEST_SUITE(pipe_tests,
 	&test_pipe_close_writer,
 	&test_pipe_single_producer,
 	&test_pipe_multi_producer,
+	&test_pipe_threads_share_end,
+	&test_splice_and_tee,
+	&test_splice_holds_end,
+	&test_poll_pipe,
+	&test_vectored_io,
+	&test_event_queue,
+	&test_io_ring,
 	NULL
 };
 
@@ -2191,6 +2893,262 @@ BOOT_TEST(test_shudown_write,
 
 
 
+static int poll_read_thread(int fd, void* args)
+{
+	pollfd pfd = { .fd = fd, .events = POLL_READ };
+	ASSERT(Poll(&pfd, 1, -1)==1);
+	return pfd.revents;
+}
+
+BOOT_TEST(test_shutdown_wakes_reader,
+	"Test that ShutDown with SHUTDOWN_READ wakes up a Read and a Poll that\n"
+	"are blocked on the same socket, and that Read then fails."
+	)
+{
+	Fid_t lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	Fid_t cli = Socket(NOPORT); ASSERT(cli!=NOFILE);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	char c = 0;
+	Tid_t tr = CreateThread(read_one_thread, cli, &c);
+	Tid_t tp = CreateThread(poll_read_thread, cli, NULL);
+
+	/* Let both threads block */
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 50);
+	Mutex_Unlock(&mx);
+
+	ASSERT(ShutDown(cli, SHUTDOWN_READ)==0);
+	int rc;
+	ASSERT(ThreadJoin(tr, &rc)==0);
+	ASSERT(rc == -1);
+	ASSERT(ThreadJoin(tp, &rc)==0);
+	ASSERT(rc == POLL_HANGUP);
+
+	/* The other direction still works */
+	ASSERT(Write(srv, "x", 1)==-1);
+	check_transfer(cli, srv);
+	return 0;
+}
+
+
+
+
+BOOT_TEST(test_datagram_socket_boundaries,
+	"Test that datagram sockets keep the boundaries of messages, and that they\n"
+	"only connect to datagram listeners."
+	)
+{
+	ASSERT(SocketWithKind(NOPORT, SOCKET_DATAGRAM+1)==NOFILE);
+	ASSERT(SocketWithKind(MAX_PORT+1, SOCKET_DATAGRAM)==NOFILE);
+
+	Fid_t lsock = SocketWithKind(100, SOCKET_DATAGRAM);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* A stream socket cannot connect to a datagram listener */
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 100, 100)==-1);
+
+	Fid_t cli = SocketWithKind(NOPORT, SOCKET_DATAGRAM);
+	ASSERT(cli!=NOFILE);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* Each Read returns one whole message */
+	static char buffer[1<<20];
+	const unsigned int sizes[] = { 5, 1, 100, 4000 };
+	for(int i=0; i<4; i++) {
+		memset(buffer, 'a'+i, sizes[i]);
+		ASSERT(Write(cli, buffer, sizes[i])==sizes[i]);
+	}
+	for(int i=0; i<4; i++) {
+		ASSERT(Read(srv, buffer, sizeof(buffer))==sizes[i]);
+		ASSERT(buffer[0]=='a'+i && buffer[sizes[i]-1]=='a'+i);
+	}
+
+	/* A short Read leaves the rest of the message for the next */
+	ASSERT(Write(srv, "Hello world", 12)==12);
+	ASSERT(Write(srv, "Bye", 4)==4);
+	ASSERT(Read(cli, buffer, 6)==6);
+	ASSERT(Read(cli, buffer+6, 100)==6);
+	ASSERT(strcmp(buffer, "Hello world")==0);
+	ASSERT(Read(cli, buffer, 100)==4);
+	ASSERT(strcmp(buffer, "Bye")==0);
+
+	/* A vectored write is one message, and a vectored read gets one message */
+	char hdr[2] = { 'H', ':' };
+	iovec_t out[2] = { { .base = hdr, .len = 2 }, { .base = "payload", .len = 8 } };
+	ASSERT(WriteV(cli, out, 2)==10);
+	ASSERT(Write(cli, "next", 5)==5);
+	char rhdr[2];
+	iovec_t in[2] = { { .base = rhdr, .len = 2 }, { .base = buffer, .len = 100 } };
+	ASSERT(ReadV(srv, in, 2)==10);
+	ASSERT(rhdr[0]=='H' && strcmp(buffer, "payload")==0);
+	ASSERT(Read(srv, buffer, 100)==5);
+
+	/* Empty messages are not sent, and too long messages fail */
+	ASSERT(Write(cli, buffer, 0)==0);
+	ASSERT(Write(cli, buffer, sizeof(buffer))==-1);
+
+	/* End of data, after a shutdown */
+	ASSERT(Write(cli, "Hello world", 12)==12);
+	ASSERT(ShutDown(cli, SHUTDOWN_WRITE)==0);
+	ASSERT(Read(srv, buffer, 100)==12);
+	ASSERT(Read(srv, buffer, 100)==0);
+
+	return 0;
+}
+
+
+BOOT_TEST(test_io_ring_datagram_full,
+	"Test that an I/O ring write of a datagram larger than the free space of\n"
+	"its socket waits without blocking IoRingEnter, and completes once the\n"
+	"peer makes room."
+	)
+{
+	Fid_t lsock = SocketWithKind(100, SOCKET_DATAGRAM);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = SocketWithKind(NOPORT, SOCKET_DATAGRAM);
+	ASSERT(cli!=NOFILE);
+	Fid_t srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	/* Leave less room than a 1000-byte message, but enough for Poll */
+	static char buffer[8000];
+	memset(buffer, 'a', sizeof(buffer));
+	ASSERT(Write(cli, buffer, 8000)==8000);
+	ASSERT(Write(cli, buffer, 8000)==8000);
+	pollfd pfd = { .fd = cli, .events = POLL_WRITE };
+	ASSERT(Poll(&pfd, 1, 0)==1);
+
+	io_ring* r;
+	Fid_t ring = IoRingSetup(4, &r);
+	ASSERT(ring!=NOFILE);
+	io_cqe cqe = {0};
+	char msg[1000];
+	memset(msg, 'b', sizeof(msg));
+
+	ring_submit(r, IO_WRITE, cli, msg, sizeof(msg), 1);
+	ASSERT(IoRingEnter(ring, 0, 0)==1);
+	ASSERT(! ring_complete(r, &cqe));
+
+	/* Reading a message makes room, and the write completes */
+	ASSERT(Read(srv, buffer, sizeof(buffer))==8000);
+	ASSERT(IoRingEnter(ring, 1, -1)==0);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==1 && cqe.result==1000);
+
+	ASSERT(Read(srv, buffer, sizeof(buffer))==8000);
+	ASSERT(Read(srv, buffer, sizeof(buffer))==1000);
+	ASSERT(buffer[0]=='b' && buffer[999]=='b');
+	ASSERT(Close(ring)==0);
+	return 0;
+}
+
+
+static int reuse_port_connector(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(sock!=NOFILE);
+		ASSERT(Connect(sock, 100, -1)==0);
+		Close(sock);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_reuse_port,
+	"Test that sockets marked by ReusePort can listen at the same port, and that\n"
+	"connections are spread over them round-robin."
+	)
+{
+	Fid_t L[2];
+	for(int i=0; i<2; i++) {
+		L[i] = Socket(100);
+		ASSERT(L[i]!=NOFILE);
+		ASSERT(ReusePort(L[i])==0);
+		ASSERT(Listen(L[i])==0);
+	}
+	ASSERT(ReusePort(L[0])==-1);
+
+	/* All the listeners of a port must be marked */
+	Fid_t other = Socket(100);
+	ASSERT(Listen(other)==-1);
+	ASSERT(ReusePort(NOFILE)==-1);
+	ASSERT(ReusePort(OpenNull())==-1);
+
+	/* Each Connect waits to be accepted, so the listeners take turns */
+	Tid_t t = CreateThread(reuse_port_connector, 6, NULL);
+	for(int i=0; i<4; i++) {
+		Fid_t srv = Accept(L[i%2]);
+		ASSERT(srv!=NOFILE);
+		Close(srv);
+	}
+
+	/* Closed listeners leave the rotation */
+	Close(L[0]);
+	for(int i=0; i<2; i++) {
+		Fid_t srv = Accept(L[1]);
+		ASSERT(srv!=NOFILE);
+		Close(srv);
+	}
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	Close(L[1]);
+	ASSERT(Listen(other)==0);
+	return 0;
+}
+
+
+static int poll_connector_thread(int argl, void* args)
+{
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(sock!=NOFILE);
+	ASSERT(Connect(sock, 100, -1)==0);
+	ASSERT(Write(sock, "Hello", 6)==6);
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(test_poll_socket,
+	"Test Poll on listening and connected sockets."
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	pollfd fds[2] = { { .fd = lsock, .events = POLL_READ } };
+	ASSERT(Poll(fds, 1, 0)==0);
+
+	/* A listener is ready when a connection is pending */
+	Tid_t t = CreateThread(poll_connector_thread, 0, NULL);
+	ASSERT(Poll(fds, 1, -1)==1);
+	ASSERT(fds[0].revents==POLL_READ);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+
+	/* A peer is ready when data arrives, and hangs up on close */
+	fds[1].fd = srv;
+	fds[1].events = POLL_READ;
+	ASSERT(Poll(fds+1, 1, -1)==1);
+	ASSERT(fds[1].revents & POLL_READ);
+	char buffer[6];
+	ASSERT(Read(srv, buffer, 6)==6);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Poll(fds+1, 1, -1)==1);
+	ASSERT(fds[1].revents & POLL_HANGUP);
+	return 0;
+}
+
+
 TEST_SUITE(socket_tests,
 	"A suite of tests for sockets."
 	)
@@ -2225,6 +3183,12 @@ TEST_SUITE(socket_tests,
 
 	&test_shudown_read,
 	&test_shudown_write,
+	&test_shutdown_wakes_reader,
+	&test_io_ring_datagram_full,
+
+	&test_datagram_socket_boundaries,
+	&test_reuse_port,
+	&test_poll_socket,
 
 	NULL
 };
@@ -2537,20 +3501,1802 @@ BOOT_TEST(test_term_input_driver_interrupt,
 }
 
 
-
-
-TEST_SUITE(io_tests,
-	"A suite of tests which test the concurrency of terminal I/O."
+BOOT_TEST(test_poll_terminal,
+	"Test Poll on a terminal, and that the char it reads is not lost.\n"
+	"Also test that an I/O ring read of a terminal waits for input.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fid = OpenTerminal(0);
+	ASSERT(fid!=NOFILE);
+	pollfd fds[1] = { { .fd = fid, .events = POLL_READ|POLL_WRITE } };
+	ASSERT(Poll(fds, 1, 0)==1);
+	ASSERT(fds[0].revents==POLL_WRITE);
+
+	fds[0].events = POLL_READ;
+	sendme(0, "ab");
+	ASSERT(Poll(fds, 1, -1)==1);
+	ASSERT(fds[0].revents==POLL_READ);
+
+	char buffer[2];
+	int count = 0;
+	while(count < 2)
+		count += Read(fid, buffer+count, 2-count);
+	ASSERT(buffer[0]=='a' && buffer[1]=='b');
+
+	io_ring* r;
+	Fid_t ring = IoRingSetup(2, &r);
+	ASSERT(ring!=NOFILE);
+	io_cqe cqe = {0};
+	ring_submit(r, IO_READ, fid, buffer, 2, 1);
+	ASSERT(IoRingEnter(ring, 0, 0)==1);
+	sendme(0, "c");
+	ASSERT(IoRingEnter(ring, 1, -1)==0);
+	ASSERT(ring_complete(r, &cqe) && cqe.data==1 && cqe.result==1);
+	ASSERT(buffer[0]=='c');
+	return 0;
+}
+
+
+
+BOOT_TEST(test_terminal_canonical_mode,
+	"Test that in canonical mode a read on a terminal returns one line,\n"
+	"that switching to raw mode makes a partial line readable, and that\n"
+	"TerminalMode returns the previous mode.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t fid = OpenTerminal(0);
+	ASSERT(fid!=NOFILE);
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull!=NOFILE);
+
+	ASSERT(TerminalMode(fnull, TERMINAL_CANONICAL)==-1);
+	ASSERT(TerminalMode(fid, 7)==-1);
+	ASSERT(TerminalMode(fid, TERMINAL_CANONICAL)==TERMINAL_RAW);
+	ASSERT(TerminalMode(fid, TERMINAL_CANONICAL)==TERMINAL_CANONICAL);
+
+	/* A partial line cannot be read */
+	pollfd fds[1] = { { .fd = fid, .events = POLL_READ } };
+	sendme(0, "ab");
+	ASSERT(Poll(fds, 1, 100)==0);
+
+	/* Each read returns one line */
+	sendme(0, "cd\nef\n");
+	char buffer[64];
+	ASSERT(Read(fid, buffer, sizeof(buffer))==5);
+	ASSERT(memcmp(buffer, "abcd\n", 5)==0);
+	ASSERT(Read(fid, buffer, sizeof(buffer))==3);
+	ASSERT(memcmp(buffer, "ef\n", 3)==0);
+
+	/* A partial line becomes readable in raw mode */
+	sendme(0, "gh");
+	ASSERT(Poll(fds, 1, 100)==0);
+	ASSERT(TerminalMode(fid, TERMINAL_RAW)==TERMINAL_CANONICAL);
+	int count = 0;
+	while(count < 2)
+		count += Read(fid, buffer+count, 2-count);
+	ASSERT(buffer[0]=='g' && buffer[1]=='h');
+	return 0;
+}
+
+
+
+TEST_SUITE(io_tests,
+	"A suite of tests which test the concurrency of terminal I/O."
 	)
 {
 	&test_input_concurrency,
 	&test_term_input_driver_interrupt,
+	&test_poll_terminal,
+	&test_terminal_canonical_mode,
 	NULL
 };
 
 
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *
+ *
+ *********************************************/
+
+
+/*
+	Benchmarks report their measurements with MSG(). They are not part of
+	'all_tests'; run them by
+	  ./validate_api benchmark_tests
+ */
+
+
+/* Run a symposium of threads as the init task, with stdout suppressed */
+static double timed_symposium(uint ncores, symposium_t* symp)
+{
+	struct timeval t0;
+
+	fflush(stdout);
+	FILE* saved = stdout;
+	stdout = fopen("/dev/null", "w");
+
+	mark_time(&t0);
+	boot(ncores, 0, SymposiumOfThreads, sizeof(*symp), symp);
+	double T = time_since(&t0);
+
+	fclose(stdout);
+	stdout = saved;
+	return T;
+}
+
+
+BARE_TEST(bench_symposium_scaling,
+	"Measure the run time of a symposium of threads on 1 to 32 cores,\n"
+	"to show the scaling of the scheduler.",
+	.timeout = 300
+	)
+{
+	symposium_t symp;
+	symp.N = 200;
+	symp.bites = 5;
+	adjust_symposium(&symp, -4, 0);
+
+	double T1 = 0.0;
+	for(uint ncores = 1; ncores <= MAX_CORES; ncores *= 2) {
+		double T = timed_symposium(ncores, &symp);
+		if(ncores == 1) T1 = T;
+		MSG("cores=%2u  time=%8.3f sec  speedup=%6.2f\n", ncores, T, T1/T);
+	}
+}
+
+
+/*
+	A token is passed around a ring of threads. Every pass is a wakeup and
+	a sleep, so the scheduler is entered twice per pass.
+ */
+struct token_ring {
+	Mutex mx;
+	CondVar* turn;
+	int nthreads;
+	int token;
+	int passes;
+};
+
+static int token_ring_thread(int i, void* args)
+{
+	struct token_ring* R = args;
+	Mutex_Lock(&R->mx);
+	while(R->passes > 0) {
+		if(R->token == i) {
+			R->passes--;
+			R->token = (i+1) % R->nthreads;
+			Cond_Signal(&R->turn[R->token]);
+		} else
+			Cond_Wait(&R->mx, &R->turn[i]);
+	}
+	/* Release everyone */
+	for(int j=0; j<R->nthreads; j++)
+		Cond_Signal(&R->turn[j]);
+	Mutex_Unlock(&R->mx);
+	return 0;
+}
+
+static double token_ring_rate(int nthreads, int passes)
+{
+	struct token_ring R = { MUTEX_INIT, NULL, nthreads, 0, passes };
+	R.turn = xmalloc(nthreads*sizeof(CondVar));
+	for(int i=0; i<nthreads; i++) R.turn[i] = COND_INIT;
+
+	struct timeval t0;
+	mark_time(&t0);
+
+	Tid_t tid[nthreads];
+	for(int i=0; i<nthreads; i++)
+		tid[i] = CreateThread(token_ring_thread, i, &R);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tid[i], NULL);
+
+	double T = time_since(&t0);
+	free(R.turn);
+	return passes / T;
+}
+
+
+void sched_select_hold(unsigned long* count, unsigned long long* cycles);
+
+BOOT_TEST(bench_yield_token_ring,
+	"Measure the rate of scheduler-heavy token passing in rings\n"
+	"of threads of different sizes, and how long the ready-queue lock\n"
+	"is held to select the next thread (if the kernel is built with\n"
+	"SCHED_STATISTICS). With O(1) selection the hold time should not grow\n"
+	"with the number of threads.",
+	.timeout = 120
+	)
+{
+	for(int n=2; n<=512; n*=4) {
+		unsigned long c0, c1;
+		unsigned long long h0, h1;
+		sched_select_hold(&c0, &h0);
+		double rate = token_ring_rate(n, 100000);
+		sched_select_hold(&c1, &h1);
+		if(c1 > c0)
+			MSG("threads=%4d  passes/sec=%10.0f  cycles/select=%6.1f\n", n, rate,
+				(double)(h1-h0) / (c1-c0));
+		else
+			MSG("threads=%4d  passes/sec=%10.0f\n", n, rate);
+	}
+	return 0;
+}
+
+
+/*
+	A mixed load: pairs of threads that ping-pong on condition variables
+	keep the top priority level busy, while CPU-bound threads sink to the
+	lowest levels. Without priority boosts the CPU-bound threads would
+	never run again. Each CPU-bound thread records the longest gap between
+	two consecutive iterations of its loop.
+ */
+struct starvation_load {
+	Mutex mx;
+	CondVar turn[2];
+	int token;
+	int stop;
+	int ncpu;
+	double duration;
+	double maxgap[];
+};
+
+static int ping_pong_thread(int i, void* args)
+{
+	struct starvation_load* L = args;
+	Mutex_Lock(&L->mx);
+	while(! L->stop) {
+		if(L->token == i) {
+			L->token = 1-i;
+			Cond_Signal(&L->turn[1-i]);
+		} else
+			Cond_Wait(&L->mx, &L->turn[i]);
+	}
+	Cond_Signal(&L->turn[1-i]);
+	Mutex_Unlock(&L->mx);
+	return 0;
+}
+
+static int cpu_bound_thread(int i, void* args)
+{
+	struct starvation_load* L = args;
+	struct timeval t0, tlast;
+	double maxgap = 0.0;
+
+	mark_time(&t0);
+	tlast = t0;
+	while(time_since(&t0) < L->duration) {
+		double gap = time_since(&tlast);
+		if(gap > maxgap) maxgap = gap;
+		mark_time(&tlast);
+	}
+	L->maxgap[i] = maxgap;
+	return 0;
+}
+
+static int starvation_load_task(int argl, void* args)
+{
+	struct starvation_load* L = *(struct starvation_load**) args;
+	int ncpu = L->ncpu;
+
+	Tid_t pp[2], cpu[ncpu];
+	for(int i=0; i<2; i++)
+		pp[i] = CreateThread(ping_pong_thread, i, L);
+	for(int i=0; i<ncpu; i++)
+		cpu[i] = CreateThread(cpu_bound_thread, i, L);
+
+	for(int i=0; i<ncpu; i++)
+		ThreadJoin(cpu[i], NULL);
+
+	Mutex_Lock(&L->mx);
+	L->stop = 1;
+	Cond_Broadcast(&L->turn[0]);
+	Cond_Broadcast(&L->turn[1]);
+	Mutex_Unlock(&L->mx);
+
+	for(int i=0; i<2; i++)
+		ThreadJoin(pp[i], NULL);
+	return 0;
+}
+
+
+BARE_TEST(bench_priority_boost,
+	"Measure the worst-case delay of CPU-bound threads, which are starved\n"
+	"by I/O-bound threads, for different periods of the MLFQ priority boost.",
+	.timeout = 120
+	)
+{
+	const int ncpu = 4;
+	unsigned int saved_period = sched_boost_period;
+	unsigned int periods[] = { 200, 2000, 20000 };
+
+	for(int p=0; p<3; p++) {
+		struct starvation_load* L = xmalloc(sizeof(*L) + ncpu*sizeof(double));
+		L->mx = MUTEX_INIT;
+		L->turn[0] = L->turn[1] = COND_INIT;
+		L->token = 0;
+		L->stop = 0;
+		L->ncpu = ncpu;
+		L->duration = 0.5;
+
+		sched_boost_period = periods[p];
+		boot(1, 0, starvation_load_task, sizeof(L), &L);
+
+		double worst = 0.0;
+		for(int i=0; i<ncpu; i++)
+			if(L->maxgap[i] > worst) worst = L->maxgap[i];
+		MSG("boost period=%6u yields  worst CPU-bound delay=%8.3f msec\n",
+			periods[p], 1000.0*worst);
+		sched_print_stats(stderr);
+		free(L);
+	}
+
+	sched_boost_period = saved_period;
+}
+
+
+static int null_thread(int argl, void* args)
+{
+	return argl;
+}
+
+BOOT_TEST(bench_create_join,
+	"Measure the rate of creating and joining threads, when batches\n"
+	"of threads of different sizes are alive together.",
+	.timeout = 120
+	)
+{
+	const int total = 50000;
+	for(int batch=1; batch<=256; batch*=16) {
+		Tid_t tid[batch];
+		struct timeval t0;
+		mark_time(&t0);
+		for(int n=0; n<total; n+=batch) {
+			for(int i=0; i<batch; i++)
+				tid[i] = CreateThread(null_thread, i, NULL);
+			for(int i=0; i<batch; i++)
+				ASSERT(ThreadJoin(tid[i], NULL)==0);
+		}
+		double T = time_since(&t0);
+		MSG("batch=%4d  threads/sec=%10.0f\n", batch, total/T);
+	}
+	return 0;
+}
+
+
+/*
+	Pairs of threads ping-pong on condition variables. Every pass is
+	one context switch.
+ */
+struct ping_pong {
+	Mutex mx;
+	CondVar turn[2];
+	int token;
+	int passes;
+};
+
+static int ping_pong_pass_thread(int i, void* args)
+{
+	struct ping_pong* P = args;
+	Mutex_Lock(&P->mx);
+	while(P->passes > 0) {
+		if(P->token == i) {
+			P->passes--;
+			P->token = 1-i;
+			Cond_Signal(&P->turn[1-i]);
+		} else
+			Cond_Wait(&P->mx, &P->turn[i]);
+	}
+	Cond_Signal(&P->turn[1-i]);
+	Mutex_Unlock(&P->mx);
+	return 0;
+}
+
+static int context_switch_task(int npairs, void* args)
+{
+	const int passes = 200000;
+	struct ping_pong P[npairs];
+	Tid_t tid[npairs][2];
+
+	for(int p=0; p<npairs; p++) {
+		P[p] = (struct ping_pong) { MUTEX_INIT, { COND_INIT, COND_INIT }, 0, passes };
+		for(int i=0; i<2; i++)
+			tid[p][i] = CreateThread(ping_pong_pass_thread, i, &P[p]);
+	}
+	for(int p=0; p<npairs; p++)
+		for(int i=0; i<2; i++)
+			ThreadJoin(tid[p][i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_context_switch,
+	"Measure the rate of context switches per core, with one pair of\n"
+	"ping-pong threads per core, on 1 to 8 cores.",
+	.timeout = 120
+	)
+{
+	const int passes = 200000;
+	for(uint ncores = 1; ncores <= 8; ncores *= 2) {
+		struct timeval t0;
+		mark_time(&t0);
+		boot(ncores, 0, context_switch_task, ncores, NULL);
+		double T = time_since(&t0);
+		MSG("cores=%u  switches/sec/core=%10.0f\n", ncores, passes/T);
+	}
+}
+
+
+/* Return the user and system cpu time of the process, in seconds */
+static void cpu_times(double* utime, double* stime)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	*utime = ru.ru_utime.tv_sec + 1E-6*ru.ru_utime.tv_usec;
+	*stime = ru.ru_stime.tv_sec + 1E-6*ru.ru_stime.tv_usec;
+}
+
+BOOT_TEST(bench_syscall,
+	"Measure the cost of cheap system calls. The system time spent per call\n"
+	"shows the host system calls made inside each kernel call.",
+	.timeout = 120
+	)
+{
+	const int N = 1000000;
+	struct timeval t0;
+	double u0, s0, u1, s1;
+	char buf[16];
+
+	Fid_t fnull = OpenNull();
+	ASSERT(fnull != NOFILE);
+
+	for(int k=0; k<2; k++) {
+		mark_time(&t0);
+		cpu_times(&u0, &s0);
+		for(int i=0; i<N; i++) {
+			if(k==0) 
+				GetPid();
+			else
+				Write(fnull, buf, sizeof(buf));
+		}
+		double T = time_since(&t0);
+		cpu_times(&u1, &s1);
+		MSG("%-8s  nsec/call=%7.1f   user nsec/call=%7.1f   system nsec/call=%7.1f\n",
+			k==0 ? "GetPid" : "Write", 1E9*T/N, 1E9*(u1-u0)/N, 1E9*(s1-s0)/N);
+	}
+
+	Close(fnull);
+	return 0;
+}
+
+
+/*
+	Independent processes, one per core, each making cheap system calls
+	on its own streams.
+ */
+static int syscall_loop_task(int N, void* args)
+{
+	char buf[16];
+	Fid_t fnull = OpenNull();
+	for(int i=0; i<N; i++) {
+		Write(fnull, buf, sizeof(buf));
+		GetPid();
+	}
+	Close(fnull);
+	return 0;
+}
+
+static int syscall_throughput_task(int nproc, void* args)
+{
+	for(int p=0; p<nproc; p++)
+		Exec(syscall_loop_task, 500000, NULL);
+	while(WaitChild(NOPROC, NULL)!=NOPROC);
+	return 0;
+}
+
+BARE_TEST(bench_syscall_scaling,
+	"Measure the throughput of system calls made by independent processes,\n"
+	"one per core, on 1 to 8 cores.",
+	.timeout = 120
+	)
+{
+	const int N = 500000;
+	for(uint ncores = 1; ncores <= 8; ncores *= 2) {
+		struct timeval t0;
+		mark_time(&t0);
+		boot(ncores, 0, syscall_throughput_task, ncores, NULL);
+		double T = time_since(&t0);
+		double rate = 2.0*N*ncores/T;
+		MSG("cores=%u  syscalls/sec=%11.0f   per core=%11.0f\n", ncores, rate, rate/ncores);
+	}
+}
+
+
+BOOT_TEST(bench_pipe_throughput,
+	"Measure the throughput of a pipe between two threads, for different\n"
+	"sizes of Write().",
+	.timeout = 300
+	)
+{
+	const size_t total = 1ul << 30;
+	static char buffer[65536];
+
+	for(unsigned int wsize = 16; wsize <= 65536; wsize *= 4) {
+		/* Keep the number of calls bounded for small writes */
+		size_t nbytes = total;
+		if(nbytes / wsize > (1ul<<24)) nbytes = wsize * (1ul<<24);
+
+		pipe_t pipe;
+		ASSERT(Pipe(&pipe)==0);
+		size_t count = 0;
+		Tid_t t = CreateThread(pipe_drain_thread, pipe.read, &count);
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(size_t sent = 0; sent < nbytes; ) {
+			size_t n = (nbytes - sent < wsize) ? nbytes - sent : wsize;
+			int rc = Write(pipe.write, buffer, n);
+			ASSERT(rc > 0);
+			sent += rc;
+		}
+		Close(pipe.write);
+		ThreadJoin(t, NULL);
+		double T = time_since(&t0);
+		Close(pipe.read);
+
+		ASSERT(count == nbytes);
+		MSG("write size=%6u  %6zu MB in %6.3f sec  %8.1f MB/sec\n", 
+			wsize, nbytes >> 20, T, (nbytes >> 20)/T);
+	}
+	return 0;
+}
+
+
+/*
+	Producer/consumer pairs of threads, one pipe per pair.
+ */
+struct pipe_pair {
+	pipe_t pipe;
+	unsigned int wsize;
+	size_t nbytes;
+	size_t count;
+};
+
+static int pipe_pair_producer(int argl, void* args)
+{
+	struct pipe_pair* P = args;
+	static char buffer[4096];
+	for(size_t sent = 0; sent < P->nbytes; ) {
+		size_t n = (P->nbytes - sent < P->wsize) ? P->nbytes - sent : P->wsize;
+		int rc = Write(P->pipe.write, buffer, n);
+		assert(rc > 0);
+		sent += rc;
+	}
+	Close(P->pipe.write);
+	return 0;
+}
+
+static int pipe_pair_consumer(int argl, void* args)
+{
+	struct pipe_pair* P = args;
+	char buffer[4096];
+	int rc;
+	while((rc = Read(P->pipe.read, buffer, P->wsize)) > 0)
+		P->count += rc;
+	Close(P->pipe.read);
+	return 0;
+}
+
+/* The array of pairs ends with a pair with nbytes==0 */
+static int pipe_pairs_task(int argl, void* args)
+{
+	struct pipe_pair* P = *(struct pipe_pair**) args;
+	int npairs = 0;
+	while(P[npairs].nbytes > 0) npairs++;
+	Tid_t tid[npairs][2];
+	for(int i=0; i<npairs; i++) {
+		ASSERT(Pipe(&P[i].pipe)==0);
+		tid[i][0] = CreateThread(pipe_pair_producer, 0, &P[i]);
+		tid[i][1] = CreateThread(pipe_pair_consumer, 0, &P[i]);
+	}
+	for(int i=0; i<npairs; i++) {
+		ThreadJoin(tid[i][0], NULL);
+		ThreadJoin(tid[i][1], NULL);
+	}
+	return 0;
+}
+
+BARE_TEST(bench_pipe_spsc,
+	"Compare the throughput of pipes in SPSC mode against the locked mode,\n"
+	"with producer/consumer pairs on separate cores.",
+	.timeout = 300
+	)
+{
+	int saved = pipe_spsc_enabled;
+	unsigned int wsizes[] = { 64, 4096 };
+
+	for(int w=0; w<2; w++)
+	for(int npairs = 1; npairs <= 2; npairs++)
+	for(int spsc = 0; spsc <= 1; spsc++) {
+		struct pipe_pair* P = xmalloc((npairs+1)*sizeof(struct pipe_pair));
+		for(int i=0; i<npairs; i++) {
+			P[i].wsize = wsizes[w];
+			P[i].nbytes = (size_t) wsizes[w] << 18;
+			P[i].count = 0;
+		}
+		P[npairs].nbytes = 0;
+
+		pipe_spsc_enabled = spsc;
+		struct timeval t0;
+		mark_time(&t0);
+		boot(2*npairs, 0, pipe_pairs_task, sizeof(P), &P);
+		double T = time_since(&t0);
+
+		size_t total = 0;
+		for(int i=0; i<npairs; i++) {
+			ASSERT(P[i].count == P[i].nbytes);
+			total += P[i].count;
+		}
+		MSG("write size=%5u  pairs=%d  cores=%d  %-6s  %8.1f MB/sec\n", wsizes[w], npairs,
+			2*npairs, spsc ? "spsc" : "locked", (total/1048576.0)/T);
+		free(P);
+	}
+
+	pipe_spsc_enabled = saved;
+}
+
+
+/*
+	A relay thread forwards one pipe to another, either by Read/Write 
+	through a user buffer (argl==0) or by Splice (argl==1).
+ */
+struct relay {
+	pipe_t in, out;
+	int splice;
+};
+
+static int relay_thread(int argl, void* args)
+{
+	struct relay* R = args;
+	char buffer[4096];
+	int rc;
+	if(R->splice) {
+		while((rc = Splice(R->in.read, R->out.write, 65536)) > 0);
+	} else {
+		while((rc = Read(R->in.read, buffer, sizeof(buffer))) > 0) 
+			for(int done = 0; done < rc; )
+				done += Write(R->out.write, buffer+done, rc-done);
+	}
+	Close(R->out.write);
+	return 0;
+}
+
+BOOT_TEST(bench_splice_relay,
+	"Measure the throughput of a relay thread forwarding a pipe to another\n"
+	"pipe, by Read/Write and by Splice.",
+	.timeout = 300
+	)
+{
+	const size_t nbytes = 1ul << 30;
+	static char buffer[4096];
+
+	for(int splice = 0; splice <= 1; splice++) {
+		struct relay R;
+		ASSERT(Pipe(&R.in)==0);
+		ASSERT(Pipe(&R.out)==0);
+		R.splice = splice;
+
+		size_t count = 0;
+		Tid_t tr = CreateThread(relay_thread, 0, &R);
+		Tid_t tc = CreateThread(pipe_drain_thread, R.out.read, &count);
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(size_t sent = 0; sent < nbytes; ) {
+			int rc = Write(R.in.write, buffer, sizeof(buffer));
+			ASSERT(rc > 0);
+			sent += rc;
+		}
+		Close(R.in.write);
+		ThreadJoin(tr, NULL);
+		ThreadJoin(tc, NULL);
+		double T = time_since(&t0);
+		Close(R.in.read);
+		Close(R.out.read);
+
+		ASSERT(count == nbytes);
+		MSG("%-10s  %6zu MB in %6.3f sec  %8.1f MB/sec\n", splice ? "Splice" : "Read/Write",
+			nbytes >> 20, T, (nbytes >> 20)/T);
+	}
+	return 0;
+}
+
+
+/*
+	The server of the connection rate benchmark accepts and closes
+	connections, until Accept fails.
+ */
+static int accept_close_thread(int argl, void* args)
+{
+	Fid_t lsock = argl;
+	Fid_t s;
+	while((s = Accept(lsock)) != NOFILE)
+		Close(s);
+	return 0;
+}
+
+BOOT_TEST(bench_socket_connect_rate,
+	"Measure the rate of connections (Connect, Accept and Close on both sides)\n"
+	"to a listener, for several listener backlogs.",
+	.timeout = 300
+	)
+{
+	const int N = 100000;
+	const unsigned int backlogs[] = { 1, 4, 16, 64 };
+	unsigned int saved_backlog = socket_backlog;
+
+	for(unsigned int b = 0; b < sizeof(backlogs)/sizeof(backlogs[0]); b++) {
+		socket_backlog = backlogs[b];
+		Fid_t lsock = Socket(100);
+		ASSERT(lsock != NOFILE);
+		ASSERT(Listen(lsock)==0);
+		Tid_t t = CreateThread(accept_close_thread, lsock, NULL);
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i = 0; i < N; i++) {
+			Fid_t cli = Socket(NOPORT);
+			ASSERT(cli != NOFILE);
+			ASSERT(Connect(cli, 100, -1)==0);
+			Close(cli);
+		}
+		double T = time_since(&t0);
+
+		Close(lsock);
+		ThreadJoin(t, NULL);
+		MSG("backlog=%-3u  %d connections in %6.3f sec  %10.0f conn/sec\n",
+			backlogs[b], N, T, N/T);
+	}
+
+	socket_backlog = saved_backlog;
+	return 0;
+}
+
+/*
+	Accept throughput with 1..4 listeners sharing a port by ReusePort, each
+	served by its own thread, with 8 connecting processes (since a process
+	has only MAX_FILEID fids).
+ */
+static int connect_close_process(int argl, void* args)
+{
+	for(int i = 0; i < argl; i++) {
+		Fid_t cli = Socket(NOPORT);
+		ASSERT(cli != NOFILE);
+		ASSERT(Connect(cli, 100, -1)==0);
+		Close(cli);
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_socket_accept_scaling,
+	"Measure the rate of connections to a port with 1, 2 and 4 listeners\n"
+	"(marked by ReusePort), each with its own accepting thread.",
+	.timeout = 300
+	)
+{
+	const int N = 160000;
+	const int nconn = 8;
+
+	for(int nl = 1; nl <= 4; nl *= 2) {
+		Fid_t lsock[nl];
+		Tid_t acc[nl];
+
+		for(int i = 0; i < nl; i++) {
+			lsock[i] = Socket(100);
+			ASSERT(lsock[i] != NOFILE);
+			ASSERT(ReusePort(lsock[i])==0);
+			ASSERT(Listen(lsock[i])==0);
+			acc[i] = CreateThread(accept_close_thread, lsock[i], NULL);
+		}
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i = 0; i < nconn; i++)
+			ASSERT(Exec(connect_close_process, N/nconn, NULL) != NOPROC);
+		for(int i = 0; i < nconn; i++)
+			WaitChild(NOPROC, NULL);
+		double T = time_since(&t0);
+
+		for(int i = 0; i < nl; i++) {
+			Close(lsock[i]);
+			ThreadJoin(acc[i], NULL);
+		}
+		MSG("listeners=%d  %d connections in %6.3f sec  %10.0f conn/sec\n",
+			nl, N, T, N/T);
+	}
+	return 0;
+}
+
+
+/*
+	Request/response round trips over a connected socket pair. On stream
+	sockets, each message is framed by its length (as in the remote shell),
+	and received by a loop of Read calls. On datagram sockets, each message
+	is a single Write and a single Read.
+ */
+#define RT_MSG_SIZE 64
+
+static int rt_send(Fid_t sock, socket_kind kind, const char* msg, int len)
+{
+	if(kind == SOCKET_DATAGRAM)
+		return Write(sock, msg, len) == len;
+	iovec_t iov[2] = {
+		{ .base = &len, .len = sizeof(len) },
+		{ .base = (char*) msg, .len = len }
+	};
+	return WriteV(sock, iov, 2) == sizeof(len) + len;
+}
+
+static int rt_recv_all(Fid_t sock, char* buf, int len)
+{
+	int count = 0;
+	while(count < len) {
+		int rc = Read(sock, buf+count, len-count);
+		if(rc < 1) return 0;
+		count += rc;
+	}
+	return 1;
+}
+
+static int rt_recv(Fid_t sock, socket_kind kind, char* buf)
+{
+	if(kind == SOCKET_DATAGRAM)
+		return Read(sock, buf, RT_MSG_SIZE);
+	int len;
+	if(! rt_recv_all(sock, (char*)&len, sizeof(len))) return 0;
+	if(! rt_recv_all(sock, buf, len)) return 0;
+	return len;
+}
+
+struct round_trip {
+	Fid_t sock;
+	socket_kind kind;
+};
+
+static int rt_echo_thread(int argl, void* args)
+{
+	struct round_trip* R = args;
+	char buf[RT_MSG_SIZE];
+	int len;
+	while((len = rt_recv(R->sock, R->kind, buf)) > 0)
+		if(! rt_send(R->sock, R->kind, buf, len)) break;
+	return 0;
+}
+
+BOOT_TEST(bench_socket_round_trip,
+	"Measure the rate of request/response round trips of 64-byte messages,\n"
+	"over stream sockets with length framing and over datagram sockets.",
+	.timeout = 300
+	)
+{
+	const int N = 200000;
+
+	for(socket_kind kind = SOCKET_STREAM; kind <= SOCKET_DATAGRAM; kind++) {
+		Fid_t lsock = SocketWithKind(100, kind);
+		ASSERT(lsock!=NOFILE);
+		ASSERT(Listen(lsock)==0);
+		Fid_t cli = SocketWithKind(NOPORT, kind);
+		ASSERT(cli!=NOFILE);
+		struct round_trip R;
+		R.kind = kind;
+		connect_sockets(cli, lsock, &R.sock, 100);
+		Tid_t t = CreateThread(rt_echo_thread, 0, &R);
+
+		char msg[RT_MSG_SIZE], reply[RT_MSG_SIZE];
+		memset(msg, 'x', sizeof(msg));
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i = 0; i < N; i++) {
+			ASSERT(rt_send(cli, kind, msg, sizeof(msg)));
+			ASSERT(rt_recv(cli, kind, reply) == sizeof(msg));
+		}
+		double T = time_since(&t0);
+
+		ShutDown(cli, SHUTDOWN_WRITE);
+		ThreadJoin(t, NULL);
+		Close(cli);
+		Close(R.sock);
+		Close(lsock);
+		MSG("%-9s  %d round trips in %6.3f sec  %10.0f round trips/sec\n",
+			kind == SOCKET_DATAGRAM ? "datagram" : "stream", N, T, N/T);
+	}
+	return 0;
+}
+
+
+/*
+	A server for many connections: either a single thread running an event
+	loop over Poll, or a thread per connection. The clients are processes
+	sending 64-byte requests over datagram sockets and waiting for the echo.
+ */
+#define EL_CLIENTS 12
+
+static int el_client_process(int argl, void* args)
+{
+	Fid_t sock = SocketWithKind(NOPORT, SOCKET_DATAGRAM);
+	ASSERT(sock!=NOFILE);
+	ASSERT(Connect(sock, 100, -1)==0);
+	char msg[RT_MSG_SIZE], reply[RT_MSG_SIZE];
+	memset(msg, 'x', sizeof(msg));
+	for(int i = 0; i < argl; i++) {
+		ASSERT(Write(sock, msg, sizeof(msg))==sizeof(msg));
+		ASSERT(Read(sock, reply, sizeof(reply))==sizeof(reply));
+	}
+	Close(sock);
+	return 0;
+}
+
+static void el_event_loop(Fid_t lsock)
+{
+	pollfd fds[EL_CLIENTS+1];
+	unsigned int n = 1;
+	int accepted = 0;
+	fds[0].fd = lsock;
+	fds[0].events = POLL_READ;
+
+	while(accepted < EL_CLIENTS || n > 1) {
+		ASSERT(Poll(fds, n, -1) > 0);
+		for(unsigned int i = n-1; i > 0; i--) {
+			if(fds[i].revents & POLL_READ) {
+				char buf[RT_MSG_SIZE];
+				int len = Read(fds[i].fd, buf, sizeof(buf));
+				if(len > 0) {
+					ASSERT(Write(fds[i].fd, buf, len)==len);
+					continue;
+				}
+			}
+			if(fds[i].revents & (POLL_HANGUP|POLL_ERROR)) {
+				Close(fds[i].fd);
+				fds[i] = fds[--n];
+			}
+		}
+		if(fds[0].revents & POLL_READ) {
+			Fid_t sock = Accept(lsock);
+			ASSERT(sock!=NOFILE);
+			fds[n].fd = sock;
+			fds[n].events = POLL_READ;
+			n++;
+			if(++accepted == EL_CLIENTS) fds[0].fd = -1;
+		}
+	}
+}
+
+static int el_echo_thread(int sock, void* args)
+{
+	char buf[RT_MSG_SIZE];
+	int len;
+	while((len = Read(sock, buf, sizeof(buf))) > 0)
+		ASSERT(Write(sock, buf, len)==len);
+	Close(sock);
+	return 0;
+}
+
+BOOT_TEST(bench_poll_event_loop,
+	"Measure the round trips per second of 12 clients served by a single-threaded\n"
+	"event loop over Poll, and by a thread per connection.",
+	.timeout = 300
+	)
+{
+	const int R = 20000;
+
+	for(int threaded = 0; threaded <= 1; threaded++) {
+		Fid_t lsock = SocketWithKind(100, SOCKET_DATAGRAM);
+		ASSERT(lsock!=NOFILE);
+		ASSERT(Listen(lsock)==0);
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i = 0; i < EL_CLIENTS; i++)
+			ASSERT(Exec(el_client_process, R, NULL)!=NOPROC);
+
+		if(threaded) {
+			Tid_t t[EL_CLIENTS];
+			for(int i = 0; i < EL_CLIENTS; i++) {
+				Fid_t sock = Accept(lsock);
+				ASSERT(sock!=NOFILE);
+				t[i] = CreateThread(el_echo_thread, sock, NULL);
+			}
+			for(int i = 0; i < EL_CLIENTS; i++)
+				ThreadJoin(t[i], NULL);
+		} else {
+			el_event_loop(lsock);
+		}
+		for(int i = 0; i < EL_CLIENTS; i++)
+			WaitChild(NOPROC, NULL);
+		double T = time_since(&t0);
+		Close(lsock);
+
+		MSG("%-22s  %d round trips in %6.3f sec  %10.0f round trips/sec\n",
+			threaded ? "thread per connection" : "Poll event loop",
+			EL_CLIENTS*R, T, EL_CLIENTS*R/T);
+	}
+	return 0;
+}
+
+
+
+/* The arguments of the processes which hold the idle pipes */
+struct idle_pipes_args {
+	int n;			/* the number of pipes */
+	Fid_t eq;		/* the event queue */
+	Fid_t hold;		/* read end of a pipe, closed by the parent at the end */
+	Fid_t ready;	/* write end of a pipe, written after adding the pipes */
+};
+
+/*
+	Add n idle pipes to the event queue and keep them open, until the
+	parent closes the hold pipe. A stream is removed from an event queue
+	when its last fid is closed, and a process has few fids, so the idle
+	pipes are spread over several processes.
+ */
+static int hold_idle_pipes(int argl, void* args)
+{
+	struct idle_pipes_args* F = args;
+	for(Fid_t fid = 0; fid < MAX_FILEID; fid++)
+		if(fid != F->eq && fid != F->hold && fid != F->ready)
+			Close(fid);
+
+	for(int i = 0; i < F->n; i++) {
+		pipe_t p;
+		ASSERT(Pipe(&p)==0);
+		ASSERT(EventCtl(F->eq, EVQ_ADD, p.read, POLL_READ, i)==0);
+		ASSERT(EventCtl(F->eq, EVQ_ADD, p.write, 0, i)==0);
+	}
+
+	char c = 'x';
+	ASSERT(Write(F->ready, &c, 1)==1);
+	ASSERT(Read(F->hold, &c, 1)==0);
+	return 0;
+}
+
+
+BOOT_TEST(bench_event_queue_scaling,
+	"Measure the cost of EventWait on one active pipe, as the number of idle\n"
+	"pipes registered at the event queue grows. It should not depend on it."
+	)
+{
+	const int R = 100000;
+	const int sizes[] = { 16, 64, 256, 1024 };
+
+	for(int k = 0; k < sizeof(sizes)/sizeof(int); k++) {
+		int N = sizes[k];
+		Fid_t eq = EventQueue();
+		ASSERT(eq!=NOFILE);
+
+		/* The idle pipes are held by child processes */
+		pipe_t hold, ready;
+		ASSERT(Pipe(&hold)==0);
+		ASSERT(Pipe(&ready)==0);
+		struct idle_pipes_args F = { 0, eq, hold.read, ready.write };
+		const int per_child = (MAX_FILEID - 3) / 2;
+		int nchildren = 0;
+		for(int i = 0; i < N; i += per_child) {
+			F.n = (N - i < per_child) ? N - i : per_child;
+			ASSERT(Exec(hold_idle_pipes, sizeof(F), &F)!=NOPROC);
+			nchildren++;
+		}
+		Close(hold.read);
+		Close(ready.write);
+		for(int i = 0; i < nchildren; i++) {
+			char c;
+			ASSERT(Read(ready.read, &c, 1)==1);
+		}
+
+		pipe_t a;
+		ASSERT(Pipe(&a)==0);
+		ASSERT(EventCtl(eq, EVQ_ADD, a.read, POLL_READ, -1)==0);
+
+		event_record ev[16];
+		char c = 'x';
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i = 0; i < R; i++) {
+			ASSERT(Write(a.write, &c, 1)==1);
+			ASSERT(EventWait(eq, ev, 16, -1)==1);
+			ASSERT(ev[0].data==-1);
+			ASSERT(Read(a.read, &c, 1)==1);
+		}
+		double T = time_since(&t0);
+
+		Close(a.read);
+		Close(a.write);
+		Close(hold.write);
+		for(int i = 0; i < nchildren; i++)
+			WaitChild(NOPROC, NULL);
+		Close(ready.read);
+		ASSERT(Close(eq)==0);
+
+		MSG("%5d registered pipes  %d waits in %6.3f sec  %8.1f nsec/wait\n",
+			N, R, T, 1e9*T/R);
+	}
+	return 0;
+}
+
+
+/*
+	Write a whole buffer, or all the buffers of a vector, continuing
+	after short writes. Return the number of calls made.
+ */
+static unsigned int write_all(Fid_t fd, const char* buf, unsigned int len)
+{
+	unsigned int calls = 0;
+	while(len > 0) {
+		int rc = Write(fd, buf, len);
+		assert(rc > 0);
+		calls++;
+		buf += rc;
+		len -= rc;
+	}
+	return calls;
+}
+
+static unsigned int writev_all(Fid_t fd, iovec_t* iov, unsigned int n)
+{
+	unsigned int calls = 0;
+	while(n > 0) {
+		int rc = WriteV(fd, iov, n);
+		assert(rc > 0);
+		calls++;
+		while(n > 0 && (unsigned int) rc >= iov->len) {
+			rc -= iov->len;
+			iov++; n--;
+		}
+		if(n > 0) {
+			iov->base = (char*) iov->base + rc;
+			iov->len -= rc;
+		}
+	}
+	return calls;
+}
+
+#define REC_BATCH 16
+
+BOOT_TEST(bench_vectored_small_records,
+	"Measure the rate of small records (a 4-byte header and a 28-byte payload)\n"
+	"sent over a pipe by two Writes, by one WriteV per record, and by one\n"
+	"WriteV per 16 records.",
+	.timeout = 300
+	)
+{
+	const unsigned int R = 1u << 21;
+	const char* modes[] = { "2 x Write", "WriteV per record", "WriteV per 16 records" };
+
+	for(int mode = 0; mode < 3; mode++) {
+		pipe_t pipe;
+		ASSERT(Pipe(&pipe)==0);
+		size_t count = 0;
+		Tid_t t = CreateThread(pipe_drain_thread, pipe.read, &count);
+
+		uint32_t hdr = 28;
+		char payload[28] = { 0 };
+		unsigned int calls = 0;
+
+		struct timeval t0;
+		mark_time(&t0);
+		for(unsigned int i = 0; i < R; ) {
+			unsigned int nrec = (mode == 2) ? REC_BATCH : 1;
+			if(mode == 0) {
+				calls += write_all(pipe.write, (char*) &hdr, sizeof(hdr));
+				calls += write_all(pipe.write, payload, sizeof(payload));
+			} else {
+				iovec_t v[2*REC_BATCH];
+				for(unsigned int j = 0; j < nrec; j++) {
+					v[2*j].base = &hdr; v[2*j].len = sizeof(hdr);
+					v[2*j+1].base = payload; v[2*j+1].len = sizeof(payload);
+				}
+				calls += writev_all(pipe.write, v, 2*nrec);
+			}
+			i += nrec;
+		}
+		Close(pipe.write);
+		ThreadJoin(t, NULL);
+		double T = time_since(&t0);
+		Close(pipe.read);
+
+		ASSERT(count == (size_t) R * 32);
+		MSG("%-22s  %4.2f calls/record  %10.0f records/sec  %7.1f MB/sec\n",
+			modes[mode], (double) calls / R, R/T, (count >> 20)/T);
+	}
+	return 0;
+}
+
+
+#define IOR_PIPES 7
+
+BOOT_TEST(bench_io_ring_batching,
+	"Measure the rate of 32-byte writes and reads on 7 pipes, done by Read and\n"
+	"Write calls, and by an I/O ring with one IoRingEnter per round of 14\n"
+	"requests (with the writes first, and with the reads first).",
+	.timeout = 300
+	)
+{
+	const int R = 100000;
+	const char* modes[] = { "Read/Write calls", "ring, writes first", "ring, reads first" };
+	static char out[32], in[IOR_PIPES][32];
+
+	for(int mode = 0; mode < 3; mode++) {
+		pipe_t p[IOR_PIPES];
+		for(int j = 0; j < IOR_PIPES; j++)
+			ASSERT(Pipe(&p[j])==0);
+		io_ring* r;
+		Fid_t ring = IoRingSetup(2*IOR_PIPES, &r);
+		ASSERT(ring!=NOFILE);
+
+		unsigned long calls = 0;
+		io_cqe cqe = {0};
+		struct timeval t0;
+		mark_time(&t0);
+		for(int i = 0; i < R; i++) {
+			if(mode == 0) {
+				for(int j = 0; j < IOR_PIPES; j++)
+					ASSERT(Write(p[j].write, out, 32)==32);
+				for(int j = 0; j < IOR_PIPES; j++)
+					ASSERT(Read(p[j].read, in[j], 32)==32);
+				calls += 2*IOR_PIPES;
+				continue;
+			}
+			for(int k = 0; k < 2; k++)
+				for(int j = 0; j < IOR_PIPES; j++) {
+					if((k == 0) == (mode == 1))
+						ring_submit(r, IO_WRITE, p[j].write, out, 32, j);
+					else
+						ring_submit(r, IO_READ, p[j].read, in[j], 32, j);
+				}
+			ASSERT(IoRingEnter(ring, 2*IOR_PIPES, -1)==2*IOR_PIPES);
+			calls++;
+			while(ring_complete(r, &cqe))
+				ASSERT(cqe.result==32);
+		}
+		double T = time_since(&t0);
+
+		Close(ring);
+		for(int j = 0; j < IOR_PIPES; j++) {
+			Close(p[j].read);
+			Close(p[j].write);
+		}
+
+		double ops = 2.0*IOR_PIPES*R;
+		MSG("%-20s  %5.3f syscalls/op  %10.0f ops/sec\n",
+			modes[mode], calls/ops, ops/T);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(bench_terminal_throughput,
+	"Measure the throughput of writing to the console and reading from\n"
+	"the keyboard of terminal 0, in blocks of 16 kbytes.",
+	.minimum_terminals = 1, .timeout = 300
+	)
+{
+	const int MB = 8;
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+	static char buffer[16384];
+	FUDGE(buffer);
+
+	for(int dir = 0; dir < 2; dir++) {
+		for(int i=0; i<1024*MB; i++) {
+			if(dir==0) expect(0, bytes); else sendme(0, bytes);
+		}
+
+		size_t total = (size_t) MB << 20;
+		size_t count = 0;
+		struct timeval t0;
+		mark_time(&t0);
+		while(count < total) {
+			size_t remain = total-count;
+			unsigned int n = (remain < sizeof(buffer)) ? remain : sizeof(buffer);
+			int rc = (dir==0) ? Write(fterm, buffer, n) : Read(fterm, buffer, n);
+			ASSERT(rc>0);
+			count += rc;
+		}
+		double T = time_since(&t0);
+
+		MSG("%-8s  %d MB in %6.3f sec  %12.0f bytes/sec\n",
+			(dir==0) ? "console" : "keyboard", MB, T, total/T);
+	}
+	return 0;
+}
+
+
+/*
+	Console writers, competing with a thread that computes.
+ */
+struct console_writers {
+	Fid_t fterm;
+	size_t nbytes;
+	int done;
+	unsigned long work;
+};
+
+static int console_writer_thread(int argl, void* args)
+{
+	struct console_writers* W = args;
+	static char buffer[1024];
+	FUDGE(buffer);
+	for(size_t sent = 0; sent < W->nbytes; ) {
+		int rc = Write(W->fterm, buffer, sizeof(buffer));
+		assert(rc > 0);
+		sent += rc;
+	}
+	return 0;
+}
+
+static int console_compute_thread(int argl, void* args)
+{
+	struct console_writers* W = args;
+	volatile unsigned long x = 0;
+	while(! __atomic_load_n(& W->done, __ATOMIC_ACQUIRE)) {
+		for(int i = 0; i < 1000; i++) x++;
+		W->work++;
+	}
+	return 0;
+}
+
+#define CW_WRITERS 8
+
+BOOT_TEST(bench_console_writers,
+	"Measure the throughput of 8 threads writing to the console of terminal 0,\n"
+	"which is not read for the first 200 msec, and the progress of a thread\n"
+	"computing at the same time.",
+	.minimum_terminals = 1, .timeout = 300
+	)
+{
+	const size_t MB = 4;
+	struct console_writers W = { .nbytes = (MB << 20) / CW_WRITERS, .done = 0, .work = 0 };
+	W.fterm = OpenTerminal(0);
+	ASSERT(W.fterm!=NOFILE);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* The rate of the computing thread alone */
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t c = CreateThread(console_compute_thread, 0, &W);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 200);
+	Mutex_Unlock(&mx);
+	__atomic_store_n(& W.done, 1, __ATOMIC_RELEASE);
+	ThreadJoin(c, NULL);
+	double alone = W.work / time_since(&t0);
+
+	W.done = 0;
+	W.work = 0;
+	mark_time(&t0);
+	c = CreateThread(console_compute_thread, 0, &W);
+	Tid_t t[CW_WRITERS];
+	for(int i = 0; i < CW_WRITERS; i++)
+		t[i] = CreateThread(console_writer_thread, 0, &W);
+
+	/* The console is not read for the first 200 msec, as if it were slow */
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 200);
+	Mutex_Unlock(&mx);
+	double stalled = __atomic_load_n(& W.work, __ATOMIC_RELAXED) / time_since(&t0);
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+	for(size_t i = 0; i < 1024*MB; i++)
+		expect(0, bytes);
+
+	for(int i = 0; i < CW_WRITERS; i++)
+		ThreadJoin(t[i], NULL);
+	double T = time_since(&t0);
+	__atomic_store_n(& W.done, 1, __ATOMIC_RELEASE);
+	ThreadJoin(c, NULL);
+
+	MSG("%d writers  %zu MB in %6.3f sec  %10.0f bytes/sec\n", CW_WRITERS, MB, T, (MB << 20)/T);
+	MSG("computing thread: %5.1f%% of its rate alone while the console is stalled, %5.1f%% overall\n",
+		100.0 * stalled / alone, 100.0 * (W.work / T) / alone);
+	return 0;
+}
+
+
+BOOT_TEST(bench_terminal_lines,
+	"Measure the reads and the time needed to read a line of 32 chars from\n"
+	"terminal 0, typed one char at a time, in raw and in canonical mode.",
+	.minimum_terminals = 1, .timeout = 300
+	)
+{
+	const int LINES = 500;
+	const char* modes[] = { "raw", "canonical" };
+	Fid_t fterm = OpenTerminal(0);
+	ASSERT(fterm!=NOFILE);
+
+	char keys[32][2];
+	for(int k = 0; k < 32; k++) {
+		keys[k][0] = (k == 31) ? '\n' : 'a' + k % 26;
+		keys[k][1] = '\0';
+	}
+
+	for(int mode = TERMINAL_RAW; mode <= TERMINAL_CANONICAL; mode++) {
+		ASSERT(TerminalMode(fterm, mode)!=-1);
+
+		unsigned long reads = 0;
+		double T = 0.0;
+		for(int l = 0; l < LINES; l++) {
+			struct timeval t0;
+			mark_time(&t0);
+			for(int k = 0; k < 32; k++)
+				sendme(0, keys[k]);
+
+			char line[64];
+			int count = 0;
+			while(count == 0 || line[count-1] != '\n') {
+				int rc = Read(fterm, line + count, sizeof(line) - count);
+				ASSERT(rc > 0);
+				count += rc;
+				reads++;
+			}
+			ASSERT(count == 32);
+			T += time_since(&t0);
+		}
+
+		MSG("%-10s  %5.2f reads/line  %8.1f usec/line\n",
+			modes[mode], (double) reads / LINES, 1E6 * T / LINES);
+	}
+
+	ASSERT(TerminalMode(fterm, TERMINAL_RAW)==TERMINAL_CANONICAL);
+	return 0;
+}
+
+
+/*
+	Traffic on all the terminals at once.
+ */
+struct terminal_traffic {
+	Fid_t fterm;
+	size_t nbytes;
+};
+
+static int terminal_traffic_reader(int argl, void* args)
+{
+	struct terminal_traffic* X = args;
+	char buffer[4096];
+	for(size_t count = 0; count < X->nbytes; ) {
+		int rc = Read(X->fterm, buffer, sizeof(buffer));
+		assert(rc > 0);
+		count += rc;
+	}
+	return 0;
+}
+
+static int terminal_traffic_writer(int argl, void* args)
+{
+	struct terminal_traffic* X = args;
+	char buffer[1024];
+	FUDGE(buffer);
+	for(size_t sent = 0; sent < X->nbytes; ) {
+		int rc = Write(X->fterm, buffer, sizeof(buffer));
+		assert(rc > 0);
+		sent += rc;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_all_terminals,
+	"Measure the throughput of reading from the keyboards and writing to\n"
+	"the consoles of all terminals at the same time, 4 MB in each direction\n"
+	"of each terminal. The interrupts of the terminals are spread over the\n"
+	"cores, so this is best run with as many cores as terminals.",
+	.minimum_terminals = 2, .timeout = 300
+	)
+{
+	const size_t MB = 4;
+	uint nterm = GetTerminalDevices();
+	struct terminal_traffic X[MAX_TERMINALS];
+	Tid_t t[2*MAX_TERMINALS];
+
+	char bytes[1025];
+	FUDGE(bytes);
+	bytes[1024]='\0';
+	for(uint i = 0; i < nterm; i++) {
+		X[i].fterm = OpenTerminal(i);
+		ASSERT(X[i].fterm!=NOFILE);
+		X[i].nbytes = MB << 20;
+		for(size_t k = 0; k < 1024*MB; k++) {
+			sendme(i, bytes);
+			expect(i, bytes);
+		}
+	}
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(uint i = 0; i < nterm; i++) {
+		t[2*i] = CreateThread(terminal_traffic_reader, 0, &X[i]);
+		t[2*i+1] = CreateThread(terminal_traffic_writer, 0, &X[i]);
+	}
+	for(uint i = 0; i < 2*nterm; i++)
+		ThreadJoin(t[i], NULL);
+	double T = time_since(&t0);
+
+	MSG("%u terminals  %zu MB in %6.3f sec  %12.0f bytes/sec\n",
+		nterm, 2*nterm*MB, T, 2*nterm*(MB << 20)/T);
+	return 0;
+}
+
+
+/*
+	Terminal readers under uneven input load.
+ */
+struct terminal_readers {
+	Fid_t fterm[MAX_TERMINALS];
+	size_t nbytes[MAX_TERMINALS];   /* Changed for terminals 1-3 at the end */
+	struct timeval t0;
+	double T0;                      /* The time to read terminal 0 */
+	int finished;                   /* Set when terminal 0 is read */
+	int done;
+	unsigned long work;
+};
+
+static int terminal_reader_thread(int argl, void* args)
+{
+	struct terminal_readers* R = args;
+	char buffer[64];
+	for(size_t count = 0; count < __atomic_load_n(& R->nbytes[argl], __ATOMIC_ACQUIRE); ) {
+		int rc = Read(R->fterm[argl], buffer, sizeof(buffer));
+		assert(rc > 0);
+		count += rc;
+	}
+	if(argl == 0) {
+		R->T0 = time_since(&R->t0);
+		__atomic_store_n(& R->finished, 1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+static int terminal_compute_thread(int argl, void* args)
+{
+	struct terminal_readers* R = args;
+	volatile unsigned long x = 0;
+	while(! __atomic_load_n(& R->done, __ATOMIC_ACQUIRE)) {
+		for(int i = 0; i < 1000; i++) x++;
+		R->work++;
+	}
+	return 0;
+}
+
+BOOT_TEST(bench_uneven_terminal_input,
+	"Measure the time to read 20000 lines of 64 bytes from terminal 0, while\n"
+	"terminals 1-3 receive a line every 10 msec, and the progress of a thread\n"
+	"computing at the same time.",
+	.minimum_terminals = 4, .timeout = 300
+	)
+{
+	const size_t LINES = 20000;
+
+	struct terminal_readers R = { .finished = 0, .done = 0, .work = 0 };
+	for(int i = 0; i < 4; i++) {
+		R.fterm[i] = OpenTerminal(i);
+		ASSERT(R.fterm[i]!=NOFILE);
+		R.nbytes[i] = (i==0) ? 64*LINES : SIZE_MAX;
+	}
+
+	char line[65];
+	FUDGE(line);
+	line[64]='\0';
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	/* The rate of the computing thread alone */
+	mark_time(&R.t0);
+	Tid_t c = CreateThread(terminal_compute_thread, 0, &R);
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 200);
+	Mutex_Unlock(&mx);
+	__atomic_store_n(& R.done, 1, __ATOMIC_RELEASE);
+	ThreadJoin(c, NULL);
+	double alone = R.work / time_since(&R.t0);
+
+	R.done = 0;
+	R.work = 0;
+	Tid_t t[4];
+	for(int i = 0; i < 4; i++)
+		t[i] = CreateThread(terminal_reader_thread, i, &R);
+	c = CreateThread(terminal_compute_thread, 0, &R);
+
+	mark_time(&R.t0);
+	for(size_t l = 0; l < LINES; l++)
+		sendme(0, line);
+
+	/* Terminals 1-3 receive a line every 10 msec, until terminal 0 is read */
+	size_t sent = 0;
+	while(! __atomic_load_n(& R.finished, __ATOMIC_ACQUIRE)) {
+		for(int i = 1; i < 4; i++)
+			sendme(i, line);
+		sent++;
+		Mutex_Lock(&mx);
+		Cond_TimedWait(&mx, &cv, 10);
+		Mutex_Unlock(&mx);
+	}
+
+	/* Send the last line, after telling the readers to stop there */
+	for(int i = 1; i < 4; i++) {
+		__atomic_store_n(& R.nbytes[i], 64*(sent+1), __ATOMIC_RELEASE);
+		sendme(i, line);
+	}
+
+	for(int i = 0; i < 4; i++)
+		ThreadJoin(t[i], NULL);
+	double T = time_since(&R.t0);
+	__atomic_store_n(& R.done, 1, __ATOMIC_RELEASE);
+	ThreadJoin(c, NULL);
+
+	MSG("terminal 0  %zu lines in %6.3f sec  %10.0f bytes/sec\n", LINES, R.T0, 64*LINES/R.T0);
+	MSG("terminals 1-3  %zu lines each\n", sent+1);
+	MSG("computing thread: %5.1f%% of its rate alone\n", 100.0 * (R.work / T) / alone);
+	return 0;
+}
+
+
+/*
+	Many threads with small stacks, all alive at the same time.
+ */
+struct many_threads {
+	Mutex mx;
+	CondVar go;
+	int started;
+	int released;
+};
+
+static int many_threads_thread(int argl, void* args)
+{
+	struct many_threads* M = args;
+	Mutex_Lock(&M->mx);
+	M->started++;
+	while(! M->released)
+		Cond_Wait(&M->mx, &M->go);
+	/* Wake up the threads one by one, to avoid a thundering herd */
+	Cond_Signal(&M->go);
+	Mutex_Unlock(&M->mx);
+	return 0;
+}
+
+BOOT_TEST(bench_many_small_threads,
+	"Measure the time and memory needed to run 100000 threads with 16 kbyte\n"
+	"stacks at the same time.",
+	.timeout = 300
+	)
+{
+	const int N = 100000;
+	struct many_threads M = { MUTEX_INIT, COND_INIT, 0, 0 };
+	Tid_t* tid = xmalloc(N*sizeof(Tid_t));
+	struct timeval t0;
+
+	mark_time(&t0);
+	for(int i=0; i<N; i++) {
+		tid[i] = CreateThreadWithStack(many_threads_thread, 0, &M, 16*1024);
+		ASSERT(tid[i]!=NOTHREAD);
+	}
+
+	Mutex_Lock(&M.mx);
+	while(M.started < N) {
+		Mutex_Unlock(&M.mx);
+		sleep_thread(1);
+		Mutex_Lock(&M.mx);
+	}
+	double Tstart = time_since(&t0);
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+
+	M.released = 1;
+	Cond_Signal(&M.go);
+	Mutex_Unlock(&M.mx);
+
+	for(int i=0; i<N; i++)
+		ASSERT(ThreadJoin(tid[i], NULL)==0);
+	double T = time_since(&t0);
+	free(tid);
+
+	MSG("threads=%d  started in %.3f sec, all joined in %.3f sec, max RSS=%ld MB\n",
+		N, Tstart, T, ru.ru_maxrss/1024);
+	return 0;
+}
+
+
+/*
+	CPU-bound threads keep the cores busy, so that every quantum ends
+	with an ALARM interrupt.
+ */
+static int spin_thread(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	while(time_since(&t0) < 1.0);
+	return 0;
+}
+
+static int alarm_latency_task(int nthreads, void* args)
+{
+	Tid_t tid[nthreads];
+	for(int i=0; i<nthreads; i++)
+		tid[i] = CreateThread(spin_thread, 0, NULL);
+	for(int i=0; i<nthreads; i++)
+		ThreadJoin(tid[i], NULL);
+	return 0;
+}
+
+BARE_TEST(bench_alarm_latency,
+	"Measure the delay from the expiration of a core timer to the delivery\n"
+	"of the ALARM interrupt, with CPU-bound threads on 1 to 4 cores.",
+	.timeout = 120
+	)
+{
+	for(uint ncores = 1; ncores <= 4; ncores *= 2) {
+		boot(ncores, 0, alarm_latency_task, 2*ncores, NULL);
+
+		unsigned long hist[ALARM_LATENCY_BUCKETS];
+		vm_alarm_latency(hist);
+
+		unsigned long total = 0;
+		for(int b=0; b<ALARM_LATENCY_BUCKETS; b++) total += hist[b];
+		MSG("cores=%u  alarms=%lu  latency histogram (usec):\n", ncores, total);
+		for(int b=0; b<ALARM_LATENCY_BUCKETS; b++) 
+			if(hist[b]) 
+				MSG("   < %7lu : %6lu\n", 1ul << b, hist[b]);
+	}
+}
+
+
+TEST_SUITE(benchmark_tests,
+	"A suite of benchmarks, which report performance measurements."
+	)
+{
+	&bench_symposium_scaling,
+	&bench_yield_token_ring,
+	&bench_priority_boost,
+	&bench_create_join,
+	&bench_context_switch,
+	&bench_syscall,
+	&bench_syscall_scaling,
+	&bench_pipe_throughput,
+	&bench_pipe_spsc,
+	&bench_splice_relay,
+	&bench_socket_connect_rate,
+	&bench_socket_accept_scaling,
+	&bench_socket_round_trip,
+	&bench_poll_event_loop,
+	&bench_event_queue_scaling,
+	&bench_vectored_small_records,
+	&bench_io_ring_batching,
+	&bench_terminal_throughput,
+	&bench_console_writers,
+	&bench_terminal_lines,
+	&bench_uneven_terminal_input,
+	&bench_all_terminals,
+	&bench_many_small_threads,
+	&bench_alarm_latency,
+	NULL
+};
+
+
+
 /*********************************************
  *
  *
@@ -2613,6 +5359,8 @@ int main(int argc, char** argv)
 {
 	register_test(&all_tests);
 	register_test(&user_tests);
+	register_test(&benchmark_tests);
+	register_test(&io_tests);
 	return run_program(argc, argv, &all_tests);
 }
 